@@ -0,0 +1,182 @@
+/**
+* @file dbg.c
+* @author rigensen
+* @brief  async logger, every thread formats into its own ring, one
+*         flusher thread drains all rings to stdout
+* @date 六 10/26 09:12:40 2019
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "dbg.h"
+
+#define DBG_RING_SLOTS 64 /* power of 2 */
+#define DBG_LINE_MAX 256
+#define DBG_FLUSH_INTERVAL_US (20*1000)
+
+/*
+ * single producer(the owner thread) single consumer(the flusher), head
+ * and tail only ever grow. a full ring drops the line instead of waiting
+ */
+typedef struct dbg_ring {
+    struct dbg_ring *next;
+    unsigned int head;
+    unsigned int tail;
+    unsigned int dropped;
+    int dead; /* owner exited, freed after the last drain */
+    unsigned short len[DBG_RING_SLOTS];
+    char line[DBG_RING_SLOTS][DBG_LINE_MAX];
+} dbg_ring_t;
+
+int dbg_level = DBG_COMPILE_LEVEL;
+
+static dbg_ring_t *g_rings;
+static pthread_mutex_t g_rings_mutex = PTHREAD_MUTEX_INITIALIZER; /* ring list and the consumer side */
+static pthread_once_t g_once = PTHREAD_ONCE_INIT;
+static pthread_key_t g_ring_key;
+static int g_async;
+static __thread dbg_ring_t *t_ring;
+
+static const char *g_prefix[] = {
+    [DBG_LEVEL_ERROR] = RED"| ERROR | %s:%d(%s)# "NONE,
+    [DBG_LEVEL_INFO] = "| INFO | %s:%d(%s)# "NONE,
+    [DBG_LEVEL_DEBUG] = "| DEBUG | %s:%d(%s)# "NONE,
+};
+
+static void ring_release(void *arg)
+{
+    __atomic_store_n(&((dbg_ring_t *)arg)->dead, 1, __ATOMIC_RELEASE);
+}
+
+/* g_rings_mutex held */
+static void drain_ring(dbg_ring_t *ring)
+{
+    unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    unsigned int tail = ring->tail, dropped = 0;
+
+    for (; tail != head; tail++) {
+        unsigned int i = tail & (DBG_RING_SLOTS-1);
+
+        fwrite(ring->line[i], ring->len[i], 1, stdout);
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+    if (dropped)
+        printf("| DEBUG | %u log lines dropped\n", dropped);
+}
+
+void dbg_flush(void)
+{
+    dbg_ring_t **pp = NULL, *ring = NULL;
+    int dead = 0;
+
+    pthread_mutex_lock(&g_rings_mutex);
+    for (pp = &g_rings; (ring = *pp) != NULL; ) {
+        /* read dead first, a dead ring gets no more lines after this drain */
+        dead = __atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE);
+        drain_ring(ring);
+        if (dead) {
+            *pp = ring->next;
+            free(ring);
+            continue;
+        }
+        pp = &ring->next;
+    }
+    fflush(stdout);
+    pthread_mutex_unlock(&g_rings_mutex);
+}
+
+static void *flush_thread(void *arg)
+{
+    (void)arg;
+
+    for (;;) {
+        dbg_flush();
+        usleep(DBG_FLUSH_INTERVAL_US);
+    }
+    return NULL;
+}
+
+static void dbg_init(void)
+{
+    pthread_t tid;
+
+    if (pthread_key_create(&g_ring_key, ring_release) != 0)
+        return;
+    if (pthread_create(&tid, NULL, flush_thread, NULL) != 0)
+        return;
+    pthread_detach(tid);
+    atexit(dbg_flush);
+    g_async = 1;
+}
+
+/* NULL means log synchronously */
+static dbg_ring_t *get_ring(void)
+{
+    if (t_ring)
+        return t_ring;
+    pthread_once(&g_once, dbg_init);
+    if (!g_async)
+        return NULL;
+    if ( (t_ring = (dbg_ring_t *)calloc(1, sizeof(dbg_ring_t))) == NULL )
+        return NULL;
+    pthread_setspecific(g_ring_key, t_ring);
+    pthread_mutex_lock(&g_rings_mutex);
+    t_ring->next = g_rings;
+    g_rings = t_ring;
+    pthread_mutex_unlock(&g_rings_mutex);
+    return t_ring;
+}
+
+void dbg_set_level(int level)
+{
+    if (level < DBG_LEVEL_ERROR)
+        level = DBG_LEVEL_ERROR;
+    if (level > DBG_LEVEL_DEBUG)
+        level = DBG_LEVEL_DEBUG;
+    __atomic_store_n(&dbg_level, level, __ATOMIC_RELAXED);
+}
+
+void dbg_log(int level, const char *file, int line, const char *func, const char *fmt, ...)
+{
+    dbg_ring_t *ring = get_ring();
+    char buf[DBG_LINE_MAX];
+    char *dst = buf;
+    unsigned int head = 0;
+    int n = 0, m = 0;
+    va_list ap;
+
+    if (level < DBG_LEVEL_ERROR || level > DBG_LEVEL_DEBUG)
+        level = DBG_LEVEL_DEBUG;
+    if (ring) {
+        head = ring->head;
+        if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= DBG_RING_SLOTS) {
+            __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        dst = ring->line[head & (DBG_RING_SLOTS-1)];
+    }
+    /* always room left for the '\n' */
+    n = snprintf(dst, DBG_LINE_MAX-1, g_prefix[level], file, line, func);
+    if (n < 0)
+        n = 0;
+    if (n > DBG_LINE_MAX-2)
+        n = DBG_LINE_MAX-2;
+    va_start(ap, fmt);
+    m = vsnprintf(dst+n, DBG_LINE_MAX-1-n, fmt, ap);
+    va_end(ap);
+    if (m < 0)
+        m = 0;
+    if (m > DBG_LINE_MAX-2-n)
+        m = DBG_LINE_MAX-2-n;
+    dst[n+m] = '\n';
+    if (!ring) {
+        fwrite(dst, n+m+1, 1, stdout);
+        return;
+    }
+    ring->len[head & (DBG_RING_SLOTS-1)] = (unsigned short)(n+m+1);
+    __atomic_store_n(&ring->head, head+1, __ATOMIC_RELEASE);
+}
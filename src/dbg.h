@@ -1,7 +1,9 @@
 /**
 * @file dbg.h
 * @author rigensen
-* @brief 
+* @brief  level filtered logging, lines go to a per thread ring and a
+*         background thread writes them out, so callers never block
+*         on the console
 * @date 五 10/18 10:40:49 2019
 */
 
@@ -16,17 +18,33 @@
     #define __FILE_NAME__ __FILE__
 #endif
 
-#define LOGE( args...) do { \
-    printf( RED"| ERROR | %s:%d(%s)# "NONE, __FILE_NAME__, __LINE__, __FUNCTION__); \
-    printf(args); \
-    printf("\n"); \
-} while(0)
+enum {
+    DBG_LEVEL_ERROR = 0,
+    DBG_LEVEL_INFO,
+    DBG_LEVEL_DEBUG,
+};
+
+/* levels above this are compiled out, -DDBG_COMPILE_LEVEL=2 for LOGD */
+#ifndef DBG_COMPILE_LEVEL
+#define DBG_COMPILE_LEVEL DBG_LEVEL_INFO
+#endif
 
-#define LOGI( args...) do { \
-    printf( "| INFO | %s:%d(%s)# "NONE, __FILE_NAME__, __LINE__, __FUNCTION__); \
-    printf(args); \
-    printf("\n"); \
+extern int dbg_level;
+extern void dbg_set_level(int level);
+/* write out everything queued so far, e.g. before exit or abort */
+extern void dbg_flush(void);
+extern void dbg_log(int level, const char *file, int line, const char *func, const char *fmt, ...)
+    __attribute__((format(printf, 5, 6)));
+
+#define DBG_LOG(level, args...) do { \
+    if ( (level) <= DBG_COMPILE_LEVEL && (level) <= dbg_level ) \
+        dbg_log( (level), __FILE_NAME__, __LINE__, __FUNCTION__, args ); \
 } while(0)
 
+#define LOGE( args...) DBG_LOG(DBG_LEVEL_ERROR, args)
+#define LOGI( args...) DBG_LOG(DBG_LEVEL_INFO, args)
+/* hot paths: per probe, per slice, per ioctl */
+#define LOGD( args...) DBG_LOG(DBG_LEVEL_DEBUG, args)
+
 #define _DBG_H
 #endif
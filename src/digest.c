@@ -0,0 +1,234 @@
+/**
+* @file digest.c
+* @author rigensen
+* @brief  md5 for old apps, crc32c(sse4.2/armv8 crc instructions when
+*         available) and xxhash32 for cheap integrity checks
+* @date 五 10/25 11:02:37 2019
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <pthread.h>
+#include "md5.h"
+#include "digest.h"
+#include "dbg.h"
+#include "public.h"
+
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define DIGEST_X86_CRC32C
+#endif
+
+#define CRC32C_POLY 0x82f63b78 /* reflected castagnoli */
+
+static uint32_t g_crc32c_table[8][256];
+static pthread_once_t g_crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init_table()
+{
+    uint32_t crc = 0;
+    int i = 0, j = 0;
+
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (j = 0; j < 8; j++)
+            crc = (crc >> 1) ^ (CRC32C_POLY & (0 - (crc & 1)));
+        g_crc32c_table[0][i] = crc;
+    }
+    for (i = 0; i < 256; i++) {
+        crc = g_crc32c_table[0][i];
+        for (j = 1; j < 8; j++) {
+            crc = g_crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+            g_crc32c_table[j][i] = crc;
+        }
+    }
+}
+
+/* slicing by 8, for cores without crc instructions(e.g. cortex-a7) */
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    pthread_once(&g_crc32c_once, crc32c_init_table);
+    while (len && ((uintptr_t)buf & 7)) {
+        crc = g_crc32c_table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    while (len >= 8) {
+        uint32_t lo = 0, hi = 0;
+
+        memcpy(&lo, buf, 4);
+        memcpy(&hi, buf+4, 4);
+        lo ^= crc;
+        crc = g_crc32c_table[7][lo & 0xff] ^ g_crc32c_table[6][(lo >> 8) & 0xff]
+            ^ g_crc32c_table[5][(lo >> 16) & 0xff] ^ g_crc32c_table[4][lo >> 24]
+            ^ g_crc32c_table[3][hi & 0xff] ^ g_crc32c_table[2][(hi >> 8) & 0xff]
+            ^ g_crc32c_table[1][(hi >> 16) & 0xff] ^ g_crc32c_table[0][hi >> 24];
+        buf += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = g_crc32c_table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    uint64_t v = 0;
+
+    while (len && ((uintptr_t)buf & 7)) {
+        crc = __crc32cb(crc, *buf++);
+        len--;
+    }
+    while (len >= 8) {
+        memcpy(&v, buf, 8);
+        crc = __crc32cd(crc, v);
+        buf += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = __crc32cb(crc, *buf++);
+    return crc;
+}
+#elif defined(DIGEST_X86_CRC32C)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    uint64_t crc64 = crc, v = 0;
+
+    while (len && ((uintptr_t)buf & 7)) {
+        crc64 = _mm_crc32_u8((uint32_t)crc64, *buf++);
+        len--;
+    }
+    while (len >= 8) {
+        memcpy(&v, buf, 8);
+        crc64 = _mm_crc32_u64(crc64, v);
+        buf += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc64 = _mm_crc32_u8((uint32_t)crc64, *buf++);
+    return (uint32_t)crc64;
+}
+#endif
+
+uint32_t digest_crc32c(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    crc = ~crc;
+#if defined(__ARM_FEATURE_CRC32)
+    crc = crc32c_hw(crc, buf, len);
+#elif defined(DIGEST_X86_CRC32C)
+    if (__builtin_cpu_supports("sse4.2"))
+        crc = crc32c_hw(crc, buf, len);
+    else
+        crc = crc32c_sw(crc, buf, len);
+#else
+    crc = crc32c_sw(crc, buf, len);
+#endif
+    return ~crc;
+}
+
+#define XXH_PRIME32_1 0x9E3779B1U
+#define XXH_PRIME32_2 0x85EBCA77U
+#define XXH_PRIME32_3 0xC2B2AE3DU
+#define XXH_PRIME32_4 0x27D4EB2FU
+#define XXH_PRIME32_5 0x165667B1U
+#define XXH_ROTL(x, r) (((x) << (r)) | ((x) >> (32 - (r))))
+
+static inline uint32_t xxh_read32(const uint8_t *p)
+{
+    uint32_t v = 0;
+
+    memcpy(&v, p, 4);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+static inline uint32_t xxh_round(uint32_t acc, uint32_t input)
+{
+    acc += input * XXH_PRIME32_2;
+    acc = XXH_ROTL(acc, 13);
+    return acc * XXH_PRIME32_1;
+}
+
+uint32_t digest_xxh32(const uint8_t *buf, size_t len, uint32_t seed)
+{
+    const uint8_t *end = buf + len;
+    uint32_t h = 0;
+
+    if (len >= 16) {
+        const uint8_t *limit = end - 16;
+        uint32_t v1 = seed + XXH_PRIME32_1 + XXH_PRIME32_2;
+        uint32_t v2 = seed + XXH_PRIME32_2;
+        uint32_t v3 = seed;
+        uint32_t v4 = seed - XXH_PRIME32_1;
+
+        do {
+            v1 = xxh_round(v1, xxh_read32(buf));
+            v2 = xxh_round(v2, xxh_read32(buf+4));
+            v3 = xxh_round(v3, xxh_read32(buf+8));
+            v4 = xxh_round(v4, xxh_read32(buf+12));
+            buf += 16;
+        } while (buf <= limit);
+        h = XXH_ROTL(v1, 1) + XXH_ROTL(v2, 7) + XXH_ROTL(v3, 12) + XXH_ROTL(v4, 18);
+    } else {
+        h = seed + XXH_PRIME32_5;
+    }
+    h += (uint32_t)len;
+    while (buf + 4 <= end) {
+        h += xxh_read32(buf) * XXH_PRIME32_3;
+        h = XXH_ROTL(h, 17) * XXH_PRIME32_4;
+        buf += 4;
+    }
+    while (buf < end) {
+        h += (*buf++) * XXH_PRIME32_5;
+        h = XXH_ROTL(h, 11) * XXH_PRIME32_1;
+    }
+    h ^= h >> 15;
+    h *= XXH_PRIME32_2;
+    h ^= h >> 13;
+    h *= XXH_PRIME32_3;
+    h ^= h >> 16;
+    return h;
+}
+
+int digest_supported(int algo)
+{
+    return algo >= 0 && algo < DIGEST_NUM;
+}
+
+int digest_calc(int algo, const uint8_t *inbuf, size_t inlen, char *out)
+{
+    MD5_CONTEXT ctx;
+    int i = 0;
+
+    ASSERT( inbuf );
+    ASSERT( out );
+
+    switch (algo) {
+    case DIGEST_MD5:
+        md5_init(&ctx);
+        md5_write(&ctx, (unsigned char *)inbuf, inlen);
+        md5_final(&ctx);
+        for (i = 0; i < 16; ++i)
+            sprintf(out + i*2, "%02x", ctx.buf[i]);
+        break;
+    case DIGEST_CRC32C:
+        sprintf(out, "%08x", digest_crc32c(0, inbuf, inlen));
+        break;
+    case DIGEST_XXH32:
+        sprintf(out, "%08x", digest_xxh32(inbuf, inlen, 0));
+        break;
+    default:
+        LOGE("unsupported digest %d", algo);
+        return -ERRINVAL;
+    }
+
+    return 0;
+}
@@ -0,0 +1,31 @@
+/**
+* @file digest.h
+* @author rigensen
+* @brief  slice integrity digests, the algorithm is negotiated per
+*         playback and advertised in the frame header
+* @date 五 10/25 11:02:37 2019
+*/
+
+#ifndef _DIGEST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* values go on the wire, 0 must stay md5 for old apps */
+enum {
+    DIGEST_MD5 = 0,
+    DIGEST_CRC32C = 1,
+    DIGEST_XXH32 = 2,
+    DIGEST_NUM,
+};
+
+#define DIGEST_STR_LEN 33 /* md5 hex + '\0', the longest one */
+
+extern int digest_supported(int algo);
+/* hex string of the digest into out, at least DIGEST_STR_LEN bytes */
+extern int digest_calc(int algo, const uint8_t *inbuf, size_t inlen, char *out);
+extern uint32_t digest_crc32c(uint32_t crc, const uint8_t *buf, size_t len);
+extern uint32_t digest_xxh32(const uint8_t *buf, size_t len, uint32_t seed);
+
+#define _DIGEST_H
+#endif
@@ -65,45 +65,56 @@ md5_init( MD5_CONTEXT *ctx )
 
 
 
+#if defined(__GNUC__)
+typedef u32 __attribute__((__may_alias__)) u32_alias;
+#else
+typedef u32 u32_alias;
+#endif
+
 /****************
  * transform n*64 bytes
+ * aligned little endian input is read in place, the chaining
+ * variables stay in registers across blocks
  */
-void
-transform( MD5_CONTEXT *ctx, unsigned char *data )
+static void
+transform( MD5_CONTEXT *ctx, const unsigned char *data, size_t nblocks )
 {
     u32 correct_words[16];
     u32 A = ctx->A;
     u32 B = ctx->B;
     u32 C = ctx->C;
     u32 D = ctx->D;
-    u32 *cwp = correct_words;
+    const u32 *X;
 
+    for( ; nblocks; nblocks--, data += 64 ) {
+	u32 AA = A, BB = B, CC = C, DD = D;
 
 #ifdef BIG_ENDIAN_HOST
-    { int i;
-      unsigned char *p2, *p1;
-      for(i=0, p1=data, p2=(unsigned char*)correct_words; i < 16; i++, p2 += 4 ) {
-	p2[3] = *p1++;
-	p2[2] = *p1++;
-	p2[1] = *p1++;
-	p2[0] = *p1++;
-      }
-    }
+	{ int i;
+	  for(i=0; i < 16; i++ ) {
+	    memcpy( &correct_words[i], data + i*4, 4 );
+	    correct_words[i] = __builtin_bswap32( correct_words[i] );
+	  }
+	}
+	X = correct_words;
 #else
-    memcpy( correct_words, data, 64 );
+	if( ((size_t)data & 3) == 0 )
+	    X = (const u32_alias *)data;
+	else {
+	    memcpy( correct_words, data, 64 );
+	    X = correct_words;
+	}
 #endif
 
 
-
-
-#define OP(a, b, c, d, s, T)					    \
-  do								    \
-    {								    \
-      a += FF (b, c, d) + (*cwp++) + T; 	    \
-      a = rol(a, s);						    \
-      a += b;							    \
-    }								    \
-  while (0)
+#define OP(f, a, b, c, d, k, s, T)  \
+    do								      \
+      { 							      \
+	a += f (b, c, d) + X[k] + T;		      \
+	a = rol(a, s);						      \
+	a += b; 						      \
+      } 							      \
+    while (0)
 
 
     /* Before we start, one word about the strange constants.
@@ -112,98 +123,94 @@ transform( MD5_CONTEXT *ctx, unsigned char *data )
      */
 
 
-    /* Round 1.  */
-    OP (A, B, C, D,  7, 0xd76aa478);
-    OP (D, A, B, C, 12, 0xe8c7b756);
-    OP (C, D, A, B, 17, 0x242070db);
-    OP (B, C, D, A, 22, 0xc1bdceee);
-    OP (A, B, C, D,  7, 0xf57c0faf);
-    OP (D, A, B, C, 12, 0x4787c62a);
-    OP (C, D, A, B, 17, 0xa8304613);
-    OP (B, C, D, A, 22, 0xfd469501);
-    OP (A, B, C, D,  7, 0x698098d8);
-    OP (D, A, B, C, 12, 0x8b44f7af);
-    OP (C, D, A, B, 17, 0xffff5bb1);
-    OP (B, C, D, A, 22, 0x895cd7be);
-    OP (A, B, C, D,  7, 0x6b901122);
-    OP (D, A, B, C, 12, 0xfd987193);
-    OP (C, D, A, B, 17, 0xa679438e);
-    OP (B, C, D, A, 22, 0x49b40821);
-
+	/* Round 1.  */
+	OP (FF, A, B, C, D,  0,  7, 0xd76aa478);
+	OP (FF, D, A, B, C,  1, 12, 0xe8c7b756);
+	OP (FF, C, D, A, B,  2, 17, 0x242070db);
+	OP (FF, B, C, D, A,  3, 22, 0xc1bdceee);
+	OP (FF, A, B, C, D,  4,  7, 0xf57c0faf);
+	OP (FF, D, A, B, C,  5, 12, 0x4787c62a);
+	OP (FF, C, D, A, B,  6, 17, 0xa8304613);
+	OP (FF, B, C, D, A,  7, 22, 0xfd469501);
+	OP (FF, A, B, C, D,  8,  7, 0x698098d8);
+	OP (FF, D, A, B, C,  9, 12, 0x8b44f7af);
+	OP (FF, C, D, A, B, 10, 17, 0xffff5bb1);
+	OP (FF, B, C, D, A, 11, 22, 0x895cd7be);
+	OP (FF, A, B, C, D, 12,  7, 0x6b901122);
+	OP (FF, D, A, B, C, 13, 12, 0xfd987193);
+	OP (FF, C, D, A, B, 14, 17, 0xa679438e);
+	OP (FF, B, C, D, A, 15, 22, 0x49b40821);
+
+
+	/* Round 2.  */
+	OP (FG, A, B, C, D,  1,  5, 0xf61e2562);
+	OP (FG, D, A, B, C,  6,  9, 0xc040b340);
+	OP (FG, C, D, A, B, 11, 14, 0x265e5a51);
+	OP (FG, B, C, D, A,  0, 20, 0xe9b6c7aa);
+	OP (FG, A, B, C, D,  5,  5, 0xd62f105d);
+	OP (FG, D, A, B, C, 10,  9, 0x02441453);
+	OP (FG, C, D, A, B, 15, 14, 0xd8a1e681);
+	OP (FG, B, C, D, A,  4, 20, 0xe7d3fbc8);
+	OP (FG, A, B, C, D,  9,  5, 0x21e1cde6);
+	OP (FG, D, A, B, C, 14,  9, 0xc33707d6);
+	OP (FG, C, D, A, B,  3, 14, 0xf4d50d87);
+	OP (FG, B, C, D, A,  8, 20, 0x455a14ed);
+	OP (FG, A, B, C, D, 13,  5, 0xa9e3e905);
+	OP (FG, D, A, B, C,  2,  9, 0xfcefa3f8);
+	OP (FG, C, D, A, B,  7, 14, 0x676f02d9);
+	OP (FG, B, C, D, A, 12, 20, 0x8d2a4c8a);
+
+
+	/* Round 3.  */
+	OP (FH, A, B, C, D,  5,  4, 0xfffa3942);
+	OP (FH, D, A, B, C,  8, 11, 0x8771f681);
+	OP (FH, C, D, A, B, 11, 16, 0x6d9d6122);
+	OP (FH, B, C, D, A, 14, 23, 0xfde5380c);
+	OP (FH, A, B, C, D,  1,  4, 0xa4beea44);
+	OP (FH, D, A, B, C,  4, 11, 0x4bdecfa9);
+	OP (FH, C, D, A, B,  7, 16, 0xf6bb4b60);
+	OP (FH, B, C, D, A, 10, 23, 0xbebfbc70);
+	OP (FH, A, B, C, D, 13,  4, 0x289b7ec6);
+	OP (FH, D, A, B, C,  0, 11, 0xeaa127fa);
+	OP (FH, C, D, A, B,  3, 16, 0xd4ef3085);
+	OP (FH, B, C, D, A,  6, 23, 0x04881d05);
+	OP (FH, A, B, C, D,  9,  4, 0xd9d4d039);
+	OP (FH, D, A, B, C, 12, 11, 0xe6db99e5);
+	OP (FH, C, D, A, B, 15, 16, 0x1fa27cf8);
+	OP (FH, B, C, D, A,  2, 23, 0xc4ac5665);
+
+
+	/* Round 4.  */
+	OP (FI, A, B, C, D,  0,  6, 0xf4292244);
+	OP (FI, D, A, B, C,  7, 10, 0x432aff97);
+	OP (FI, C, D, A, B, 14, 15, 0xab9423a7);
+	OP (FI, B, C, D, A,  5, 21, 0xfc93a039);
+	OP (FI, A, B, C, D, 12,  6, 0x655b59c3);
+	OP (FI, D, A, B, C,  3, 10, 0x8f0ccc92);
+	OP (FI, C, D, A, B, 10, 15, 0xffeff47d);
+	OP (FI, B, C, D, A,  1, 21, 0x85845dd1);
+	OP (FI, A, B, C, D,  8,  6, 0x6fa87e4f);
+	OP (FI, D, A, B, C, 15, 10, 0xfe2ce6e0);
+	OP (FI, C, D, A, B,  6, 15, 0xa3014314);
+	OP (FI, B, C, D, A, 13, 21, 0x4e0811a1);
+	OP (FI, A, B, C, D,  4,  6, 0xf7537e82);
+	OP (FI, D, A, B, C, 11, 10, 0xbd3af235);
+	OP (FI, C, D, A, B,  2, 15, 0x2ad7d2bb);
+	OP (FI, B, C, D, A,  9, 21, 0xeb86d391);
 
 #undef OP
-#define OP(f, a, b, c, d, k, s, T)  \
-    do								      \
-      { 							      \
-	a += f (b, c, d) + correct_words[k] + T;		      \
-	a = rol(a, s);						      \
-	a += b; 						      \
-      } 							      \
-    while (0)
-
-
-    /* Round 2.  */
-    OP (FG, A, B, C, D,  1,  5, 0xf61e2562);
-    OP (FG, D, A, B, C,  6,  9, 0xc040b340);
-    OP (FG, C, D, A, B, 11, 14, 0x265e5a51);
-    OP (FG, B, C, D, A,  0, 20, 0xe9b6c7aa);
-    OP (FG, A, B, C, D,  5,  5, 0xd62f105d);
-    OP (FG, D, A, B, C, 10,  9, 0x02441453);
-    OP (FG, C, D, A, B, 15, 14, 0xd8a1e681);
-    OP (FG, B, C, D, A,  4, 20, 0xe7d3fbc8);
-    OP (FG, A, B, C, D,  9,  5, 0x21e1cde6);
-    OP (FG, D, A, B, C, 14,  9, 0xc33707d6);
-    OP (FG, C, D, A, B,  3, 14, 0xf4d50d87);
-    OP (FG, B, C, D, A,  8, 20, 0x455a14ed);
-    OP (FG, A, B, C, D, 13,  5, 0xa9e3e905);
-    OP (FG, D, A, B, C,  2,  9, 0xfcefa3f8);
-    OP (FG, C, D, A, B,  7, 14, 0x676f02d9);
-    OP (FG, B, C, D, A, 12, 20, 0x8d2a4c8a);
-
-
-    /* Round 3.  */
-    OP (FH, A, B, C, D,  5,  4, 0xfffa3942);
-    OP (FH, D, A, B, C,  8, 11, 0x8771f681);
-    OP (FH, C, D, A, B, 11, 16, 0x6d9d6122);
-    OP (FH, B, C, D, A, 14, 23, 0xfde5380c);
-    OP (FH, A, B, C, D,  1,  4, 0xa4beea44);
-    OP (FH, D, A, B, C,  4, 11, 0x4bdecfa9);
-    OP (FH, C, D, A, B,  7, 16, 0xf6bb4b60);
-    OP (FH, B, C, D, A, 10, 23, 0xbebfbc70);
-    OP (FH, A, B, C, D, 13,  4, 0x289b7ec6);
-    OP (FH, D, A, B, C,  0, 11, 0xeaa127fa);
-    OP (FH, C, D, A, B,  3, 16, 0xd4ef3085);
-    OP (FH, B, C, D, A,  6, 23, 0x04881d05);
-    OP (FH, A, B, C, D,  9,  4, 0xd9d4d039);
-    OP (FH, D, A, B, C, 12, 11, 0xe6db99e5);
-    OP (FH, C, D, A, B, 15, 16, 0x1fa27cf8);
-    OP (FH, B, C, D, A,  2, 23, 0xc4ac5665);
-
-
-    /* Round 4.  */
-    OP (FI, A, B, C, D,  0,  6, 0xf4292244);
-    OP (FI, D, A, B, C,  7, 10, 0x432aff97);
-    OP (FI, C, D, A, B, 14, 15, 0xab9423a7);
-    OP (FI, B, C, D, A,  5, 21, 0xfc93a039);
-    OP (FI, A, B, C, D, 12,  6, 0x655b59c3);
-    OP (FI, D, A, B, C,  3, 10, 0x8f0ccc92);
-    OP (FI, C, D, A, B, 10, 15, 0xffeff47d);
-    OP (FI, B, C, D, A,  1, 21, 0x85845dd1);
-    OP (FI, A, B, C, D,  8,  6, 0x6fa87e4f);
-    OP (FI, D, A, B, C, 15, 10, 0xfe2ce6e0);
-    OP (FI, C, D, A, B,  6, 15, 0xa3014314);
-    OP (FI, B, C, D, A, 13, 21, 0x4e0811a1);
-    OP (FI, A, B, C, D,  4,  6, 0xf7537e82);
-    OP (FI, D, A, B, C, 11, 10, 0xbd3af235);
-    OP (FI, C, D, A, B,  2, 15, 0x2ad7d2bb);
-    OP (FI, B, C, D, A,  9, 21, 0xeb86d391);
 
+	A += AA;
+	B += BB;
+	C += CC;
+	D += DD;
+    }
 
     /* Put checksum in context given as argument.  */
-    ctx->A += A;
-    ctx->B += B;
-    ctx->C += C;
-    ctx->D += D;
+    ctx->A = A;
+    ctx->B = B;
+    ctx->C = C;
+    ctx->D = D;
 }
 
 
@@ -218,35 +225,219 @@ transform( MD5_CONTEXT *ctx, unsigned char *data )
 void
 md5_write( MD5_CONTEXT *hd, unsigned char *inbuf, size_t inlen)
 {
+    size_t n;
+
     if( hd->count == 64 ) { /* flush the buffer */
-	transform( hd, hd->buf );
+	transform( hd, hd->buf, 1 );
 	hd->count = 0;
 	hd->nblocks++;
     }
     if( !inbuf )
 	return;
     if( hd->count ) {
-	for( ; inlen && hd->count < 64; inlen-- )
-	    hd->buf[hd->count++] = *inbuf++;
+	n = 64 - hd->count;
+	if( n > inlen )
+	    n = inlen;
+	memcpy( hd->buf + hd->count, inbuf, n );
+	hd->count += n;
+	inbuf += n;
+	inlen -= n;
 	md5_write( hd, NULL, 0 );
 	if( !inlen )
 	    return;
     }
 
+    if( inlen >= 64 ) {
+	n = inlen / 64;
+	transform( hd, inbuf, n );
+	hd->nblocks += n;
+	inbuf += n * 64;
+	inlen -= n * 64;
+    }
+    memcpy( hd->buf, inbuf, inlen );
+    hd->count = inlen;
+}
+
 
-    while( inlen >= 64 ) {
-	transform( hd, inbuf );
-	hd->count = 0;
-	hd->nblocks++;
-	inlen -= 64;
-	inbuf += 64;
+
+#if defined(__GNUC__) && !defined(BIG_ENDIAN_HOST)
+/****************
+ * 4 buffers in the lanes of one 128 bit vector, gcc/clang turn the
+ * vector extension into neon on arm and sse2 on x86
+ */
+typedef u32 v4u32 __attribute__((vector_size(16)));
+
+#define VROL(x,n) ( ((x) << (n)) | ((x) >> (32-(n))) )
+
+static void
+transform_x4( v4u32 *state, const unsigned char **data, size_t nblocks )
+{
+    v4u32 A = state[0];
+    v4u32 B = state[1];
+    v4u32 C = state[2];
+    v4u32 D = state[3];
+    v4u32 X[16];
+    size_t off;
+    int k;
+
+    for( off = 0; nblocks; nblocks--, off += 64 ) {
+	v4u32 AA = A, BB = B, CC = C, DD = D;
+
+	for( k = 0; k < 16; k++ ) {
+	    u32 w0, w1, w2, w3;
+
+	    memcpy( &w0, data[0] + off + k*4, 4 );
+	    memcpy( &w1, data[1] + off + k*4, 4 );
+	    memcpy( &w2, data[2] + off + k*4, 4 );
+	    memcpy( &w3, data[3] + off + k*4, 4 );
+	    X[k] = (v4u32){ w0, w1, w2, w3 };
+	}
+
+#define OP(f, a, b, c, d, k, s, T)  \
+    do								      \
+      { 							      \
+	a += f (b, c, d) + X[k] + T;		      \
+	a = VROL(a, s);						      \
+	a += b; 						      \
+      } 							      \
+    while (0)
+
+	OP (FF, A, B, C, D,  0,  7, 0xd76aa478);
+	OP (FF, D, A, B, C,  1, 12, 0xe8c7b756);
+	OP (FF, C, D, A, B,  2, 17, 0x242070db);
+	OP (FF, B, C, D, A,  3, 22, 0xc1bdceee);
+	OP (FF, A, B, C, D,  4,  7, 0xf57c0faf);
+	OP (FF, D, A, B, C,  5, 12, 0x4787c62a);
+	OP (FF, C, D, A, B,  6, 17, 0xa8304613);
+	OP (FF, B, C, D, A,  7, 22, 0xfd469501);
+	OP (FF, A, B, C, D,  8,  7, 0x698098d8);
+	OP (FF, D, A, B, C,  9, 12, 0x8b44f7af);
+	OP (FF, C, D, A, B, 10, 17, 0xffff5bb1);
+	OP (FF, B, C, D, A, 11, 22, 0x895cd7be);
+	OP (FF, A, B, C, D, 12,  7, 0x6b901122);
+	OP (FF, D, A, B, C, 13, 12, 0xfd987193);
+	OP (FF, C, D, A, B, 14, 17, 0xa679438e);
+	OP (FF, B, C, D, A, 15, 22, 0x49b40821);
+
+	OP (FG, A, B, C, D,  1,  5, 0xf61e2562);
+	OP (FG, D, A, B, C,  6,  9, 0xc040b340);
+	OP (FG, C, D, A, B, 11, 14, 0x265e5a51);
+	OP (FG, B, C, D, A,  0, 20, 0xe9b6c7aa);
+	OP (FG, A, B, C, D,  5,  5, 0xd62f105d);
+	OP (FG, D, A, B, C, 10,  9, 0x02441453);
+	OP (FG, C, D, A, B, 15, 14, 0xd8a1e681);
+	OP (FG, B, C, D, A,  4, 20, 0xe7d3fbc8);
+	OP (FG, A, B, C, D,  9,  5, 0x21e1cde6);
+	OP (FG, D, A, B, C, 14,  9, 0xc33707d6);
+	OP (FG, C, D, A, B,  3, 14, 0xf4d50d87);
+	OP (FG, B, C, D, A,  8, 20, 0x455a14ed);
+	OP (FG, A, B, C, D, 13,  5, 0xa9e3e905);
+	OP (FG, D, A, B, C,  2,  9, 0xfcefa3f8);
+	OP (FG, C, D, A, B,  7, 14, 0x676f02d9);
+	OP (FG, B, C, D, A, 12, 20, 0x8d2a4c8a);
+
+	OP (FH, A, B, C, D,  5,  4, 0xfffa3942);
+	OP (FH, D, A, B, C,  8, 11, 0x8771f681);
+	OP (FH, C, D, A, B, 11, 16, 0x6d9d6122);
+	OP (FH, B, C, D, A, 14, 23, 0xfde5380c);
+	OP (FH, A, B, C, D,  1,  4, 0xa4beea44);
+	OP (FH, D, A, B, C,  4, 11, 0x4bdecfa9);
+	OP (FH, C, D, A, B,  7, 16, 0xf6bb4b60);
+	OP (FH, B, C, D, A, 10, 23, 0xbebfbc70);
+	OP (FH, A, B, C, D, 13,  4, 0x289b7ec6);
+	OP (FH, D, A, B, C,  0, 11, 0xeaa127fa);
+	OP (FH, C, D, A, B,  3, 16, 0xd4ef3085);
+	OP (FH, B, C, D, A,  6, 23, 0x04881d05);
+	OP (FH, A, B, C, D,  9,  4, 0xd9d4d039);
+	OP (FH, D, A, B, C, 12, 11, 0xe6db99e5);
+	OP (FH, C, D, A, B, 15, 16, 0x1fa27cf8);
+	OP (FH, B, C, D, A,  2, 23, 0xc4ac5665);
+
+	OP (FI, A, B, C, D,  0,  6, 0xf4292244);
+	OP (FI, D, A, B, C,  7, 10, 0x432aff97);
+	OP (FI, C, D, A, B, 14, 15, 0xab9423a7);
+	OP (FI, B, C, D, A,  5, 21, 0xfc93a039);
+	OP (FI, A, B, C, D, 12,  6, 0x655b59c3);
+	OP (FI, D, A, B, C,  3, 10, 0x8f0ccc92);
+	OP (FI, C, D, A, B, 10, 15, 0xffeff47d);
+	OP (FI, B, C, D, A,  1, 21, 0x85845dd1);
+	OP (FI, A, B, C, D,  8,  6, 0x6fa87e4f);
+	OP (FI, D, A, B, C, 15, 10, 0xfe2ce6e0);
+	OP (FI, C, D, A, B,  6, 15, 0xa3014314);
+	OP (FI, B, C, D, A, 13, 21, 0x4e0811a1);
+	OP (FI, A, B, C, D,  4,  6, 0xf7537e82);
+	OP (FI, D, A, B, C, 11, 10, 0xbd3af235);
+	OP (FI, C, D, A, B,  2, 15, 0x2ad7d2bb);
+	OP (FI, B, C, D, A,  9, 21, 0xeb86d391);
+
+#undef OP
+
+	A += AA;
+	B += BB;
+	C += CC;
+	D += DD;
     }
-    for( ; inlen && hd->count < 64; inlen-- )
-	hd->buf[hd->count++] = *inbuf++;
+    state[0] = A;
+    state[1] = B;
+    state[2] = C;
+    state[3] = D;
 }
+#endif
 
 
 
+/* The whole blocks all lanes have in common run in lockstep, each
+ * lane finishes its own tail with the scalar code.  Slices saved by
+ * one camera have about the same size, so most of the work is shared.
+ */
+void
+md5_multi( const unsigned char **inbuf, const size_t *inlen,
+           unsigned char (*out)[16], int n )
+{
+    MD5_CONTEXT ctx[4];
+    int i, l, lanes;
+    size_t common;
+
+    for( i = 0; i < n; i += lanes ) {
+	lanes = n - i < 4 ? n - i : 4;
+	common = 0;
+	for( l = 0; l < lanes; l++ ) {
+	    md5_init( &ctx[l] );
+	    if( !l || inlen[i+l] / 64 < common )
+		common = inlen[i+l] / 64;
+	}
+#if defined(__GNUC__) && !defined(BIG_ENDIAN_HOST)
+	if( lanes > 1 && common ) {
+	    const unsigned char *data[4];
+	    v4u32 state[4];
+
+	    /* unused lanes just recompute lane 0 */
+	    for( l = 0; l < 4; l++ )
+		data[l] = inbuf[i + (l < lanes ? l : 0)];
+	    state[0] = (v4u32){ ctx[0].A, ctx[0].A, ctx[0].A, ctx[0].A };
+	    state[1] = (v4u32){ ctx[0].B, ctx[0].B, ctx[0].B, ctx[0].B };
+	    state[2] = (v4u32){ ctx[0].C, ctx[0].C, ctx[0].C, ctx[0].C };
+	    state[3] = (v4u32){ ctx[0].D, ctx[0].D, ctx[0].D, ctx[0].D };
+	    transform_x4( state, data, common );
+	    for( l = 0; l < lanes; l++ ) {
+		ctx[l].A = state[0][l];
+		ctx[l].B = state[1][l];
+		ctx[l].C = state[2][l];
+		ctx[l].D = state[3][l];
+		ctx[l].nblocks = common;
+	    }
+	} else
+#endif
+	    common = 0;
+	for( l = 0; l < lanes; l++ ) {
+	    md5_write( &ctx[l], (unsigned char *)inbuf[i+l] + common*64,
+		       inlen[i+l] - common*64 );
+	    md5_final( &ctx[l] );
+	    memcpy( out[i+l], ctx[l].buf, 16 );
+	}
+    }
+}
+
 
 
 
@@ -303,7 +494,7 @@ md5_final( MD5_CONTEXT *hd )
     hd->buf[61] = msb >>  8;
     hd->buf[62] = msb >> 16;
     hd->buf[63] = msb >> 24;
-    transform( hd, hd->buf );
+    transform( hd, hd->buf, 1 );
 
 
     p = hd->buf;
@@ -1,22 +1,27 @@
 #ifndef MD5_H
 #define MD5_H
 
+#include <stddef.h>
+
 #undef BIG_ENDIAN_HOST
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define BIG_ENDIAN_HOST 1
+#endif
 typedef unsigned int u32;
 
 
 /****************
- * Rotate a 32 bit integer by n bytes
+ * Rotate a 32 bit integer by n bits
+ * both map to a single ror on arm and rol on x86. the old i386 asm
+ * version hid the constant n from the optimizer
  */
-#if defined(__GNUC__) && defined(__i386__)
-static inline u32
-rol( u32 x, int n)
-{
-	__asm__("roll %%cl,%0"
-		:"=r" (x)
-		:"0" (x),"c" (n));
-	return x;
-}
+#if defined(__has_builtin)
+#if __has_builtin(__builtin_rotateleft32)
+#define MD5_HAVE_BUILTIN_ROTATE
+#endif
+#endif
+#ifdef MD5_HAVE_BUILTIN_ROTATE
+#define rol(x,n) __builtin_rotateleft32((x), (n))
 #else
 #define rol(x,n) ( ((x) << (n)) | ((x) >> (32-(n))) )
 #endif
@@ -35,6 +40,11 @@ extern void
 md5_write( MD5_CONTEXT *hd, unsigned char *inbuf, size_t inlen);
 extern void
 md5_final( MD5_CONTEXT *hd );
+/* digest of n whole buffers, 4 at a time in simd lanes where possible,
+ * out[i] is the same as md5_init/md5_write/md5_final of inbuf[i] */
+extern void
+md5_multi( const unsigned char **inbuf, const size_t *inlen,
+           unsigned char (*out)[16], int n );
 
 
 #endif  /*MD5_H*/
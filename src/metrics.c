@@ -0,0 +1,306 @@
+/**
+* @file metrics.c
+* @author rigensen
+* @brief  metrics registry, see metrics.h
+* @date 六 10/26 15:20:07 2019
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <assert.h>
+#include "metrics.h"
+#include "dbg.h"
+#include "public.h"
+
+typedef struct {
+    uint32_t buckets[METRIC_HIST_BUCKETS];
+    uint32_t max_us;
+    uint64_t sum_us;
+} metrics_hist_t;
+
+typedef struct {
+    uint64_t counters[METRIC_COUNTER_NUM];
+    int32_t gauges[METRIC_GAUGE_NUM];
+    uint64_t session_bytes[METRIC_MAX_SESSION];
+    metrics_hist_t hists[METRIC_HIST_NUM];
+    int64_t start_us;
+    int dump_pipe[2];
+    char *dump_path;
+} metrics_info_t;
+
+static metrics_info_t g_metrics = {
+    .dump_pipe = { -1, -1 },
+};
+
+static const char *g_counter_names[METRIC_COUNTER_NUM] = {
+    [METRIC_SLICES_SAVED] = "slices_saved",
+    [METRIC_BYTES_SAVED] = "bytes_saved",
+    [METRIC_SAVE_ERRORS] = "save_errors",
+    [METRIC_SLICES_EVICTED] = "slices_evicted",
+    [METRIC_SLICES_SENT] = "slices_sent",
+    [METRIC_BYTES_SENT] = "bytes_sent",
+    [METRIC_SLICES_RESENT] = "slices_resent",
+    [METRIC_SESSIONS_TOTAL] = "sessions_total",
+    [METRIC_CACHE_HITS] = "cache_hits",
+    [METRIC_CACHE_MISSES] = "cache_misses",
+};
+
+static const char *g_gauge_names[METRIC_GAUGE_NUM] = {
+    [METRIC_SESSIONS_ACTIVE] = "sessions_active",
+    [METRIC_PLAYBACKS_ACTIVE] = "playbacks_active",
+};
+
+static const char *g_hist_names[METRIC_HIST_NUM] = {
+    [METRIC_HIST_SAVE_TS] = "save_ts",
+    [METRIC_HIST_SD_WRITE] = "sd_write",
+    [METRIC_HIST_LOOKUP] = "lookup",
+    [METRIC_HIST_SEND_TS] = "send_ts",
+    [METRIC_HIST_SEGMENT_LIST] = "segment_list",
+    [METRIC_HIST_PLAY_START] = "play_start",
+};
+
+int64_t metrics_now_us(void)
+{
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return tp.tv_sec*(int64_t)1000000 + tp.tv_nsec/1000;
+}
+
+void metrics_init(void)
+{
+    int64_t expect = 0;
+
+    __atomic_compare_exchange_n(&g_metrics.start_us, &expect, metrics_now_us(), 0,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+void metrics_inc(int counter, uint64_t n)
+{
+    if (counter < 0 || counter >= METRIC_COUNTER_NUM)
+        return;
+    __atomic_fetch_add(&g_metrics.counters[counter], n, __ATOMIC_RELAXED);
+}
+
+void metrics_gauge_add(int gauge, int n)
+{
+    if (gauge < 0 || gauge >= METRIC_GAUGE_NUM)
+        return;
+    __atomic_fetch_add(&g_metrics.gauges[gauge], n, __ATOMIC_RELAXED);
+}
+
+static inline int hist_bucket(uint64_t us)
+{
+    int i = 0;
+
+    while (i < METRIC_HIST_BUCKETS-1 && us >= ((uint64_t)1 << i))
+        i++;
+    return i;
+}
+
+void metrics_observe(int hist, int64_t us)
+{
+    metrics_hist_t *h = NULL;
+    uint32_t max = 0, v = 0;
+
+    if (hist < 0 || hist >= METRIC_HIST_NUM)
+        return;
+    if (us < 0)
+        us = 0;
+    h = &g_metrics.hists[hist];
+    v = us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+    __atomic_fetch_add(&h->buckets[hist_bucket(v)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum_us, (uint64_t)v, __ATOMIC_RELAXED);
+    max = __atomic_load_n(&h->max_us, __ATOMIC_RELAXED);
+    while (v > max && !__atomic_compare_exchange_n(&h->max_us, &max, v, 1,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+void metrics_observe_since(int hist, int64_t begin_us)
+{
+    metrics_observe(hist, metrics_now_us() - begin_us);
+}
+
+void metrics_session_add(int sid, uint64_t bytes)
+{
+    if (sid < 0 || sid >= METRIC_MAX_SESSION)
+        return;
+    __atomic_fetch_add(&g_metrics.session_bytes[sid], bytes, __ATOMIC_RELAXED);
+}
+
+void metrics_session_reset(int sid)
+{
+    if (sid < 0 || sid >= METRIC_MAX_SESSION)
+        return;
+    __atomic_store_n(&g_metrics.session_bytes[sid], 0, __ATOMIC_RELAXED);
+}
+
+static uint32_t hist_percentile(const metrics_hist_report_t *h, int percent)
+{
+    uint64_t want = 0, seen = 0;
+    int i = 0;
+
+    if (!h->count)
+        return 0;
+    want = ((uint64_t)h->count*percent + 99)/100;
+    for (i = 0; i < METRIC_HIST_BUCKETS-1; i++) {
+        seen += h->buckets[i];
+        if (seen >= want)
+            return (uint32_t)1 << i;
+    }
+    return h->max_us;
+}
+
+/* fields are read one by one, a report taken under load may be a little skewed */
+void metrics_report(metrics_report_t *report)
+{
+    int64_t start = __atomic_load_n(&g_metrics.start_us, __ATOMIC_RELAXED);
+    int i = 0, j = 0;
+
+    memset(report, 0, sizeof(*report));
+    report->version = METRICS_REPORT_VERSION;
+    if (start)
+        report->uptime_sec = (uint32_t)((metrics_now_us() - start)/1000000);
+    for (i = 0; i < METRIC_COUNTER_NUM; i++)
+        report->counters[i] = __atomic_load_n(&g_metrics.counters[i], __ATOMIC_RELAXED);
+    for (i = 0; i < METRIC_GAUGE_NUM; i++)
+        report->gauges[i] = __atomic_load_n(&g_metrics.gauges[i], __ATOMIC_RELAXED);
+    for (i = 0; i < METRIC_MAX_SESSION; i++)
+        report->session_bytes[i] = __atomic_load_n(&g_metrics.session_bytes[i], __ATOMIC_RELAXED);
+    for (i = 0; i < METRIC_HIST_NUM; i++) {
+        metrics_hist_t *h = &g_metrics.hists[i];
+        metrics_hist_report_t *out = &report->hists[i];
+
+        for (j = 0; j < METRIC_HIST_BUCKETS; j++) {
+            out->buckets[j] = __atomic_load_n(&h->buckets[j], __ATOMIC_RELAXED);
+            out->count += out->buckets[j];
+        }
+        out->sum_us = __atomic_load_n(&h->sum_us, __ATOMIC_RELAXED);
+        out->max_us = __atomic_load_n(&h->max_us, __ATOMIC_RELAXED);
+        out->p50_us = hist_percentile(out, 50);
+        out->p90_us = hist_percentile(out, 90);
+        out->p99_us = hist_percentile(out, 99);
+    }
+}
+
+void metrics_dump(FILE *fp)
+{
+    metrics_report_t report;
+    int i = 0;
+
+    metrics_report(&report);
+    fprintf(fp, "uptime_sec %u\n", report.uptime_sec);
+    for (i = 0; i < METRIC_COUNTER_NUM; i++)
+        fprintf(fp, "counter %s %llu\n", g_counter_names[i], (unsigned long long)report.counters[i]);
+    for (i = 0; i < METRIC_GAUGE_NUM; i++)
+        fprintf(fp, "gauge %s %d\n", g_gauge_names[i], report.gauges[i]);
+    for (i = 0; i < METRIC_MAX_SESSION; i++)
+        fprintf(fp, "session %d bytes_sent %llu\n", i, (unsigned long long)report.session_bytes[i]);
+    for (i = 0; i < METRIC_HIST_NUM; i++) {
+        metrics_hist_report_t *h = &report.hists[i];
+
+        fprintf(fp, "hist %s count %u avg_us %llu p50_us %u p90_us %u p99_us %u max_us %u\n",
+                g_hist_names[i], h->count,
+                (unsigned long long)(h->count ? h->sum_us/h->count : 0),
+                h->p50_us, h->p90_us, h->p99_us, h->max_us);
+    }
+}
+
+/* written aside and renamed, a collector never reads half a dump */
+int metrics_dump_file(const char *path)
+{
+    char tmp[256] = {0};
+    FILE *fp = NULL;
+
+    ASSERT( path );
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if ( (fp = fopen(tmp, "w")) == NULL ) {
+        LOGE("open %s error, %s", tmp, strerror(errno));
+        return -ERRINTERNAL;
+    }
+    metrics_dump(fp);
+    fclose(fp);
+    if ( rename(tmp, path) < 0 ) {
+        LOGE("rename %s error, %s", tmp, strerror(errno));
+        return -ERRINTERNAL;
+    }
+    return 0;
+}
+
+static void dump_signal_handler(int signo)
+{
+    int saved_errno = errno;
+    char c = (char)signo;
+    ssize_t ret = 0;
+
+    /* only async signal safe calls here, the dump thread does the work */
+    ret = write(g_metrics.dump_pipe[1], &c, 1);
+    (void)ret;
+    errno = saved_errno;
+}
+
+static void *dump_thread(void *arg)
+{
+    char c = 0;
+    ssize_t ret = 0;
+
+    (void)arg;
+    pthread_detach(pthread_self());
+    for (;;) {
+        ret = read(g_metrics.dump_pipe[0], &c, 1);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+        if (metrics_dump_file(g_metrics.dump_path) == 0)
+            LOGI("metrics dumped to %s", g_metrics.dump_path);
+    }
+    return NULL;
+}
+
+int metrics_dump_on_signal(int signo, const char *path)
+{
+    struct sigaction sa;
+    pthread_t tid;
+
+    ASSERT( path );
+
+    if (g_metrics.dump_pipe[0] >= 0)
+        return -ERRINVAL;
+    if ( (g_metrics.dump_path = strdup(path)) == NULL )
+        return -ERRNOMEM;
+    if (pipe(g_metrics.dump_pipe) < 0) {
+        LOGE("pipe error, %s", strerror(errno));
+        goto err;
+    }
+    /* a burst of signals must never block the handler */
+    fcntl(g_metrics.dump_pipe[1], F_SETFL, O_NONBLOCK);
+    if (pthread_create(&tid, NULL, dump_thread, NULL) != 0)
+        goto err;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = dump_signal_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(signo, &sa, NULL) < 0) {
+        LOGE("sigaction %d error, %s", signo, strerror(errno));
+        return -ERRINTERNAL;
+    }
+    return 0;
+err:
+    if (g_metrics.dump_pipe[0] >= 0) {
+        close(g_metrics.dump_pipe[0]);
+        close(g_metrics.dump_pipe[1]);
+        g_metrics.dump_pipe[0] = g_metrics.dump_pipe[1] = -1;
+    }
+    free(g_metrics.dump_path);
+    g_metrics.dump_path = NULL;
+    return -ERRINTERNAL;
+}
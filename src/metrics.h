@@ -0,0 +1,91 @@
+/**
+* @file metrics.h
+* @author rigensen
+* @brief  counters, gauges and latency histograms, all lock free. read
+*         by the metrics ioctl or dumped to a file on a signal
+* @date 六 10/26 15:20:07 2019
+*/
+
+#ifndef _METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+enum {
+    METRIC_SLICES_SAVED,
+    METRIC_BYTES_SAVED,
+    METRIC_SAVE_ERRORS,
+    METRIC_SLICES_EVICTED,
+    METRIC_SLICES_SENT,
+    METRIC_BYTES_SENT,
+    METRIC_SLICES_RESENT,
+    METRIC_SESSIONS_TOTAL,
+    METRIC_CACHE_HITS,        /* slices served from the slice cache */
+    METRIC_CACHE_MISSES,
+    METRIC_COUNTER_NUM,
+};
+
+enum {
+    METRIC_SESSIONS_ACTIVE,
+    METRIC_PLAYBACKS_ACTIVE,
+    METRIC_GAUGE_NUM,
+};
+
+enum {
+    METRIC_HIST_SAVE_TS,      /* a slice going to the card, retention and index included, not the ones held in ram */
+    METRIC_HIST_SD_WRITE,     /* fopen to fclose of one slice */
+    METRIC_HIST_LOOKUP,       /* find_start_pos */
+    METRIC_HIST_SEND_TS,
+    METRIC_HIST_SEGMENT_LIST,
+    METRIC_HIST_PLAY_START,   /* play request to the first slice sent */
+    METRIC_HIST_NUM,
+};
+
+/* bucket i counts samples below 2^i us, the last one everything above */
+#define METRIC_HIST_BUCKETS 24
+#define METRIC_MAX_SESSION 8 /* part of the report, not below MAX_CLIENT_NUM of sdplay.c */
+
+/*
+ * metrics ioctl response, little endian, no padding. percentiles are
+ * the upper bound of the bucket they fall in
+ */
+typedef struct {
+    uint32_t count;
+    uint32_t p50_us;
+    uint32_t p90_us;
+    uint32_t p99_us;
+    uint32_t max_us;
+    uint32_t reserved;
+    uint64_t sum_us;
+    uint32_t buckets[METRIC_HIST_BUCKETS];
+} metrics_hist_report_t;
+
+typedef struct {
+    uint32_t version;
+    uint32_t uptime_sec;
+    uint64_t counters[METRIC_COUNTER_NUM];
+    int32_t gauges[METRIC_GAUGE_NUM];
+    uint64_t session_bytes[METRIC_MAX_SESSION]; /* bytes sent to each sid */
+    metrics_hist_report_t hists[METRIC_HIST_NUM];
+} metrics_report_t;
+
+#define METRICS_REPORT_VERSION 2
+
+/* uptime in the report counts from here, called by sdp_init */
+extern void metrics_init(void);
+extern int64_t metrics_now_us(void);
+extern void metrics_inc(int counter, uint64_t n);
+extern void metrics_gauge_add(int gauge, int n);
+extern void metrics_observe(int hist, int64_t us);
+/* pass the metrics_now_us() taken at the start */
+extern void metrics_observe_since(int hist, int64_t begin_us);
+extern void metrics_session_add(int sid, uint64_t bytes);
+extern void metrics_session_reset(int sid);
+extern void metrics_report(metrics_report_t *report);
+extern void metrics_dump(FILE *fp);
+extern int metrics_dump_file(const char *path);
+/* a dump thread writes path each time signo arrives */
+extern int metrics_dump_on_signal(int signo, const char *path);
+
+#define _METRICS_H
+#endif
@@ -0,0 +1,107 @@
+/**
+* @file preroll.c
+* @author rigensen
+* @brief  pre-roll ring, see preroll.h
+* @date 一 10/28 15:12:30 2019
+*/
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <sys/param.h>
+#include "preroll.h"
+#include "dbg.h"
+#include "public.h"
+
+int preroll_init(preroll_ring_t *ring, int cap_bytes, int max_sec)
+{
+    ASSERT( ring );
+
+    if (cap_bytes <= 0 || max_sec < 0)
+        return -ERRINVAL;
+    memset(ring, 0, sizeof(*ring));
+    if ( (ring->buf = (uint8_t *)malloc(cap_bytes)) == NULL ) {
+        LOGE("malloc error, size:%d", cap_bytes);
+        return -ERRNOMEM;
+    }
+    ring->cap = cap_bytes;
+    ring->max_sec = max_sec;
+    return 0;
+}
+
+void preroll_free(preroll_ring_t *ring)
+{
+    free(ring->buf);
+    memset(ring, 0, sizeof(*ring));
+}
+
+static void pop_oldest(preroll_ring_t *ring)
+{
+    ring->used -= ring->slices[ring->head].size;
+    ring->head = (ring->head + 1) % PREROLL_MAX_SLICES;
+    ring->count--;
+}
+
+int preroll_push(preroll_ring_t *ring, const uint8_t *buf, int size, int starttime, int endtime)
+{
+    preroll_slice_t *slice = NULL;
+    int first = 0;
+
+    ASSERT( buf );
+
+    if (!ring->buf || size <= 0 || size > ring->cap)
+        return -ERRINVAL;
+    while ( ring->count && (ring->used + size > ring->cap
+                || ring->count == PREROLL_MAX_SLICES
+                || ring->slices[ring->head].endtime <= endtime - ring->max_sec) )
+        pop_oldest(ring);
+    slice = &ring->slices[(ring->head + ring->count) % PREROLL_MAX_SLICES];
+    slice->starttime = starttime;
+    slice->endtime = endtime;
+    slice->off = ring->wr;
+    slice->size = size;
+    /* wraps around the end of the buffer */
+    first = MIN(size, ring->cap - ring->wr);
+    memcpy(ring->buf + ring->wr, buf, first);
+    memcpy(ring->buf, buf + first, size - first);
+    ring->wr = (ring->wr + size) % ring->cap;
+    ring->used += size;
+    ring->count++;
+    return 0;
+}
+
+int preroll_oldest(preroll_ring_t *ring)
+{
+    return ring->count ? ring->slices[ring->head].starttime : -1;
+}
+
+int preroll_drain(preroll_ring_t *ring, preroll_drain_cb_t cb, void *arg)
+{
+    preroll_slice_t *slice = NULL;
+    uint8_t *tmp = NULL;
+    int ret = 0, first = 0;
+
+    ASSERT( cb );
+
+    for (; ring->count; pop_oldest(ring)) {
+        slice = &ring->slices[ring->head];
+        if (ret < 0)
+            continue;
+        first = ring->cap - slice->off;
+        if (slice->size <= first) {
+            ret = cb(ring->buf + slice->off, slice->size, slice->starttime, slice->endtime, arg);
+            continue;
+        }
+        if ( (tmp = (uint8_t *)malloc(slice->size)) == NULL ) {
+            ret = -ERRNOMEM;
+            continue;
+        }
+        memcpy(tmp, ring->buf + slice->off, first);
+        memcpy(tmp + first, ring->buf, slice->size - first);
+        ret = cb(tmp, slice->size, slice->starttime, slice->endtime, arg);
+        free(tmp);
+    }
+    ring->wr = 0;
+    return ret;
+}
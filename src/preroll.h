@@ -0,0 +1,47 @@
+/**
+* @file preroll.h
+* @author rigensen
+* @brief  ram ring of the last seconds of ts slices, written to the sd
+*         card only when an event asks for its lead-in. one buffer is
+*         allocated up front, the oldest slices make room for new ones
+* @date 一 10/28 15:12:30 2019
+*/
+
+#ifndef _PREROLL_H
+
+#include <stdint.h>
+
+#define PREROLL_MAX_SLICES 64
+
+typedef struct {
+    int starttime;
+    int endtime;
+    int off;
+    int size;
+} preroll_slice_t;
+
+typedef struct {
+    uint8_t *buf;
+    int cap;
+    int wr;
+    int used;
+    int max_sec; /* slices ending earlier than this before the newest go */
+    int head;
+    int count;
+    preroll_slice_t slices[PREROLL_MAX_SLICES];
+} preroll_ring_t;
+
+/* called for each slice oldest first, buf is only valid during the call */
+typedef int (*preroll_drain_cb_t)(const uint8_t *buf, int size, int starttime, int endtime, void *arg);
+
+extern int preroll_init(preroll_ring_t *ring, int cap_bytes, int max_sec);
+extern void preroll_free(preroll_ring_t *ring);
+/* copies the slice in, -ERRINVAL when it never fits */
+extern int preroll_push(preroll_ring_t *ring, const uint8_t *buf, int size, int starttime, int endtime);
+/* start of the oldest slice, -1 when empty */
+extern int preroll_oldest(preroll_ring_t *ring);
+/* hands every slice to cb and empties the ring, the rest is dropped after an error */
+extern int preroll_drain(preroll_ring_t *ring, preroll_drain_cb_t cb, void *arg);
+
+#define _PREROLL_H
+#endif
@@ -0,0 +1,334 @@
+/**
+* @file scheduler.c
+* @author rigensen
+* @brief  playback scheduler, see scheduler.h
+* @date 日 10/27 16:02:44 2019
+*/
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/param.h>
+#include <pthread.h>
+#include <time.h>
+#include "scheduler.h"
+#include "dbg.h"
+#include "public.h"
+
+#define SCHED_BURST_US (200*1000) /* a bucket never saves more than this much of its rate */
+#define SCHED_MAX_REFILL_US (1000*1000)
+
+typedef struct {
+    int64_t rate_bps; /* 0 unlimited */
+    int64_t tokens;   /* bytes, below 0 is debt */
+    int64_t last_us;
+} sched_bucket_t;
+
+typedef struct {
+    int active;
+    int cancelled;
+    int background; /* only SCHED_BACKGROUND_PERCENT while a foreground one is active */
+    int weight;
+    int64_t cap_bps;
+    sched_bucket_t buckets[SCHED_RES_NUM];
+} sched_session_t;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int64_t limit_bps[SCHED_RES_NUM];
+    int64_t live_bps;
+    int default_weight;
+    int64_t default_cap_bps;
+    sched_session_t sessions[SCHED_MAX_SESSION];
+} sched_info_t;
+
+static sched_info_t g_sched = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .default_weight = 1,
+};
+static pthread_once_t g_sched_once = PTHREAD_ONCE_INIT;
+
+static void sched_init(void)
+{
+    pthread_condattr_t attr;
+    int i = 0;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&g_sched.cond, &attr);
+    pthread_condattr_destroy(&attr);
+    for (i = 0; i < SCHED_MAX_SESSION; i++)
+        g_sched.sessions[i].weight = g_sched.default_weight;
+}
+
+static int64_t now_us(void)
+{
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return tp.tv_sec*(int64_t)1000000 + tp.tv_nsec/1000;
+}
+
+static inline sched_session_t *lock_session(int sid)
+{
+    pthread_once(&g_sched_once, sched_init);
+    pthread_mutex_lock(&g_sched.mutex);
+    if (sid < 0 || sid >= SCHED_MAX_SESSION) {
+        pthread_mutex_unlock(&g_sched.mutex);
+        return NULL;
+    }
+    return &g_sched.sessions[sid];
+}
+
+static void bucket_refill(sched_bucket_t *b, int64_t now)
+{
+    int64_t dt = now - b->last_us, burst = 0;
+
+    if (dt <= 0)
+        return;
+    b->last_us = now;
+    if (!b->rate_bps)
+        return;
+    if (dt > SCHED_MAX_REFILL_US)
+        dt = SCHED_MAX_REFILL_US;
+    b->tokens += b->rate_bps*dt/8000000;
+    burst = b->rate_bps*SCHED_BURST_US/8000000;
+    if (b->tokens > burst)
+        b->tokens = burst;
+}
+
+/* cap of a session for this round, 0 none */
+static int64_t session_cap(const sched_session_t *s, int64_t total, int foreground)
+{
+    int64_t cap = 0;
+
+    if (!s->background || !foreground || total <= 0)
+        return s->cap_bps;
+    cap = MAX(total*SCHED_BACKGROUND_PERCENT/100, 1);
+    return s->cap_bps && s->cap_bps < cap ? s->cap_bps : cap;
+}
+
+/*
+ * weighted max-min: sessions capped below their share get the cap and
+ * the rest is split again among the others. mutex held
+ */
+static void rebalance_res(int res, int64_t now)
+{
+    int64_t total = g_sched.limit_bps[res], remaining = 0;
+    int64_t rate[SCHED_MAX_SESSION];
+    int fixed[SCHED_MAX_SESSION];
+    int64_t cap[SCHED_MAX_SESSION];
+    int i = 0, weights = 0, again = 0, foreground = 0;
+    sched_session_t *s = NULL;
+
+    memset(rate, 0, sizeof(rate));
+    memset(fixed, 0, sizeof(fixed));
+    if (res == SCHED_UPLINK && total > 0) {
+        int64_t floor = total*SCHED_MIN_PLAYBACK_PERCENT/100;
+
+        total -= g_sched.live_bps;
+        if (total < floor)
+            total = floor;
+    }
+    for (i = 0; i < SCHED_MAX_SESSION; i++)
+        foreground += g_sched.sessions[i].active && !g_sched.sessions[i].background;
+    for (i = 0; i < SCHED_MAX_SESSION; i++)
+        cap[i] = session_cap(&g_sched.sessions[i], total, foreground);
+    remaining = total;
+    do {
+        again = 0;
+        weights = 0;
+        for (i = 0; i < SCHED_MAX_SESSION; i++) {
+            if (g_sched.sessions[i].active && !fixed[i])
+                weights += g_sched.sessions[i].weight;
+        }
+        for (i = 0; i < SCHED_MAX_SESSION && weights; i++) {
+            s = &g_sched.sessions[i];
+            if (!s->active || fixed[i] || !cap[i])
+                continue;
+            /* unlimited resource, only the caps apply */
+            if (total <= 0 || cap[i] < remaining*s->weight/weights) {
+                rate[i] = cap[i];
+                fixed[i] = 1;
+                remaining -= cap[i];
+                again = 1;
+            }
+        }
+    } while (again && total > 0);
+    for (i = 0; i < SCHED_MAX_SESSION; i++) {
+        s = &g_sched.sessions[i];
+        if (!s->active)
+            continue;
+        if (!fixed[i] && total > 0)
+            rate[i] = MAX(remaining*s->weight/weights, 1);
+        bucket_refill(&s->buckets[res], now);
+        s->buckets[res].rate_bps = rate[i];
+    }
+}
+
+/* mutex held, waiters pick up their new rate */
+static void rebalance()
+{
+    int64_t now = now_us();
+    int res = 0;
+
+    for (res = 0; res < SCHED_RES_NUM; res++)
+        rebalance_res(res, now);
+    pthread_cond_broadcast(&g_sched.cond);
+}
+
+void sched_set_limit(int res, int64_t bps)
+{
+    if (res < 0 || res >= SCHED_RES_NUM)
+        return;
+    pthread_once(&g_sched_once, sched_init);
+    pthread_mutex_lock(&g_sched.mutex);
+    g_sched.limit_bps[res] = bps > 0 ? bps : 0;
+    rebalance();
+    pthread_mutex_unlock(&g_sched.mutex);
+    LOGI("res %d limit %"PRId64" bps", res, bps);
+}
+
+void sched_set_live(int64_t bps)
+{
+    pthread_once(&g_sched_once, sched_init);
+    pthread_mutex_lock(&g_sched.mutex);
+    g_sched.live_bps = bps > 0 ? bps : 0;
+    rebalance();
+    pthread_mutex_unlock(&g_sched.mutex);
+}
+
+void sched_set_default(int weight, int64_t cap_bps)
+{
+    pthread_once(&g_sched_once, sched_init);
+    pthread_mutex_lock(&g_sched.mutex);
+    g_sched.default_weight = weight > 0 ? weight : 1;
+    g_sched.default_cap_bps = cap_bps > 0 ? cap_bps : 0;
+    pthread_mutex_unlock(&g_sched.mutex);
+}
+
+int sched_set_session(int sid, int weight, int64_t cap_bps)
+{
+    sched_session_t *s = lock_session(sid);
+
+    if (!s)
+        return -ERRINVAL;
+    s->weight = weight > 0 ? weight : 1;
+    s->cap_bps = cap_bps > 0 ? cap_bps : 0;
+    rebalance();
+    pthread_mutex_unlock(&g_sched.mutex);
+    return 0;
+}
+
+void sched_reset_session(int sid)
+{
+    sched_session_t *s = lock_session(sid);
+
+    if (!s)
+        return;
+    s->weight = g_sched.default_weight;
+    s->cap_bps = g_sched.default_cap_bps;
+    s->background = 0;
+    pthread_mutex_unlock(&g_sched.mutex);
+}
+
+int sched_set_background(int sid, int background)
+{
+    sched_session_t *s = lock_session(sid);
+
+    if (!s)
+        return -ERRINVAL;
+    s->background = !!background;
+    rebalance();
+    pthread_mutex_unlock(&g_sched.mutex);
+    return 0;
+}
+
+void sched_join(int sid)
+{
+    sched_session_t *s = lock_session(sid);
+    int64_t now = now_us();
+    int res = 0;
+
+    if (!s)
+        return;
+    s->active = 1;
+    s->cancelled = 0;
+    for (res = 0; res < SCHED_RES_NUM; res++) {
+        s->buckets[res].tokens = 0;
+        s->buckets[res].last_us = now;
+    }
+    rebalance();
+    pthread_mutex_unlock(&g_sched.mutex);
+}
+
+void sched_leave(int sid)
+{
+    sched_session_t *s = lock_session(sid);
+
+    if (!s)
+        return;
+    s->active = 0;
+    rebalance();
+    pthread_mutex_unlock(&g_sched.mutex);
+}
+
+void sched_cancel(int sid)
+{
+    sched_session_t *s = lock_session(sid);
+
+    if (!s)
+        return;
+    s->cancelled = 1;
+    pthread_cond_broadcast(&g_sched.cond);
+    pthread_mutex_unlock(&g_sched.mutex);
+}
+
+int sched_acquire(int sid, int res, int bytes)
+{
+    sched_session_t *s = NULL;
+    sched_bucket_t *b = NULL;
+    struct timespec deadline;
+    int64_t now = 0, wait_us = 0;
+    int ret = 0;
+
+    if (res < 0 || res >= SCHED_RES_NUM)
+        return 0;
+    if ( (s = lock_session(sid)) == NULL )
+        return 0;
+    b = &s->buckets[res];
+    for (;;) {
+        if (s->cancelled) {
+            ret = -1;
+            break;
+        }
+        now = now_us();
+        bucket_refill(b, now);
+        if (!s->active || !b->rate_bps || b->tokens >= 0) {
+            b->tokens -= bytes;
+            break;
+        }
+        /* the debt is paid off at the current rate, a rebalance wakes us early */
+        wait_us = -b->tokens*8000000/b->rate_bps + 1;
+        now += wait_us;
+        deadline.tv_sec = now/1000000;
+        deadline.tv_nsec = (now%1000000)*1000;
+        pthread_cond_timedwait(&g_sched.cond, &g_sched.mutex, &deadline);
+    }
+    pthread_mutex_unlock(&g_sched.mutex);
+    return ret;
+}
+
+int64_t sched_get_rate(int sid, int res)
+{
+    sched_session_t *s = NULL;
+    int64_t rate = 0;
+
+    if (res < 0 || res >= SCHED_RES_NUM)
+        return 0;
+    if ( (s = lock_session(sid)) == NULL )
+        return 0;
+    rate = s->active ? s->buckets[res].rate_bps : 0;
+    pthread_mutex_unlock(&g_sched.mutex);
+    return rate;
+}
@@ -0,0 +1,54 @@
+/**
+* @file scheduler.h
+* @author rigensen
+* @brief  playback scheduler, shares the uplink and the sd card read
+*         bandwidth among the sessions playing back. every session has
+*         a token bucket per resource, refilled at its weighted fair
+*         share, capped per session. live view is served first
+* @date 日 10/27 16:02:44 2019
+*/
+
+#ifndef _SCHEDULER_H
+
+#include <stdint.h>
+
+enum {
+    SCHED_UPLINK,
+    SCHED_SD_READ,
+    SCHED_RES_NUM,
+};
+
+#define SCHED_MAX_SESSION 16 /* a playback and an export per sid */
+/* playback keeps this much of the uplink however much live view takes */
+#define SCHED_MIN_PLAYBACK_PERCENT 10
+/* what background sessions(exports) share while a playback is running */
+#define SCHED_BACKGROUND_PERCENT 20
+
+/* total bandwidth of a resource, 0(default) means unlimited */
+extern void sched_set_limit(int res, int64_t bps);
+/* uplink taken by live view, 0 when no live view is running */
+extern void sched_set_live(int64_t bps);
+/* weight and cap(0 no cap) for sessions opened from now on */
+extern void sched_set_default(int weight, int64_t cap_bps);
+/* override for one sid, until its next session */
+extern int sched_set_session(int sid, int weight, int64_t cap_bps);
+/* back to the defaults, called when sdplay opens a session */
+extern void sched_reset_session(int sid);
+/* a bulk job that must not slow down interactive playback, reset with the session */
+extern int sched_set_background(int sid, int background);
+/* the session starts/stops competing, shares are recomputed */
+extern void sched_join(int sid);
+extern void sched_leave(int sid);
+/* wakes the session out of sched_acquire(), until its next join */
+extern void sched_cancel(int sid);
+/*
+ * blocks until the session may use bytes more of res. a bucket may go
+ * into debt, so one big packet never waits for a bigger bucket.
+ * 0, or -1 when cancelled
+ */
+extern int sched_acquire(int sid, int res, int bytes);
+/* current share of a session, 0 when unlimited */
+extern int64_t sched_get_rate(int sid, int res);
+
+#define _SCHEDULER_H
+#endif
@@ -11,14 +11,30 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <pthread.h>
 #include <sys/stat.h>
 #include <assert.h>
 #include <sys/param.h>
+#ifdef __linux__
+#include <sys/vfs.h>
+#else
 #include <sys/mount.h>
+#endif
 #include <inttypes.h>
+#include <limits.h>
+#include <dirent.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include "transfer.h"
-#include "md5.h"
+#include "digest.h"
+#include "metrics.h"
+#include "scheduler.h"
+#include "slice_cache.h"
+#include "preroll.h"
+#include "ts_parse.h"
+#include "thumb.h"
 #include "transfer.h"
 #include "dbg.h"
 #include "sdplay.h"
@@ -27,9 +43,19 @@
 #define SDPLAY_DBG 0
 #define TS_INDEX_DB "tsindexdb"
 #define SEGMENT_DB_FILENAME "segmentdb"
-#define INDEX_DB_TMP "tsindexdb.tmp"
+#define THUMB_DB "thumbdb"
+#define DB_TMP_SUFFIX ".tmp"
 #define LENGTH_PER_RECORD 64
-#define PKT_HDR_LEN 52
+#define PKT_HDR_LEN 52 /* tag_frame_header_t without pkt_crc, what old apps expect */
+#define PKT_CRC_FLAG 0x01 /* reserved[1] of play request and frame header */
+#define PLAY_FOLLOW_FLAG 0x02 /* reserved[1] of play request, keep on with new slices */
+#define PLAY_CONCAT_FLAG 0x04 /* reserved[1] of play request, the slices as one continuous ts */
+#define PLAY_GAP_FLAG 0x08 /* reserved[1] of play request, only what the segments cover */
+#define FRAME_GAP_FLAG 0x02 /* reserved[1] of frame header, a sdp_gap_marker_t */
+#define FOLLOW_WAIT_MS 1000 /* a follower rechecks its state at least this often */
+#define TAKEOVER_WAIT_MS (5*1000) /* for a stopped playback to finish its slice */
+#define BACKWARD_KEYFRAMES 0x01 /* low byte of Param of AVIOCTRL_RECORD_PLAY_BACKWARD */
+#define MAX_SLICE_KEYFRAMES 64
 #define SD_SPACE_THREHOLD (1024*1024)// 1M
 //#define DELETE_TS_COUNT (1024) // each time sd full,delete 1024 ts
 #define DELETE_TS_COUNT (2) // each time sd full,delete 1024 ts
@@ -37,10 +63,25 @@
 #define _TIME_STR(t) "0"#t
 #define TIME_STR(t) _TIME_STR(t)
 #define TIME_FILL_ZERO_LEN TIME_STR(TIME_IN_SEC_LEN)
-#define SEGMENT_RECORD_LEN (TIME_IN_SEC_LEN*2+1+1+1)
+#define EVENT_TYPE_LEN 2
+#define LEGACY_SEGMENT_RECORD_LEN (TIME_IN_SEC_LEN*2+1+1) /* no event type, always motion */
+#define SEGMENT_RECORD_LEN (TIME_IN_SEC_LEN*2+1+1+EVENT_TYPE_LEN+1+1)
 #define MAX_PKT_SIZE (1024*1024) /*  avServSetResendSize()函数最大发送为 1024KB 字节  */
-#define TS_MD5_LEN 33
+#define CONCAT_PKT_SIZE (MAX_PKT_SIZE/TS_PKT_LEN*TS_PKT_LEN) /* whole ts packets */
+#define COALESCE_MAX_BYTES (8*1024*1024) /* a merged slice never grows past this */
+#define SEGMENT_LIST_PKT_EVENTS \
+    (int)((LST_MAX_IOCTL_SIZE-offsetof(SMsgAVIoctrlListEventResp, stEvent))/sizeof(SAvEvent))
+#define SEGMENT_LIST_MAX_EVENTS (SEGMENT_LIST_PKT_EVENTS*256) /* index of a packet is one byte */
 #define MAX_CLIENT_NUM 8
+#define MAX_CHANNEL_NUM 4 /* camera channels(lens) served by one process */
+#define RECOVER_WORKER_NUM 4
+#define EXPORT_OPEN_TIMEOUT_MS (10*1000) /* for the app to join the bulk stream */
+#define EXPORT_WRITE_SIZE (256*1024) /* a stop is seen between two writes */
+#define EXPORT_SCHED_ID(sid) (MAX_CLIENT_NUM + (sid)) /* an export is scheduled apart from playback */
+
+#if MAX_CLIENT_NUM > METRIC_MAX_SESSION
+#error "metrics_report_t has no session_bytes for every sid"
+#endif
 
 enum {
     JUDGE_CURRENT = 1,
@@ -55,23 +96,71 @@ enum {
     PLAYBACK_STS_STOP,
 };
 
+enum {
+    CLIENT_FREE,
+    CLIENT_OPEN,
+    CLIENT_CLOSING, /* session gone, the playback thread still holds a ref */
+};
+
+/*
+ * one slot per sid. the session holds a ref while it is open, a running
+ * playback thread holds another, the last put closes the session in the
+ * transport and frees the slot for the next connection
+ */
 typedef struct {
-    int av_index;
-    int playback_ch;
+    int state;
+    int refs;
+    int av_index;     /* ioctl channel */
+    int playback_ch;  /* iotc channel of the running playback, -1 when none */
     int playback_sts;
+    pthread_mutex_t mutex;
+    int playing;
+    int resume_pending; /* one slice to resend, from packet resume_idx */
+    int resume_time;
+    int resume_idx;
+    int exporting;    /* an export thread runs and holds a ref */
+    int export_sts;   /* PLAYBACK_STS_PLAY or _STOP */
+    pthread_cond_t play_cond; /* with mutex, playing went back to 0 */
 } av_client_t;
 
+typedef struct {
+    char *ts_dbfile;
+    char *segment_dbfile;
+    pthread_mutex_t ts_db_mutex;
+    unsigned int ts_db_gen; /* bumped under ts_db_mutex when the index is rewritten */
+    unsigned int ts_db_appends; /* bumped under ts_db_mutex for every new slice */
+    pthread_cond_t ts_db_cond;  /* with ts_db_mutex, an append or a follower to stop */
+    pthread_mutex_t segment_db_mutex;
+    int seg_max_len;  /* longest segment saved, -1 segmentdb not read yet, under segment_db_mutex */
+    pthread_mutex_t rec_mutex;
+    int rec_mode;     /* SDP_RECORD_xxx */
+    int postroll_sec;
+    preroll_ring_t preroll;
+    int seg_open;     /* event mode, slices go to the card until seg_deadline */
+    int seg_event;
+    int seg_start;
+    int seg_end;
+    int seg_deadline;
+    thumb_store_t thumbs;
+    int coalesce_sec;   /* with coalesce_bytes, 0 every slice is a file of its own */
+    int coalesce_bytes;
+    uint8_t *pend_buf;  /* short slices waiting to be merged, under rec_mutex */
+    int pend_len;
+    int pend_size;
+    int pend_start;
+    int pend_end;
+    ts_concat_t pend_ts;
+} sdp_channel_t;
+
 typedef struct {
     const char *sd_mount_path;
     const char *user;
     const char *passwd;
-    char *ts_dbfile;
-    char *segment_dbfile;
     int ts_delete_count_when_full;
     int active_ch_num;
     int running;
-    pthread_mutex_t ts_db_mutex;
-    pthread_mutex_t segment_db_mutex;
+    pthread_mutex_t retention_mutex; /* all channels share one sd card budget */
+    sdp_channel_t channels[MAX_CHANNEL_NUM];
     av_client_t clients[MAX_CLIENT_NUM];
 } sdplay_info_t;
 
@@ -83,22 +172,59 @@ typedef struct {
     unsigned int endflag;      /* endFlag=1 时表示当前TS文件最后一个片段 */
     unsigned int utctime;      /* app 定位时间 */
     unsigned int length;       /* file size */
-    unsigned char md5_str[33]; /* md5 校验 */
-    unsigned char reserved[3];
+    unsigned char md5_str[DIGEST_STR_LEN]; /* 校验值, hex字符串, 算法见reserved[0] */
+    unsigned char reserved[3];  /* reserved[0]: DIGEST_xxx, 0 md5
+                                 * reserved[1]: PKT_CRC_FLAG, pkt_crc follows */
+    unsigned int pkt_crc;      /* crc32c of this packet, only when app asked for it */
 } tag_frame_header_t;
 
 typedef struct {
     int sid;
+    int channel;
     int starttime;
+    int digest_algo;
+    int pkt_crc;
+    int first_pkt; /* packet index to start the first slice from */
+    int follow;    /* at the end of the index, wait for the slices still to come */
+    int concat;    /* PLAY_CONCAT_FLAG */
+    int gaps;      /* PLAY_GAP_FLAG */
+    int keyframes; /* backward, only the keyframes of each slice */
+    int speed;     /* backward, times real time, 0 as fast as the uplink allows */
+    int steps;     /* backward, stop after this many, 0 no limit */
+    int64_t request_us;
 } playback_info_t;
 
+typedef struct {
+    int sid;
+    int channel;
+    int ch;        /* iotc channel of the bulk stream */
+    int starttime;
+    int endtime;
+    int digest_algo;
+    int resume_time;
+    int resume_offset;
+} export_info_t;
+
 static int get_record_info_in_db(const char *db_file, int *out_record_len, int *total_record_count);
 static int read_file_to_buf(const char *file, uint8_t **outbuf, int *outsize);
-static int calc_ts_md5( uint8_t *inbuf, size_t inlen, char *outbuf );
 static int get_file_size( const char *file );
-static int find_start_pos(char *db_file, int starttime);
-static int send_ts(int ch, const char *ts_file, int starttime, int endtime);
+static int find_start_pos(const char *db_file, int starttime);
+static int send_ts(int sid, int ch, const char *ts_file, int starttime, int endtime, int digest_algo, int pkt_crc, int first_pkt);
+static int send_slice_buf(int sid, int ch, const uint8_t *buf_ptr, int filesize, int starttime, int endtime,
+        int digest_algo, int pkt_crc, char *digest, int first_pkt);
+static int load_slice(const char *ts_file, void *arg, uint8_t **buf, int *size);
+static int send_pkt(int sid, int ch, int pkt_idx, int endflg, int starttime, int endtime,
+        int digest_algo, int pkt_crc, char *digest, const uint8_t *pkt, int pkt_len);
+static int read_ts_record(sdp_channel_t *chan, int time, char *out_ts_file, int size);
 static inline int parse_one_record(char *record, int *starttime, int *endtime);
+static inline int parse_segment_record(char *record, int *starttime, int *endtime, int *event);
+static int migrate_legacy_segment_db(sdp_channel_t *chan);
+static inline void get_event_db_path(sdp_channel_t *chan, int event, char *out, size_t size);
+static int map_db(const char *db_file, const char **base, size_t *len, size_t *map_len);
+static const char *scan_record(const char *line, const char *end, int *starttime, int *endtime, int *event);
+static const char *seek_record(const char *base, size_t len, int starttime);
+static const char *seek_segment(const char *base, size_t len, int starttime, int max_len);
+static int segment_list_max_len(const char *base, size_t len);
 
 static sdplay_info_t g_sdplay_info;
 
@@ -120,375 +246,2303 @@ static int list_event_handle(int ch,char *data)
 
     ASSERT(data);
 
-    LOGI("event:%d", req->event);
-    LOGI("channel:%d",req->channel);
-    LOGI("status:%d",req->status);
-    LOGI("starttime:%d", req->utcStartTime);
-    LOGI("endtime:%d", req->utcEndTime);
+    LOGD("event:%d", req->event);
+    LOGD("channel:%d",req->channel);
+    LOGD("status:%d",req->status);
+    LOGD("starttime:%d", req->utcStartTime);
+    LOGD("endtime:%d", req->utcEndTime);
 
-    if (sdp_send_segment_list(ch, req->utcStartTime, req->utcEndTime) < 0)
+    if (sdp_send_segment_list(ch, req->channel, req->event, req->utcStartTime, req->utcEndTime) < 0)
         return -ERRINTERNAL;
 
     return 0;
 }
 
-static void *tslist_playback_thread(void *arg)
+static inline sdp_channel_t *get_channel(int channel)
 {
-    playback_info_t *playback_info_ptr = (playback_info_t *)arg;
-    int sid = playback_info_ptr->sid;
-    int start_pos = 0;
-    int av_index = lst_create_data_channel2(sid, g_sdplay_info.user, g_sdplay_info.passwd, g_sdplay_info.clients[sid].playback_ch);
-    SMsgAVIoctrlPlayRecordResp res;
-    FILE *fp = NULL;
-    char *line = NULL;
-    size_t len = 0;
-    int ts_starttime = 0, ts_endtime = 0;
-
-    if (av_index < 0)
+    if (channel < 0 || channel >= MAX_CHANNEL_NUM) {
+        LOGE("invalid channel %d", channel);
         return NULL;
-    pthread_mutex_lock(&g_sdplay_info.ts_db_mutex);
-    fp = fopen(g_sdplay_info.ts_dbfile, "r");
-    if (!fp) {
-        LOGE("open file %s error", g_sdplay_info.ts_dbfile);
-        return NULL;
-    }
-    start_pos = find_start_pos(g_sdplay_info.ts_dbfile, playback_info_ptr->starttime);
-    if (start_pos < 0)
-        goto err_unlock;
-    while(g_sdplay_info.clients[sid].playback_sts == PLAYBACK_STS_PLAY) {
-        if (getline(&line, &len, fp) < 0 ) {
-            LOGE("getline error");
-            goto err_unlock;
-        }
-        if (parse_one_record(line, &ts_starttime, &ts_endtime) < 0)
-            goto err_free;
-        if (send_ts(av_index, line, ts_starttime, ts_endtime) < 0)
-            goto err_free;
-        free(line);
     }
+    return &g_sdplay_info.channels[channel];
+}
 
-    res.command = AVIOCTRL_RECORD_PLAY_END;
-    if (lst_send_ioctl(
-                av_index, 
-                LST_USER_IPCAM_RECORD_PLAYCONTROL_RESP,
-                (const char *)&res,
-                sizeof(SMsgAVIoctrlPlayRecordResp)) < 0)
+static inline av_client_t *get_client(int sid)
+{
+    if (sid < 0 || sid >= MAX_CLIENT_NUM)
         return NULL;
-    LOGI("send AVIOCTRL_RECORD_PLAY_END");
-
-err_free:
-    free(line);
-err_unlock:
-    pthread_mutex_unlock(&g_sdplay_info.ts_db_mutex);
-    fclose(fp);
-    return NULL;
+    return &g_sdplay_info.clients[sid];
 }
 
-static int playcontrol_handle(int sid, int ch, char *data)
+static int client_alive(int sid)
 {
-    SMsgAVIoctrlPlayRecord *req = (SMsgAVIoctrlPlayRecord *)data;
-    SMsgAVIoctrlPlayRecordResp res;
-    pthread_t tid;
-    playback_info_t *playback_info_ptr;
-
-    LOGI("cmd:%d",req->command);
-    LOGI("utctime:%d", req->utcTime);
+    av_client_t *client = get_client(sid);
+    int alive = 0;
+
+    if (!client)
+        return 0;
+    pthread_mutex_lock(&client->mutex);
+    alive = client->state == CLIENT_OPEN;
+    pthread_mutex_unlock(&client->mutex);
+    return alive;
+}
 
-    res.command = AVIOCTRL_RECORD_PLAY_START;
-    if (req->command == AVIOCTRL_RECORD_PLAY_START){
-        if (g_sdplay_info.clients[sid].playback_ch < 0) {
-            g_sdplay_info.clients[sid].playback_ch = lst_session_get_free_channel(sid);
-            res.result = g_sdplay_info.clients[sid].playback_ch;
-        } else
-            res.result = -1;
-        if (res.result >= 0) {
-            playback_info_ptr = (playback_info_t *)calloc(1, sizeof(playback_info_t));
-            if (!playback_info_ptr)
-                return -ERRNOMEM;
-            playback_info_ptr->sid = sid;
-            playback_info_ptr->starttime = req->utcTime;
-            pthread_create(&tid, NULL, tslist_playback_thread, (void *)playback_info_ptr);
-        }
-        if (lst_send_ioctl(
-                    ch,
-                    LST_USER_IPCAM_RECORD_PLAYCONTROL_RESP,
-                    (const char *)&res,
-                    sizeof(SMsgAVIoctrlPlayRecordResp)) < 0)
-            return -ERRINTERNAL;
+static void client_put(int sid)
+{
+    av_client_t *client = get_client(sid);
+    int release = 0;
+
+    pthread_mutex_lock(&client->mutex);
+    if (--client->refs == 0) {
+        client->state = CLIENT_FREE;
+        client->av_index = -1;
+        client->playback_ch = -1;
+        client->resume_pending = 0;
+        release = 1;
+    }
+    pthread_mutex_unlock(&client->mutex);
+    /* the sid can't come back before this, so the slot is already free for it */
+    if (release) {
+        lst_close_session(sid);
+        LOGI("sid %d released", sid);
     }
-
-    return 0;
 }
 
-static int cmd_handle(int sid, int ch, int cmd, char *data)
+/* resend the slice an app asked for with SDP_RECORD_PLAY_RESUME */
+static int serve_resume(int sid, sdp_channel_t *chan, int av_index, int digest_algo, int pkt_crc)
 {
-    switch(cmd) {
-        case LST_USER_IPCAM_RECORD_PLAYCONTROL:
-            LOGI("LST_USER_IPCAM_RECORD_PLAYCONTROL");
-            if (playcontrol_handle(sid, ch, data) < 0)
-                goto err;
-            break;
-        case LST_USER_IPCAM_LISTEVENT_REQ:
-            LOGI("LST_USER_IPCAM_LISTEVENT_REQ");
-            if (list_event_handle(ch, data) < 0)
-                goto err;
-            break;
-        case LST_START_PLAY:
-            LOGI("LST_START_PLAY");
-            break;
-        case LST_USER_IPCAM_AUDIOSTART:
-            LOGI("LST_USER_IPCAM_AUDIOSTART");
-            break;
-        case LST_USER_IPCAM_PTZ_COMMAND:
-            LOGI("LST_USER_IPCAM_PTZ_COMMAND");
-            break;
-        default:
-            break;
+    av_client_t *client = &g_sdplay_info.clients[sid];
+    char ts_file[64] = {0};
+    int pending = 0, time = 0, idx = 0;
+    int ts_starttime = 0, ts_endtime = 0, ret = 0;
+
+    pthread_mutex_lock(&client->mutex);
+    pending = client->resume_pending;
+    time = client->resume_time;
+    idx = client->resume_idx;
+    client->resume_pending = 0;
+    pthread_mutex_unlock(&client->mutex);
+    if (!pending)
+        return 0;
+    pthread_mutex_lock(&chan->ts_db_mutex);
+    ret = read_ts_record(chan, time, ts_file, sizeof(ts_file));
+    pthread_mutex_unlock(&chan->ts_db_mutex);
+    if (ret < 0 || parse_one_record(ts_file, &ts_starttime, &ts_endtime) < 0) {
+        LOGE("no slice at %d to resume", time);
+        return 0;
     }
-
+    LOGI("resume %s from packet %d", ts_file, idx);
+    ret = send_ts(sid, av_index, ts_file, ts_starttime, ts_endtime, digest_algo, pkt_crc, idx);
+    if (ret == -ERRINVAL) {
+        LOGE("resume index %d out of %s", idx, ts_file);
+        return 0;
+    }
+    if (ret < 0)
+        return ret;
+    metrics_inc(METRIC_SLICES_RESENT, 1);
+    metrics_session_add(sid, ret);
     return 0;
-err:
-    return -1;
 }
 
-static void *ioctl_thread(void *arg)
+/*
+ * the index line after *pos, ts_db_mutex is only held for the read so
+ * playbacks of one channel don't wait on each other. if the index was
+ * rewritten since, the position is looked up again and every slice
+ * ending before next_time is skipped. ERR_FILE_EMPTY at the end
+ */
+static int read_next_record(sdp_channel_t *chan, long *pos, unsigned int *gen, int next_time, char *out, int size)
 {
-    int sid = (int)arg, ch = 0;
-    int ret = 0;
-
-    if ((ch = lst_create_data_channel(sid, auth_callback )) < 0)
-        return NULL;
-    g_sdplay_info.clients[sid].av_index = ch;
-    while( g_sdplay_info.running ) {
-        unsigned int cmd = 0;
-        char data[1024] = {0};
+    FILE *fp = NULL;
+    int resync = 0, starttime = 0, endtime = 0, ret = -ERRINTERNAL;
+    size_t len = 0;
 
-        ret = lst_recv_ioctl(ch, &cmd, data, sizeof(data), 1000); 
-        if ( ret < 0 ) {
-            if ( ret == LST_ERR_TIMEOUT )
-                continue;
-            return NULL;
-        }
-        if (cmd_handle(sid, ch, cmd, data) < 0 ) {
-            return NULL;
+    pthread_mutex_lock(&chan->ts_db_mutex);
+    if ( (fp = fopen(chan->ts_dbfile, "r")) == NULL ) {
+        LOGE("open file %s error", chan->ts_dbfile);
+        goto out;
+    }
+    if (*gen != chan->ts_db_gen) {
+        *gen = chan->ts_db_gen;
+        *pos = find_start_pos(chan->ts_dbfile, next_time);
+        if (*pos < 0)
+            *pos = 0;
+        resync = 1;
+    }
+    if (fseek(fp, *pos, SEEK_SET) < 0)
+        goto out;
+    for (;;) {
+        /* a line still being appended is not there yet */
+        if ( !fgets(out, size, fp) || (len = strlen(out)) == 0 || out[len-1] != '\n' ) {
+            ret = ERR_FILE_EMPTY;
+            goto out;
         }
+        out[len-1] = '\0';
+        *pos = ftell(fp);
+        if (!resync || (parse_one_record(out, &starttime, &endtime) == 0 && endtime > next_time))
+            break;
     }
-
-    return 0;
+    ret = 0;
+out:
+    if (fp)
+        fclose(fp);
+    pthread_mutex_unlock(&chan->ts_db_mutex);
+    return ret;
 }
 
-static void *sdplay_thread(void *arg)
+/*
+ * the index line before *pos, *pos moves to its start. same locking as
+ * read_next_record, after a rewrite every slice starting at or after
+ * prev_time is skipped. ERR_FILE_EMPTY at the beginning
+ */
+static int read_prev_record(sdp_channel_t *chan, long *pos, unsigned int *gen, int prev_time, char *out, int size)
 {
-    int sid = 0;
-    pthread_t tid;
-
-    (void)arg;
-
-    while( !lst_login_success() )
-        usleep(200);
-
-    while( g_sdplay_info.running ) {
-        LOGI("start to listen");
-        if ( (sid = lst_listen(0)) < 0 ) {
-            LOGE("lst_listen error");
-            continue;
+    FILE *fp = NULL;
+    int resync = 0, starttime = 0, endtime = 0, ret = -ERRINTERNAL;
+    long off = 0;
+    size_t n = 0;
+    char *p = NULL;
+
+    pthread_mutex_lock(&chan->ts_db_mutex);
+    if ( (fp = fopen(chan->ts_dbfile, "r")) == NULL ) {
+        LOGE("open file %s error", chan->ts_dbfile);
+        goto out;
+    }
+    if (*gen != chan->ts_db_gen) {
+        *gen = chan->ts_db_gen;
+        if ( (*pos = find_start_pos(chan->ts_dbfile, prev_time)) < 0 )
+            goto out;
+        resync = 1;
+    }
+    for (;;) {
+        if (*pos <= 0) {
+            ret = ERR_FILE_EMPTY;
+            goto out;
         }
-        LOGI("get connection from client, sid:%d", sid);
-        pthread_create(&tid, NULL, ioctl_thread, (void*)(uintptr_t)sid );
+        off = *pos > size - 1 ? *pos - (size - 1) : 0;
+        if ( fseek(fp, off, SEEK_SET) < 0 || (n = fread(out, 1, *pos - off, fp)) != (size_t)(*pos - off)
+                || out[n-1] != '\n' )
+            goto out;
+        out[n-1] = '\0';
+        /* the end of the line before, not there when it started before off */
+        if ( (p = strrchr(out, '\n')) == NULL && off > 0 )
+            goto out;
+        p = p ? p + 1 : out;
+        *pos = off + (p - out);
+        memmove(out, p, strlen(p) + 1);
+        if (!resync || (parse_one_record(out, &starttime, &endtime) == 0 && starttime < prev_time))
+            break;
     }
+    ret = 0;
+out:
+    if (fp)
+        fclose(fp);
+    pthread_mutex_unlock(&chan->ts_db_mutex);
+    return ret;
+}
 
-    return NULL;
+/* returns once a slice was appended after seen was read, or on a wakeup */
+static void wait_index_append(sdp_channel_t *chan, unsigned int seen, av_client_t *client)
+{
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += FOLLOW_WAIT_MS/1000;
+    pthread_mutex_lock(&chan->ts_db_mutex);
+    if (chan->ts_db_appends == seen && client->playback_sts == PLAYBACK_STS_PLAY)
+        pthread_cond_timedwait(&chan->ts_db_cond, &chan->ts_db_mutex, &deadline);
+    pthread_mutex_unlock(&chan->ts_db_mutex);
 }
 
-int sdp_init( const char *ts_path,
-        const char *sd_mount_path,
-        const char *uid,
-        const char *dev_name,
-        const char *passwd)
+/* followers waiting for new slices recheck their playback state */
+static void wake_followers()
 {
-    pthread_t tid;
     int i = 0;
 
-    ASSERT( ts_path );
-    ASSERT( sd_mount_path );
-    ASSERT( uid );
-    ASSERT( dev_name );
-    ASSERT( passwd );
-
-    for (i=0; i<MAX_CLIENT_NUM; i++) {
-        g_sdplay_info.clients[i].playback_ch = -1;
+    for (i = 0; i < MAX_CHANNEL_NUM; i++) {
+        pthread_mutex_lock(&g_sdplay_info.channels[i].ts_db_mutex);
+        pthread_cond_broadcast(&g_sdplay_info.channels[i].ts_db_cond);
+        pthread_mutex_unlock(&g_sdplay_info.channels[i].ts_db_mutex);
     }
-    g_sdplay_info.ts_dbfile = (char *)calloc(1, strlen(ts_path)+strlen(TS_INDEX_DB)+2);
-    if ( !g_sdplay_info.ts_dbfile)
-        return -ERRNOMEM;
-    sprintf(g_sdplay_info.ts_dbfile, "%s/%s", ts_path, TS_INDEX_DB);
-    g_sdplay_info.segment_dbfile = (char*)calloc(1, strlen(ts_path)+strlen(SEGMENT_DB_FILENAME)+2);
-    if (!g_sdplay_info.segment_dbfile)
-        return -ERRNOMEM;
-    sprintf(g_sdplay_info.segment_dbfile, "%s/%s", ts_path, SEGMENT_DB_FILENAME);
-    g_sdplay_info.running = 1;
-    g_sdplay_info.sd_mount_path = strdup(sd_mount_path);
-    g_sdplay_info.user = strdup(dev_name);
-    g_sdplay_info.passwd = strdup(passwd);
-    g_sdplay_info.ts_delete_count_when_full = DELETE_TS_COUNT;
-    pthread_mutex_init( &g_sdplay_info.ts_db_mutex, NULL );
-    pthread_mutex_init( &g_sdplay_info.segment_db_mutex, NULL );
-    lst_init( uid, dev_name, passwd, MAX_CLIENT_NUM );
-    pthread_create(&tid, NULL, sdplay_thread, NULL);
-
-    return 0;
 }
 
-static int get_sd_free_space(unsigned long long *free_space)
+static void send_play_end(int av_index)
 {
-    struct statfs statbuf;
+    SMsgAVIoctrlPlayRecordResp res;
 
-    ASSERT( g_sdplay_info.sd_mount_path );
-    ASSERT( free_space);
+    memset(&res, 0, sizeof(res));
+    res.command = AVIOCTRL_RECORD_PLAY_END;
+    if (lst_send_ioctl(
+                av_index,
+                LST_USER_IPCAM_RECORD_PLAYCONTROL_RESP,
+                (const char *)&res,
+                sizeof(SMsgAVIoctrlPlayRecordResp)) < 0)
+        return;
+    LOGI("send AVIOCTRL_RECORD_PLAY_END");
+}
 
-#if SDPLAY_DBG
-    *free_space = 1024;
-    return 0;
-#endif
+/* last thing a playback thread does, releases its channel and client ref */
+static void playback_exit(int sid, int av_index)
+{
+    av_client_t *client = &g_sdplay_info.clients[sid];
+
+    sched_leave(sid);
+    lst_close_channel(av_index);
+    metrics_gauge_add(METRIC_PLAYBACKS_ACTIVE, -1);
+    pthread_mutex_lock(&client->mutex);
+    client->playing = 0;
+    client->playback_ch = -1;
+    client->resume_pending = 0;
+    pthread_cond_broadcast(&client->play_cond);
+    pthread_mutex_unlock(&client->mutex);
+    client_put(sid);
+}
 
-    if ( statfs(g_sdplay_info.sd_mount_path, &statbuf) < 0 ) {
-        LOGE("statfs error");
-        return -1;
-    }
-    *free_space = (statbuf.f_bfree)*(statbuf.f_bsize);
+/*
+ * PLAY_CONCAT_FLAG: the slices are joined into one ts and sent in
+ * packets of CONCAT_PKT_SIZE, each with endflag set and the digest of
+ * its own bytes. utctime is the start of the slice the packet starts in
+ */
+typedef struct {
+    int sid;
+    int av_index;
+    int digest_algo;
+    int pkt_crc;
+    ts_concat_t ts;
+    uint8_t *buf;
+    int len;
+    int index;     /* of the next packet */
+    int utctime;
+    int last_end;  /* of the last slice, -1 none yet */
+} concat_ctx_t;
+
+static concat_ctx_t *concat_new(int sid, int av_index, int digest_algo, int pkt_crc)
+{
+    concat_ctx_t *ctx = (concat_ctx_t *)calloc(1, sizeof(concat_ctx_t));
 
-    return 0;
+    if (!ctx)
+        return NULL;
+    if ( (ctx->buf = (uint8_t *)malloc(CONCAT_PKT_SIZE)) == NULL ) {
+        free(ctx);
+        return NULL;
+    }
+    ts_concat_init(&ctx->ts);
+    ctx->sid = sid;
+    ctx->av_index = av_index;
+    ctx->digest_algo = digest_algo;
+    ctx->pkt_crc = pkt_crc;
+    ctx->last_end = -1;
+    return ctx;
 }
 
-static int add_record_to_index_db( const char *ts_name )
+static void concat_free(concat_ctx_t *ctx)
 {
-    FILE *fp = NULL;
+    if (!ctx)
+        return;
+    free(ctx->buf);
+    free(ctx);
+}
 
-    ASSERT( ts_name );
-    ASSERT( g_sdplay_info.ts_dbfile );
+/* returns the bytes sent */
+static int concat_flush(concat_ctx_t *ctx)
+{
+    char digest[DIGEST_STR_LEN] = {0};
+    int len = ctx->len;
+
+    if (!len)
+        return 0;
+    if (digest_calc(ctx->digest_algo, ctx->buf, len, digest) < 0
+            || send_pkt(ctx->sid, ctx->av_index, ctx->index, 1, ctx->utctime, ctx->utctime,
+                ctx->digest_algo, ctx->pkt_crc, digest, ctx->buf, len) < 0)
+        return -1;
+    ctx->index++;
+    ctx->len = 0;
+    metrics_inc(METRIC_BYTES_SENT, len);
+    return len;
+}
 
-    LOGI("called");
+/* the first packet goes out after the first slice, the app starts playing right away */
+static int concat_send_ts(concat_ctx_t *ctx, const char *ts_file, int starttime, int endtime)
+{
+    slice_cache_entry_t *entry = NULL;
+    const uint8_t *data = NULL;
+    int size = 0, off = 0, n = 0, sent = 0, ret = -1;
 
-    pthread_mutex_lock( &g_sdplay_info.ts_db_mutex );
-    if ( (fp = fopen(g_sdplay_info.ts_dbfile, "a")) == NULL ) {
-        LOGE("open file %s error", g_sdplay_info.ts_dbfile);
-        pthread_mutex_unlock( &g_sdplay_info.ts_db_mutex );
+    if (slice_cache_get(ts_file, load_slice, &ctx->sid, &entry) < 0)
         return -1;
+    data = slice_cache_data(entry);
+    size = slice_cache_size(entry);
+    ts_concat_slice(&ctx->ts, ctx->last_end >= 0 && starttime != ctx->last_end);
+    ctx->last_end = endtime;
+    for (off = 0; off + TS_PKT_LEN <= size; off += TS_PKT_LEN) {
+        if (!ctx->len)
+            ctx->utctime = starttime;
+        if ( (n = ts_concat_packet(&ctx->ts, data + off, ctx->buf + ctx->len)) < 0 ) {
+            LOGE("%s is not ts at %d, rest skipped", ts_file, off);
+            break;
+        }
+        ctx->len += n;
+        if (ctx->len < CONCAT_PKT_SIZE)
+            continue;
+        if ( (n = concat_flush(ctx)) < 0 )
+            goto out;
+        sent += n;
     }
-    fwrite(ts_name, strlen(ts_name), 1, fp);
-    fwrite("\n", 1, 1, fp);
-    fclose(fp);
-    pthread_mutex_unlock( &g_sdplay_info.ts_db_mutex );
-
-    return 0;
+    if (!ctx->index) {
+        if ( (n = concat_flush(ctx)) < 0 )
+            goto out;
+        sent += n;
+    }
+    metrics_inc(METRIC_SLICES_SENT, 1);
+    ret = sent;
+out:
+    slice_cache_put(entry);
+    return ret;
 }
 
-static int remove_records_from_index_db()
+/*
+ * PLAY_GAP_FLAG: slices outside every segment are skipped, and before
+ * the first slice after a hole the app gets a marker instead of having
+ * to seek over it
+ */
+typedef struct {
+    int last_end;    /* of the last slice sent, at first the time asked for */
+    int seg_start;   /* the segment looked up last, seg_end 0 none yet */
+    int seg_end;
+    int no_segments; /* the channel saves none, every slice is footage */
+} gap_ctx_t;
+
+/* for seek_segment(), segmentdb is read once, sdp_save_segment_info() keeps it up */
+static int segment_max_len(sdp_channel_t *chan)
 {
-    int i = 0;
-    char *linep = NULL;
-    size_t len = 0;
-    ssize_t read = 0;
-    FILE *fp_old = NULL, *fp_new = NULL;
-    char new_db_file[256] = { 0 };
-    struct stat stat_buf;
+    const char *base = NULL;
+    size_t len = 0, map_len = 0;
+    int max_len = 0;
+
+    pthread_mutex_lock(&chan->segment_db_mutex);
+    if (chan->seg_max_len < 0 && map_db(chan->segment_dbfile, &base, &len, &map_len) == 0) {
+        chan->seg_max_len = segment_list_max_len(base, len);
+        if (base)
+            munmap((void *)base, map_len);
+    }
+    max_len = chan->seg_max_len;
+    pthread_mutex_unlock(&chan->segment_db_mutex);
+    return max_len > 0 ? max_len : 0;
+}
 
-    ASSERT( g_sdplay_info.ts_dbfile );
-    LOGI("called");
+/*
+ * of the segments ending after time the one starting first, 1 found, 0
+ * none after it, ERR_FILE_EMPTY when the channel has no segments at all
+ */
+static int next_segment(sdp_channel_t *chan, int time, int *seg_start, int *seg_end)
+{
+    const char *base = NULL, *p = NULL;
+    size_t len = 0, map_len = 0;
+    int start = 0, end = 0, ret = 0;
+    int max_len = segment_max_len(chan);
 
-    snprintf( new_db_file, sizeof(new_db_file), "/tmp/%s", INDEX_DB_TMP );
-    pthread_mutex_lock( &g_sdplay_info.ts_db_mutex );
-    if( stat(g_sdplay_info.ts_dbfile, &stat_buf) != 0 ) {
-        LOGE("get file %s stat error", g_sdplay_info.ts_dbfile );
-        pthread_mutex_unlock( &g_sdplay_info.ts_db_mutex );
-        return -1;
+    if (map_db(chan->segment_dbfile, &base, &len, &map_len) < 0)
+        return -ERRINTERNAL;
+    if (!base)
+        return ERR_FILE_EMPTY;
+    p = seek_segment(base, len, time+1, max_len);
+    while (p < base+len) {
+        p = scan_record(p, base+len, &start, &end, NULL);
+        if (start >= 0 && end > time) {
+            *seg_start = start;
+            *seg_end = end;
+            ret = 1;
+            break;
+        }
     }
-    if( stat_buf.st_size == 0 ) {
-        LOGE("file %s size is 0", g_sdplay_info.ts_dbfile);
-        pthread_mutex_unlock( &g_sdplay_info.ts_db_mutex );
-        return -1;
+    munmap((void *)base, map_len);
+    return ret;
+}
+
+/*
+ * 1 the slice is to be sent, 0 skipped, ERR_FILE_EMPTY nothing recorded
+ * from it on. *jump is the start of the next segment when the slices up
+ * to it can be passed over at once
+ */
+static int gap_filter(sdp_channel_t *chan, gap_ctx_t *gc, int starttime, int endtime, int follow, int *jump)
+{
+    int ret = 0;
+
+    *jump = 0;
+    /* the slice before a time in a hole, what find_start_pos gives */
+    if (endtime <= gc->last_end)
+        return 0;
+    if (gc->no_segments || (starttime < gc->seg_end && endtime > gc->seg_start))
+        return 1;
+    if (gc->seg_end && endtime <= gc->seg_start)
+        return 0;
+    ret = next_segment(chan, starttime, &gc->seg_start, &gc->seg_end);
+    if (ret == ERR_FILE_EMPTY) {
+        gc->no_segments = 1;
+        return 1;
     }
-    fp_old = fopen(g_sdplay_info.ts_dbfile, "r");
-    if ( !fp_old ) {
-        LOGE("open file %s error", g_sdplay_info.ts_dbfile);
-        pthread_mutex_unlock( &g_sdplay_info.ts_db_mutex );
+    if (ret < 0)
+        return ret;
+    /* a follower may be ahead of the segment still being recorded */
+    if (ret == 0)
+        return follow ? 1 : ERR_FILE_EMPTY;
+    if (gc->seg_start < endtime)
+        return 1;
+    *jump = gc->seg_start;
+    return 0;
+}
+
+static int send_gap(int sid, int ch, int gap_start, int gap_end, int digest_algo, int pkt_crc)
+{
+    sdp_gap_marker_t marker;
+    tag_frame_header_t hdr;
+    int hdr_len = PKT_HDR_LEN;
+
+    marker.gap_start = gap_start;
+    marker.gap_end = gap_end;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.endflag = 1;
+    hdr.utctime = gap_end;
+    hdr.length = sizeof(marker);
+    hdr.reserved[0] = (unsigned char)digest_algo;
+    hdr.reserved[1] = FRAME_GAP_FLAG;
+    if (digest_calc(digest_algo, (const uint8_t *)&marker, sizeof(marker), (char *)hdr.md5_str) < 0)
         return -1;
+    if (pkt_crc) {
+        hdr.reserved[1] |= PKT_CRC_FLAG;
+        hdr.pkt_crc = digest_crc32c(0, (const uint8_t *)&marker, sizeof(marker));
+        hdr_len = sizeof(hdr);
     }
-    fp_new = fopen( new_db_file, "w");
-    if ( !fp_new ) {
-        fclose( fp_old );
-        LOGE("open file %s error", new_db_file);
+    if (sched_acquire(sid, SCHED_UPLINK, hdr_len+sizeof(marker)) < 0)
         return -1;
-    }
-    while( (read = getline( &linep, &len, fp_old)) != -1 ) {
-        if ( ++i != g_sdplay_info.ts_delete_count_when_full ) {
+    LOGI("gap %d-%d", gap_start, gap_end);
+    return lst_send_data(ch, (uint8_t *)&hdr, hdr_len, (uint8_t *)&marker, sizeof(marker));
+}
+
+static void *tslist_playback_thread(void *arg)
+{
+    playback_info_t *playback_info_ptr = (playback_info_t *)arg;
+    int sid = playback_info_ptr->sid;
+    av_client_t *client = &g_sdplay_info.clients[sid];
+    sdp_channel_t *chan = get_channel(playback_info_ptr->channel);
+    int av_index = lst_create_data_channel2(sid, g_sdplay_info.user, g_sdplay_info.passwd, client->playback_ch);
+    int starttime = playback_info_ptr->starttime;
+    int digest_algo = playback_info_ptr->digest_algo;
+    int pkt_crc = playback_info_ptr->pkt_crc;
+    int first_pkt = playback_info_ptr->first_pkt;
+    int follow = playback_info_ptr->follow;
+    int concat = playback_info_ptr->concat;
+    int gaps = playback_info_ptr->gaps;
+    int64_t request_us = playback_info_ptr->request_us;
+    char line[LENGTH_PER_RECORD*2];
+    long pos = 0, jump_pos = 0;
+    unsigned int gen = 0, seen = 0;
+    int ts_starttime = 0, ts_endtime = 0, sent = 0, next_time = starttime, ret = 0, jump = 0;
+    concat_ctx_t *cc = NULL;
+    gap_ctx_t gc;
+
+    pthread_detach(pthread_self());
+    free(playback_info_ptr);
+    memset(&gc, 0, sizeof(gc));
+    gc.last_end = starttime;
+    if (av_index < 0 || !chan)
+        goto out;
+    if (concat && (cc = concat_new(sid, av_index, digest_algo, pkt_crc)) == NULL)
+        goto out;
+    pthread_mutex_lock(&chan->ts_db_mutex);
+    pos = find_start_pos(chan->ts_dbfile, starttime);
+    gen = chan->ts_db_gen;
+    pthread_mutex_unlock(&chan->ts_db_mutex);
+    if (pos < 0)
+        goto out;
+    while(client->playback_sts == PLAYBACK_STS_PLAY) {
+        /* read before the index, an append in between is not missed */
+        seen = __atomic_load_n(&chan->ts_db_appends, __ATOMIC_ACQUIRE);
+        if ( (ret = read_next_record(chan, &pos, &gen, next_time, line, sizeof(line))) == ERR_FILE_EMPTY ) {
+            /* nothing more for a while, what is joined goes out now */
+            if (cc) {
+                if ( (sent = concat_flush(cc)) < 0 )
+                    goto out;
+                metrics_session_add(sid, sent);
+            }
+            if (!follow)
+                break;
+            wait_index_append(chan, seen, client);
+            if (!cc && serve_resume(sid, chan, av_index, digest_algo, pkt_crc) < 0)
+                goto out;
             continue;
         }
-        fwrite(linep, len, 1, fp_new);
-    }
-    fclose(fp_old);
-    fclose(fp_new);
-    remove(g_sdplay_info.ts_dbfile);
-    rename(new_db_file, g_sdplay_info.ts_dbfile);
-    pthread_mutex_unlock(&g_sdplay_info.ts_db_mutex);
+        if (ret < 0) {
+            LOGE("read ts index error");
+            goto out;
+        }
+        if (parse_one_record(line, &ts_starttime, &ts_endtime) < 0)
+            goto out;
+        next_time = ts_endtime;
+        if (gaps && (ret = gap_filter(chan, &gc, ts_starttime, ts_endtime, follow, &jump)) <= 0) {
+            if (ret == ERR_FILE_EMPTY) {
+                if (cc && (sent = concat_flush(cc)) > 0)
+                    metrics_session_add(sid, sent);
+                break;
+            }
+            if (ret < 0)
+                goto out;
+            if (jump) {
+                pthread_mutex_lock(&chan->ts_db_mutex);
+                jump_pos = find_start_pos(chan->ts_dbfile, jump);
+                if (gen == chan->ts_db_gen && jump_pos > pos)
+                    pos = jump_pos;
+                pthread_mutex_unlock(&chan->ts_db_mutex);
+            }
+            continue;
+        }
+        /* evicted since it was indexed */
+        if (access(line, F_OK) != 0) {
+            LOGI("%s is gone, skip", line);
+            continue;
+        }
+        if (gaps && ts_starttime > gc.last_end) {
+            /* what is joined so far plays before the marker */
+            if (cc) {
+                if ( (sent = concat_flush(cc)) < 0 )
+                    goto out;
+                metrics_session_add(sid, sent);
+            }
+            if (send_gap(sid, av_index, gc.last_end, ts_starttime, digest_algo, pkt_crc) < 0)
+                goto out;
+        }
+        gc.last_end = ts_endtime;
+        if (cc)
+            sent = concat_send_ts(cc, line, ts_starttime, ts_endtime);
+        else
+            sent = send_ts(sid, av_index, line, ts_starttime, ts_endtime, digest_algo, pkt_crc, first_pkt);
+        if (sent < 0)
+            goto out;
+        metrics_session_add(sid, sent);
+        if (request_us) {
+            metrics_observe_since(METRIC_HIST_PLAY_START, request_us);
+            request_us = 0;
+        }
+        first_pkt = 0;
+        /* a resume names a slice packet, there is none in one stream */
+        if (!cc && serve_resume(sid, chan, av_index, digest_algo, pkt_crc) < 0)
+            goto out;
+    }
+
+    send_play_end(av_index);
+out:
+    concat_free(cc);
+    playback_exit(sid, av_index);
+    return NULL;
+}
+
+/* like wait_index_append, until until_us(metrics_now_us) or a stop */
+static void pace_until(sdp_channel_t *chan, av_client_t *client, int64_t until_us)
+{
+    struct timespec deadline;
+
+    deadline.tv_sec = until_us/1000000;
+    deadline.tv_nsec = (until_us%1000000)*1000;
+    pthread_mutex_lock(&chan->ts_db_mutex);
+    while (client->playback_sts == PLAYBACK_STS_PLAY
+            && pthread_cond_timedwait(&chan->ts_db_cond, &chan->ts_db_mutex, &deadline) != ETIMEDOUT)
+        ;
+    pthread_mutex_unlock(&chan->ts_db_mutex);
+}
+
+/* the slice start plus the pts distance from the first keyframe of the slice */
+static int keyframe_time(int slice_start, const ts_keyframe_t *kf, const ts_keyframe_t *first)
+{
+    if (kf->pts < 0 || first->pts < 0)
+        return slice_start;
+    return slice_start + (int)(((kf->pts - first->pts) & ((1LL << 33) - 1))/TS_PTS_HZ);
+}
+
+typedef struct {
+    int sid;
+    int av_index;
+    sdp_channel_t *chan;
+    av_client_t *client;
+    playback_info_t info;
+    int64_t begin_us;   /* when the first one went out */
+    int begin_time;     /* and its time */
+    int sent;
+} reverse_ctx_t;
+
+/* one item at time going backward, false when the playback is over */
+static int reverse_pace(reverse_ctx_t *ctx, int time)
+{
+    if (ctx->client->playback_sts != PLAYBACK_STS_PLAY)
+        return 0;
+    if (ctx->info.steps && ctx->sent >= ctx->info.steps)
+        return 0;
+    if (!ctx->sent) {
+        ctx->begin_us = metrics_now_us();
+        ctx->begin_time = time;
+    } else if (ctx->info.speed) {
+        pace_until(ctx->chan, ctx->client,
+                ctx->begin_us + (int64_t)(ctx->begin_time - time)*1000000/ctx->info.speed);
+    }
+    return ctx->client->playback_sts == PLAYBACK_STS_PLAY;
+}
+
+/*
+ * keyframes of the slice latest first, each as a small ts of its own
+ */
+static int send_keyframes_reverse(reverse_ctx_t *ctx, slice_cache_entry_t *entry, int ts_starttime)
+{
+    const uint8_t *ts = slice_cache_data(entry);
+    int size = slice_cache_size(entry);
+    ts_keyframe_t kfs[MAX_SLICE_KEYFRAMES];
+    char digest[DIGEST_STR_LEN] = {0};
+    uint8_t *buf = NULL;
+    int count = 0, from = 0, time = 0, len = 0, sent = 0, ret = 0;
+
+    while (count < MAX_SLICE_KEYFRAMES && ts_next_keyframe(ts, size, from, &kfs[count]) == 0) {
+        from = kfs[count].end;
+        count++;
+    }
+    while (count-- > 0) {
+        time = keyframe_time(ts_starttime, &kfs[count], &kfs[0]);
+        if (time > ctx->info.starttime)
+            continue;
+        if (!reverse_pace(ctx, time))
+            break;
+        if ( (buf = (uint8_t *)malloc(kfs[count].end - kfs[count].off + 2*TS_PKT_LEN)) == NULL )
+            return -ERRNOMEM;
+        len = ts_copy_keyframe(ts, size, &kfs[count], buf, kfs[count].end - kfs[count].off + 2*TS_PKT_LEN);
+        if ( len < 0 || digest_calc(ctx->info.digest_algo, buf, len, digest) < 0
+                || (sent = send_slice_buf(ctx->sid, ctx->av_index, buf, len, time, time,
+                        ctx->info.digest_algo, ctx->info.pkt_crc, digest, 0)) < 0 )
+            ret = -1;
+        free(buf);
+        if (ret < 0)
+            return ret;
+        metrics_session_add(ctx->sid, sent);
+        ctx->sent++;
+    }
+    return 0;
+}
+
+/*
+ * AVIOCTRL_RECORD_PLAY_BACKWARD and STEPBACKWARD, walks the index from
+ * the slice covering starttime towards the oldest one
+ */
+static void *reverse_playback_thread(void *arg)
+{
+    reverse_ctx_t ctx;
+    slice_cache_entry_t *entry = NULL;
+    char line[LENGTH_PER_RECORD*2];
+    long pos = 0;
+    unsigned int gen = 0;
+    int ts_starttime = 0, ts_endtime = 0, prev_time = 0, ret = 0, sent = 0;
+
+    pthread_detach(pthread_self());
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.info = *(playback_info_t *)arg;
+    free(arg);
+    ctx.sid = ctx.info.sid;
+    ctx.client = &g_sdplay_info.clients[ctx.sid];
+    ctx.chan = get_channel(ctx.info.channel);
+    ctx.av_index = lst_create_data_channel2(ctx.sid, g_sdplay_info.user, g_sdplay_info.passwd, ctx.client->playback_ch);
+    if (ctx.av_index < 0 || !ctx.chan)
+        goto out;
+    pthread_mutex_lock(&ctx.chan->ts_db_mutex);
+    pos = find_start_pos(ctx.chan->ts_dbfile, ctx.info.starttime);
+    gen = ctx.chan->ts_db_gen;
+    pthread_mutex_unlock(&ctx.chan->ts_db_mutex);
+    /* past the slice covering starttime, the first read_prev_record returns it */
+    if (pos < 0 || read_next_record(ctx.chan, &pos, &gen, ctx.info.starttime, line, sizeof(line)) < 0
+            || parse_one_record(line, &ts_starttime, &prev_time) < 0)
+        goto end;
+    for (;;) {
+        if ( (ret = read_prev_record(ctx.chan, &pos, &gen, prev_time, line, sizeof(line))) == ERR_FILE_EMPTY )
+            break;
+        if (ret < 0 || parse_one_record(line, &ts_starttime, &ts_endtime) < 0) {
+            LOGE("read ts index error");
+            goto out;
+        }
+        prev_time = ts_starttime;
+        if (ts_starttime > ctx.info.starttime || access(line, F_OK) != 0)
+            continue;
+        if (!ctx.info.keyframes) {
+            if (!reverse_pace(&ctx, ts_starttime))
+                break;
+            if ( (sent = send_ts(ctx.sid, ctx.av_index, line, ts_starttime, ts_endtime,
+                            ctx.info.digest_algo, ctx.info.pkt_crc, 0)) < 0 )
+                goto out;
+            metrics_session_add(ctx.sid, sent);
+            ctx.sent++;
+        } else {
+            if (slice_cache_get(line, load_slice, &ctx.sid, &entry) < 0)
+                goto out;
+            ret = send_keyframes_reverse(&ctx, entry, ts_starttime);
+            slice_cache_put(entry);
+            if (ret < 0)
+                goto out;
+        }
+        if (ctx.client->playback_sts != PLAYBACK_STS_PLAY || (ctx.info.steps && ctx.sent >= ctx.info.steps))
+            break;
+        if (serve_resume(ctx.sid, ctx.chan, ctx.av_index, ctx.info.digest_algo, ctx.info.pkt_crc) < 0)
+            goto out;
+    }
+end:
+    send_play_end(ctx.av_index);
+out:
+    playback_exit(ctx.sid, ctx.av_index);
+    return NULL;
+}
+
+static int start_playback(int sid, SMsgAVIoctrlPlayRecord *req, int first_pkt)
+{
+    av_client_t *client = get_client(sid);
+    playback_info_t *playback_info_ptr;
+    void *(*thread)(void *) = tslist_playback_thread;
+    pthread_t tid;
+    int free_ch = 0;
+
+    if (!client || !get_channel(req->channel))
+        return -1;
+    playback_info_ptr = (playback_info_t *)calloc(1, sizeof(playback_info_t));
+    if (!playback_info_ptr)
+        return -ERRNOMEM;
+    pthread_mutex_lock(&client->mutex);
+    if (client->state != CLIENT_OPEN || client->playing) {
+        pthread_mutex_unlock(&client->mutex);
+        free(playback_info_ptr);
+        return -1;
+    }
+    if ( (free_ch = lst_session_get_free_channel(sid)) < 0 ) {
+        pthread_mutex_unlock(&client->mutex);
+        free(playback_info_ptr);
+        return -1;
+    }
+    /* the playback thread's ref, dropped when it exits */
+    client->refs++;
+    client->playing = 1;
+    client->playback_ch = free_ch;
+    client->playback_sts = PLAYBACK_STS_PLAY;
+    pthread_mutex_unlock(&client->mutex);
+    playback_info_ptr->sid = sid;
+    playback_info_ptr->channel = req->channel;
+    playback_info_ptr->starttime = req->utcTime;
+    /* app asks for a digest in reserved[0], old apps leave it 0(md5) */
+    playback_info_ptr->digest_algo = digest_supported(req->reserved[0]) ? req->reserved[0] : DIGEST_MD5;
+    playback_info_ptr->pkt_crc = req->reserved[1] & PKT_CRC_FLAG;
+    playback_info_ptr->follow = !!(req->reserved[1] & PLAY_FOLLOW_FLAG);
+    playback_info_ptr->concat = !!(req->reserved[1] & PLAY_CONCAT_FLAG);
+    playback_info_ptr->gaps = !!(req->reserved[1] & PLAY_GAP_FLAG);
+    playback_info_ptr->first_pkt = first_pkt;
+    playback_info_ptr->request_us = metrics_now_us();
+    if (req->command == AVIOCTRL_RECORD_PLAY_BACKWARD) {
+        playback_info_ptr->keyframes = req->Param & BACKWARD_KEYFRAMES;
+        playback_info_ptr->speed = (req->Param >> 8) & 0xff;
+        thread = reverse_playback_thread;
+    } else if (req->command == AVIOCTRL_RECORD_PLAY_STEPBACKWARD) {
+        /* the keyframe before the picture the app shows */
+        playback_info_ptr->starttime = req->utcTime - 1;
+        playback_info_ptr->keyframes = 1;
+        playback_info_ptr->steps = 1;
+        thread = reverse_playback_thread;
+    }
+    metrics_gauge_add(METRIC_PLAYBACKS_ACTIVE, 1);
+    sched_join(sid);
+    if (pthread_create(&tid, NULL, thread, (void *)playback_info_ptr) != 0) {
+        sched_leave(sid);
+        metrics_gauge_add(METRIC_PLAYBACKS_ACTIVE, -1);
+        pthread_mutex_lock(&client->mutex);
+        client->playing = 0;
+        client->playback_ch = -1;
+        pthread_mutex_unlock(&client->mutex);
+        free(playback_info_ptr);
+        client_put(sid);
+        return -ERRINTERNAL;
+    }
+    return free_ch;
+}
+
+/* the thread sees it after the slice in flight and releases its channel */
+static int stop_playback(int sid)
+{
+    av_client_t *client = get_client(sid);
+    int ret = -1;
+
+    if (!client)
+        return -1;
+    pthread_mutex_lock(&client->mutex);
+    if (client->playing) {
+        client->playback_sts = PLAYBACK_STS_STOP;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&client->mutex);
+    /* a throttled or following thread would only see it after its wait */
+    if (ret == 0) {
+        sched_cancel(sid);
+        wake_followers();
+    }
+    return ret;
+}
+
+/*
+ * stops the running playback and waits until its thread let go of the
+ * channel, so a reverse request takes over without a STOP round trip.
+ * the stopped one still ends with AVIOCTRL_RECORD_PLAY_END
+ */
+static int takeover_playback(int sid)
+{
+    av_client_t *client = get_client(sid);
+    struct timespec deadline;
+    int ret = 0;
+
+    if (!client || stop_playback(sid) < 0)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += TAKEOVER_WAIT_MS/1000;
+    pthread_mutex_lock(&client->mutex);
+    while (client->playing && ret != ETIMEDOUT)
+        ret = pthread_cond_timedwait(&client->play_cond, &client->mutex, &deadline);
+    ret = client->playing ? -1 : 0;
+    pthread_mutex_unlock(&client->mutex);
+    if (ret < 0)
+        LOGE("playback of sid %d did not stop in time", sid);
+    return ret;
+}
+
+/*
+ * SDP_RECORD_PLAY_RESUME: utcTime is the start time of the slice,
+ * Param the first packet index the app is missing. during playback the
+ * slice is resent between two slices, otherwise playback starts over
+ * from that packet
+ */
+static int resume_playback(int sid, SMsgAVIoctrlPlayRecord *req)
+{
+    av_client_t *client = get_client(sid);
+    int ret = -1;
+
+    if (!client)
+        return -1;
+    pthread_mutex_lock(&client->mutex);
+    if (client->playing) {
+        client->resume_time = req->utcTime;
+        client->resume_idx = req->Param;
+        client->resume_pending = 1;
+        ret = client->playback_ch;
+    }
+    pthread_mutex_unlock(&client->mutex);
+    if (ret < 0)
+        ret = start_playback(sid, req, req->Param);
+    return ret;
+}
+
+static int playcontrol_handle(int sid, int ch, char *data)
+{
+    SMsgAVIoctrlPlayRecord *req = (SMsgAVIoctrlPlayRecord *)data;
+    SMsgAVIoctrlPlayRecordResp res;
+    int ret = 0;
+
+    LOGI("cmd:%d",req->command);
+    LOGI("utctime:%d", req->utcTime);
+
+    LOGI("channel:%d", req->channel);
+
+    memset(&res, 0, sizeof(res));
+    res.command = req->command;
+    if (req->command == AVIOCTRL_RECORD_PLAY_START)
+        ret = start_playback(sid, req, 0);
+    else if (req->command == SDP_RECORD_PLAY_RESUME)
+        ret = resume_playback(sid, req);
+    else if (req->command == AVIOCTRL_RECORD_PLAY_STOP)
+        ret = stop_playback(sid);
+    else if (req->command == AVIOCTRL_RECORD_PLAY_BACKWARD
+            || req->command == AVIOCTRL_RECORD_PLAY_STEPBACKWARD)
+        ret = takeover_playback(sid) < 0 ? -1 : start_playback(sid, req, 0);
+    else
+        return 0;
+    if (ret == -ERRNOMEM)
+        return ret;
+    res.result = ret < 0 ? -1 : ret;
+    if (lst_send_ioctl(
+                ch,
+                LST_USER_IPCAM_RECORD_PLAYCONTROL_RESP,
+                (const char *)&res,
+                sizeof(SMsgAVIoctrlPlayRecordResp)) < 0)
+        return -ERRINTERNAL;
+
+    return 0;
+}
+
+/* the stop flag is checked between the writes, so a stop never waits for a whole slice */
+static int export_write(int sid, int bulk, const uint8_t *data, int len)
+{
+    av_client_t *client = &g_sdplay_info.clients[sid];
+    int n = 0, off = 0;
+
+    for (off = 0; off < len; off += n) {
+        n = MIN(len - off, EXPORT_WRITE_SIZE);
+        if (client->export_sts != PLAYBACK_STS_PLAY
+                || sched_acquire(EXPORT_SCHED_ID(sid), SCHED_UPLINK, n) < 0
+                || lst_write_bulk(bulk, data + off, n) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * read past the slice cache, an hour of footage would push out what
+ * the interactive playbacks keep there. returns the bytes sent
+ */
+static int export_slice(int sid, int bulk, const char *ts_file, int starttime, int endtime,
+        int digest_algo, int offset)
+{
+    sdp_export_slice_hdr_t hdr;
+    int sched_id = EXPORT_SCHED_ID(sid), size = 0, ret = -1;
+    uint8_t *buf = NULL;
+
+    if (load_slice(ts_file, &sched_id, &buf, &size) < 0)
+        return -1;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = SDP_EXPORT_MAGIC;
+    hdr.starttime = starttime;
+    hdr.endtime = endtime;
+    hdr.size = size;
+    if (offset > size) {
+        LOGE("resume offset %d out of %s", offset, ts_file);
+        offset = 0;
+    }
+    hdr.offset = offset;
+    hdr.digest_algo = digest_algo;
+    if (digest_calc(digest_algo, buf, size, hdr.digest) < 0)
+        goto out;
+    if (export_write(sid, bulk, (const uint8_t *)&hdr, sizeof(hdr)) < 0
+            || export_write(sid, bulk, buf + offset, size - offset) < 0)
+        goto out;
+    ret = size - offset;
+out:
+    free(buf);
+    return ret;
+}
+
+/*
+ * an export runs beside the playback of its session, as a background
+ * job of the scheduler. the stream ends with a header of size 0, any
+ * other end aborts it so the app knows to resume
+ */
+static void *export_thread(void *arg)
+{
+    export_info_t info = *(export_info_t *)arg;
+    av_client_t *client = &g_sdplay_info.clients[info.sid];
+    sdp_channel_t *chan = get_channel(info.channel);
+    sdp_export_slice_hdr_t end;
+    char line[LENGTH_PER_RECORD*2];
+    long pos = 0;
+    unsigned int gen = 0;
+    int ts_starttime = 0, ts_endtime = 0, sent = 0, done = 0, ret = 0;
+    int next_time = info.resume_time ? info.resume_time : info.starttime;
+    int bulk = -1;
+
+    pthread_detach(pthread_self());
+    free(arg);
+    if (!chan || (bulk = lst_open_bulk(info.sid, info.ch, EXPORT_OPEN_TIMEOUT_MS)) < 0)
+        goto out;
+    LOGI("export %d-%d of channel %d to sid %d", info.starttime, info.endtime, info.channel, info.sid);
+    pthread_mutex_lock(&chan->ts_db_mutex);
+    pos = find_start_pos(chan->ts_dbfile, next_time);
+    gen = chan->ts_db_gen;
+    pthread_mutex_unlock(&chan->ts_db_mutex);
+    if (pos < 0)
+        pos = 0;
+    while (client->export_sts == PLAYBACK_STS_PLAY) {
+        if ( (ret = read_next_record(chan, &pos, &gen, next_time, line, sizeof(line))) == ERR_FILE_EMPTY ) {
+            done = 1;
+            break;
+        }
+        if (ret < 0 || parse_one_record(line, &ts_starttime, &ts_endtime) < 0) {
+            LOGE("read ts index error");
+            goto out;
+        }
+        if (ts_starttime >= info.endtime) {
+            done = 1;
+            break;
+        }
+        next_time = ts_endtime;
+        if (ts_endtime <= info.starttime || access(line, F_OK) != 0)
+            continue;
+        sent = export_slice(info.sid, bulk, line, ts_starttime, ts_endtime, info.digest_algo,
+                ts_starttime == info.resume_time ? info.resume_offset : 0);
+        if (sent < 0)
+            goto out;
+        metrics_inc(METRIC_BYTES_SENT, sent);
+        metrics_session_add(info.sid, sent);
+    }
+    if (done) {
+        memset(&end, 0, sizeof(end));
+        end.magic = SDP_EXPORT_MAGIC;
+        if (export_write(info.sid, bulk, (const uint8_t *)&end, sizeof(end)) < 0)
+            done = 0;
+    }
+    LOGI("export of sid %d %s", info.sid, done ? "done" : "stopped");
+out:
+    lst_close_bulk(bulk, !done);
+    sched_leave(EXPORT_SCHED_ID(info.sid));
+    pthread_mutex_lock(&client->mutex);
+    client->exporting = 0;
+    pthread_mutex_unlock(&client->mutex);
+    client_put(info.sid);
+    return NULL;
+}
+
+static int start_export(int sid, sdp_export_req_t *req)
+{
+    av_client_t *client = get_client(sid);
+    export_info_t *info = NULL;
+    pthread_t tid;
+    int free_ch = 0;
+
+    /* answered right away where there is no stream to open later */
+    if (!client || !lst_bulk_supported() || !get_channel(req->channel)
+            || req->endtime <= req->starttime || !digest_supported(req->digest_algo))
+        return -1;
+    if ( (info = (export_info_t *)calloc(1, sizeof(export_info_t))) == NULL )
+        return -ERRNOMEM;
+    pthread_mutex_lock(&client->mutex);
+    if (client->state != CLIENT_OPEN || client->exporting
+            || (free_ch = lst_session_get_free_channel(sid)) < 0) {
+        pthread_mutex_unlock(&client->mutex);
+        free(info);
+        return -1;
+    }
+    /* the export thread's ref */
+    client->refs++;
+    client->exporting = 1;
+    client->export_sts = PLAYBACK_STS_PLAY;
+    pthread_mutex_unlock(&client->mutex);
+    info->sid = sid;
+    info->channel = req->channel;
+    info->ch = free_ch;
+    info->starttime = req->starttime;
+    info->endtime = req->endtime;
+    info->digest_algo = req->digest_algo;
+    info->resume_time = req->resume_time;
+    info->resume_offset = req->resume_offset;
+    sched_reset_session(EXPORT_SCHED_ID(sid));
+    sched_set_background(EXPORT_SCHED_ID(sid), 1);
+    sched_join(EXPORT_SCHED_ID(sid));
+    if (pthread_create(&tid, NULL, export_thread, (void *)info) != 0) {
+        sched_leave(EXPORT_SCHED_ID(sid));
+        lst_close_channel(free_ch);
+        pthread_mutex_lock(&client->mutex);
+        client->exporting = 0;
+        pthread_mutex_unlock(&client->mutex);
+        free(info);
+        client_put(sid);
+        return -ERRINTERNAL;
+    }
+    return free_ch;
+}
+
+/* also when the session goes, the thread sees it before its next write */
+static int stop_export(int sid)
+{
+    av_client_t *client = get_client(sid);
+    int ret = -1;
+
+    if (!client)
+        return -1;
+    pthread_mutex_lock(&client->mutex);
+    if (client->exporting) {
+        client->export_sts = PLAYBACK_STS_STOP;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&client->mutex);
+    if (ret == 0)
+        sched_cancel(EXPORT_SCHED_ID(sid));
+    return ret;
+}
+
+static int export_handle(int sid, int ch, char *data)
+{
+    sdp_export_req_t *req = (sdp_export_req_t *)data;
+    sdp_export_resp_t res;
+    int ret = -1;
+
+    LOGI("export cmd:%u channel:%u %u-%u", req->command, req->channel, req->starttime, req->endtime);
+    memset(&res, 0, sizeof(res));
+    res.command = req->command;
+    if (req->command == SDP_EXPORT_START)
+        ret = start_export(sid, req);
+    else if (req->command == SDP_EXPORT_STOP)
+        ret = stop_export(sid);
+    if (ret == -ERRNOMEM)
+        return ret;
+    res.result = ret < 0 ? -1 : ret;
+    if (lst_send_ioctl(ch, LST_USER_SDP_EXPORT_RESP, (const char *)&res, sizeof(res)) < 0)
+        return -ERRINTERNAL;
+    return 0;
+}
+
+static int metrics_handle(int ch)
+{
+    metrics_report_t report;
+
+    metrics_report(&report);
+    if (lst_send_ioctl(ch, LST_USER_SDP_METRICS_RESP, (const char *)&report, sizeof(report)) < 0)
+        return -ERRINTERNAL;
+    return 0;
+}
+
+typedef struct {
+    uint8_t *buf;
+    int len;
+    int size;
+} thumb_batch_t;
+
+static int append_thumb(int time, const uint8_t *thumb, int size, void *arg)
+{
+    thumb_batch_t *batch = (thumb_batch_t *)arg;
+    uint32_t hdr[2] = { (uint32_t)time, (uint32_t)size };
+
+    if (batch->len + (int)sizeof(hdr) + size > batch->size)
+        return -ERRINVAL;
+    memcpy(batch->buf + batch->len, hdr, sizeof(hdr));
+    memcpy(batch->buf + batch->len + sizeof(hdr), thumb, size);
+    batch->len += sizeof(hdr) + size;
+    return 0;
+}
+
+/* the batch is collected first, the store is not held while it is sent */
+static int thumb_handle(int ch, char *data)
+{
+    sdp_thumb_req_t *req = (sdp_thumb_req_t *)data;
+    uint8_t msg[LST_MAX_IOCTL_SIZE];
+    sdp_thumb_resp_hdr_t *hdr = (sdp_thumb_resp_hdr_t *)msg;
+    sdp_channel_t *chan = get_channel(req->channel);
+    thumb_batch_t batch;
+    int count = 0, off = 0, max_count = req->max_count ? (int)MIN(req->max_count, THUMB_MAX_COUNT) : THUMB_DEFAULT_COUNT;
+    int ret = -ERRINTERNAL;
+
+    memset(&batch, 0, sizeof(batch));
+    batch.size = sizeof(uint32_t) + THUMB_BATCH_MAX_BYTES + max_count*2*sizeof(uint32_t);
+    if ( (batch.buf = (uint8_t *)malloc(batch.size)) == NULL )
+        return -ERRNOMEM;
+    batch.len = sizeof(uint32_t);
+    if ( chan && (count = thumb_store_query(&chan->thumbs, req->starttime, req->endtime,
+                    max_count, THUMB_BATCH_MAX_BYTES, append_thumb, &batch)) < 0 ) {
+        LOGE("query thumbnails %u-%u error", req->starttime, req->endtime);
+        count = 0;
+        batch.len = sizeof(uint32_t);
+    }
+    memcpy(batch.buf, &count, sizeof(uint32_t));
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->channel = req->channel;
+    for (off = 0; off < batch.len; off += hdr->len, hdr->index++) {
+        hdr->len = MIN(batch.len - off, (int)(sizeof(msg) - sizeof(*hdr)));
+        hdr->endflag = off + (int)hdr->len >= batch.len;
+        memcpy(msg + sizeof(*hdr), batch.buf + off, hdr->len);
+        if (lst_send_ioctl(ch, LST_USER_SDP_THUMB_RESP, (const char *)msg, sizeof(*hdr) + hdr->len) < 0)
+            goto out;
+    }
+    ret = 0;
+out:
+    free(batch.buf);
+    return ret;
+}
+
+static int cmd_handle(int sid, int ch, int cmd, char *data)
+{
+    switch(cmd) {
+        case LST_USER_IPCAM_RECORD_PLAYCONTROL:
+            LOGD("LST_USER_IPCAM_RECORD_PLAYCONTROL");
+            if (playcontrol_handle(sid, ch, data) < 0)
+                goto err;
+            break;
+        case LST_USER_IPCAM_LISTEVENT_REQ:
+            LOGD("LST_USER_IPCAM_LISTEVENT_REQ");
+            if (list_event_handle(ch, data) < 0)
+                goto err;
+            break;
+        case LST_USER_SDP_METRICS_REQ:
+            LOGD("LST_USER_SDP_METRICS_REQ");
+            if (metrics_handle(ch) < 0)
+                goto err;
+            break;
+        case LST_USER_SDP_THUMB_REQ:
+            LOGD("LST_USER_SDP_THUMB_REQ");
+            if (thumb_handle(ch, data) < 0)
+                goto err;
+            break;
+        case LST_USER_SDP_EXPORT_REQ:
+            LOGD("LST_USER_SDP_EXPORT_REQ");
+            if (export_handle(sid, ch, data) < 0)
+                goto err;
+            break;
+        case LST_START_PLAY:
+            LOGD("LST_START_PLAY");
+            break;
+        case LST_USER_IPCAM_AUDIOSTART:
+            LOGD("LST_USER_IPCAM_AUDIOSTART");
+            break;
+        case LST_USER_IPCAM_PTZ_COMMAND:
+            LOGD("LST_USER_IPCAM_PTZ_COMMAND");
+            break;
+        default:
+            break;
+    }
+
+    return 0;
+err:
+    return -1;
+}
+
+static void session_lost(int sid)
+{
+    av_client_t *client = get_client(sid);
+
+    if (!client)
+        return;
+    LOGI("sid %d lost", sid);
+    /* no blocking here, the ioctl loop notices on its next timeout */
+    pthread_mutex_lock(&client->mutex);
+    if (client->state == CLIENT_OPEN) {
+        client->state = CLIENT_CLOSING;
+        client->playback_sts = PLAYBACK_STS_STOP;
+    }
+    pthread_mutex_unlock(&client->mutex);
+    sched_cancel(sid);
+    stop_export(sid);
+    wake_followers();
+}
+
+static void session_open(int sid, int ch)
+{
+    av_client_t *client = get_client(sid);
+
+    if (!client) {
+        LOGE("invalid sid %d", sid);
+        lst_close_channel(ch);
+        lst_close_session(sid);
+        return;
+    }
+    pthread_mutex_lock(&client->mutex);
+    if (client->state != CLIENT_FREE) {
+        pthread_mutex_unlock(&client->mutex);
+        LOGE("sid %d still in use", sid);
+        return;
+    }
+    client->state = CLIENT_OPEN;
+    client->refs = 1;
+    client->av_index = ch;
+    client->playback_ch = -1;
+    client->playback_sts = PLAYBACK_STS_PLAY;
+    pthread_mutex_unlock(&client->mutex);
+    sched_reset_session(sid);
+    lst_watch_session(sid, session_lost);
+    metrics_inc(METRIC_SESSIONS_TOTAL, 1);
+    metrics_gauge_add(METRIC_SESSIONS_ACTIVE, 1);
+    metrics_session_reset(sid);
+}
+
+static void session_ioctl(int sid, int ch, unsigned int cmd, char *data, int size)
+{
+    (void)size;
+
+    if (!client_alive(sid))
+        return;
+    if (cmd_handle(sid, ch, cmd, data) < 0)
+        LOGE("handle cmd 0x%x of sid %d error", cmd, sid);
+}
+
+/*
+ * stops the session's playback and releases its ioctl channel right
+ * away, the sid is freed once the playback thread is out too. a close
+ * of a playback channel only ends that playback
+ */
+static void session_close(int sid, int ch)
+{
+    av_client_t *client = get_client(sid);
+    int av_index = -1;
+
+    if (!client)
+        return;
+    pthread_mutex_lock(&client->mutex);
+    if (client->state == CLIENT_FREE || client->av_index < 0
+            || (ch != client->av_index && ch >= 0)) {
+        pthread_mutex_unlock(&client->mutex);
+        return;
+    }
+    client->state = CLIENT_CLOSING;
+    client->playback_sts = PLAYBACK_STS_STOP;
+    av_index = client->av_index;
+    client->av_index = -1;
+    pthread_mutex_unlock(&client->mutex);
+    sched_cancel(sid);
+    stop_export(sid);
+    wake_followers();
+    lst_close_channel(av_index);
+    metrics_gauge_add(METRIC_SESSIONS_ACTIVE, -1);
+    client_put(sid);
+}
+
+static void *ioctl_thread(void *arg)
+{
+    int sid = (int)(uintptr_t)arg, ch = 0;
+    int ret = 0;
+
+    pthread_detach(pthread_self());
+    if ((ch = lst_create_data_channel(sid, auth_callback )) < 0)
+        return NULL;
+    session_open(sid, ch);
+    while( g_sdplay_info.running && client_alive(sid) ) {
+        unsigned int cmd = 0;
+        char data[LST_MAX_IOCTL_SIZE] = {0};
+
+        ret = lst_recv_ioctl(ch, &cmd, data, sizeof(data), 1000); 
+        if ( ret < 0 ) {
+            if ( ret == LST_ERR_TIMEOUT )
+                continue;
+            break;
+        }
+        if (cmd_handle(sid, ch, cmd, data) < 0 ) {
+            break;
+        }
+    }
+    session_close(sid, ch);
+
+    return 0;
+}
+
+static void *sdplay_thread(void *arg)
+{
+    static const lst_handlers_t handlers = {
+        .auth = auth_callback,
+        .on_open = session_open,
+        .on_ioctl = session_ioctl,
+        .on_close = session_close,
+    };
+    int sid = 0;
+    pthread_t tid;
+
+    (void)arg;
+
+    /* callback driven backends need no listen loop and no thread per client */
+    if ( lst_event_driven() ) {
+        if ( lst_serve(&handlers) < 0 )
+            LOGE("lst_serve error");
+        return NULL;
+    }
+
+    lst_wait_login(-1);
+
+    while( g_sdplay_info.running ) {
+        LOGI("start to listen");
+        if ( (sid = lst_listen(0)) < 0 ) {
+            LOGE("lst_listen error");
+            continue;
+        }
+        LOGI("get connection from client, sid:%d", sid);
+        pthread_create(&tid, NULL, ioctl_thread, (void*)(uintptr_t)sid );
+    }
+
+    return NULL;
+}
+
+/*
+ * crash recovery
+ *
+ * a power cut can leave a torn last line in the db files, or an index
+ * whose head/tail points at slices that are gone. torn lines are cut
+ * off at sdp_init, anything worse rebuilds the channel's ts index from
+ * the slice file names in a background thread, so boot isn't delayed
+ */
+typedef struct {
+    int starttime;
+    int endtime;
+    int channel;
+    int valid;
+    char name[64];
+} recover_entry_t;
+
+typedef struct {
+    recover_entry_t *entries;
+    int begin;
+    int end;
+} recover_job_t;
+
+/* cut a torn last line, returns the size left */
+static long truncate_torn_tail(const char *db_file, int *truncated)
+{
+    char buf[LENGTH_PER_RECORD*2];
+    struct stat stat_buf;
+    long size = 0, off = 0;
+    size_t read = 0;
+    FILE *fp = NULL;
+
+    if ( stat(db_file, &stat_buf) != 0 || stat_buf.st_size == 0 )
+        return 0;
+    size = (long)stat_buf.st_size;
+    if ( (fp = fopen(db_file, "r")) == NULL )
+        return -1;
+    off = size > (long)sizeof(buf) ? size - (long)sizeof(buf) : 0;
+    fseek(fp, off, SEEK_SET);
+    read = fread(buf, 1, sizeof(buf), fp);
+    fclose(fp);
+    if ( read == 0 || buf[read-1] == '\n' )
+        return size;
+    while ( read > 0 && buf[read-1] != '\n' )
+        read--;
+    LOGE("%s has a torn record, cut to %ld bytes", db_file, off+(long)read);
+    if ( truncate(db_file, off+(long)read) < 0 )
+        return -1;
+    if (truncated)
+        *truncated = 1;
+    return off+(long)read;
+}
+
+static int slice_exists(const char *record)
+{
+    char name[64] = {0};
+
+    if ( sscanf(record, "%63s", name) != 1 )
+        return 0;
+    return access(name, F_OK) == 0;
+}
+
+/*
+ * returns 1 when the ts index of the channel must be rebuilt, *created
+ * when it was missing, it is only lost if slices of the channel are left
+ */
+static int check_ts_index(sdp_channel_t *chan, int *created)
+{
+    long size = 0;
+    int record_len = 0, total = 0, truncated = 0;
+    char *line = NULL;
+    size_t len = 0;
+    FILE *fp = NULL;
+    int ret = 0;
+
+    if ( access(chan->ts_dbfile, F_OK) != 0 ) {
+        if ( (fp = fopen(chan->ts_dbfile, "a")) != NULL )
+            fclose(fp);
+        *created = 1;
+        return 1;
+    }
+    /* torn while appending, the slice itself made it to the card */
+    if ( (size = truncate_torn_tail(chan->ts_dbfile, &truncated)) <= 0 || truncated )
+        return size < 0 || truncated;
+    if ( get_record_info_in_db(chan->ts_dbfile, &record_len, &total) < 0
+            || size % record_len != 0 )
+        return 1;
+    if ( (fp = fopen(chan->ts_dbfile, "r")) == NULL )
+        return 1;
+    /* retention deletes files before rewriting the index, check the head too */
+    if ( getline(&line, &len, fp) <= 0 || !slice_exists(line) )
+        ret = 1;
+    if ( !ret && (fseek(fp, size-record_len, SEEK_SET) < 0
+                || getline(&line, &len, fp) <= 0 || !slice_exists(line)) )
+        ret = 1;
+    free(line);
+    fclose(fp);
+    return ret;
+}
+
+static void check_segment_db(const char *db_file)
+{
+    long size = truncate_torn_tail(db_file, NULL);
+
+    if ( size > 0 && size % (SEGMENT_RECORD_LEN-1) != 0 ) {
+        LOGE("%s size %ld, drop the partial record", db_file, size);
+        if ( truncate(db_file, size - size % (SEGMENT_RECORD_LEN-1)) < 0 )
+            LOGE("truncate %s error, %s", db_file, strerror(errno));
+    }
+}
+
+static int parse_ts_filename(const char *name, recover_entry_t *entry)
+{
+    int n = 0;
+
+    if ( sscanf(name, "%d-%d_ch%d.ts%n", &entry->starttime, &entry->endtime, &entry->channel, &n) == 3
+            && n > 0 && name[n] == '\0' )
+        return entry->channel > 0 && entry->channel < MAX_CHANNEL_NUM ? 0 : -1;
+    n = 0;
+    if ( sscanf(name, "%d-%d.ts%n", &entry->starttime, &entry->endtime, &n) == 2
+            && n > 0 && name[n] == '\0' ) {
+        entry->channel = 0;
+        return 0;
+    }
+    return -1;
+}
+
+/*
+ * stat is the slow part on a sd card, split it over the workers. ingest
+ * goes on meanwhile, an empty file may be a slice being written, so it
+ * is left out of the index but never removed here
+ */
+static void *recover_worker(void *arg)
+{
+    recover_job_t *job = (recover_job_t *)arg;
+    struct stat stat_buf;
+    int i = 0;
+
+    for (i = job->begin; i < job->end; i++) {
+        recover_entry_t *entry = &job->entries[i];
+
+        if ( stat(entry->name, &stat_buf) == 0 && stat_buf.st_size > 0 )
+            entry->valid = 1;
+    }
+    return NULL;
+}
+
+static int cmp_recover_entry(const void *a, const void *b)
+{
+    const recover_entry_t *x = (const recover_entry_t *)a, *y = (const recover_entry_t *)b;
+
+    if (x->channel != y->channel)
+        return x->channel - y->channel;
+    return (x->starttime > y->starttime) - (x->starttime < y->starttime);
+}
+
+/*
+ * slices saved while the scan ran are already appended to the old
+ * index, carry them over before the rebuilt one replaces it
+ */
+static int rebuild_ts_index(sdp_channel_t *chan, recover_entry_t *entries, int count)
+{
+    char tmp_file[256] = {0};
+    FILE *fp_new = NULL, *fp_old = NULL;
+    int i = 0, last = INT_MIN, starttime = 0, endtime = 0;
+    char *line = NULL;
+    size_t len = 0;
+    ssize_t read = 0;
+
+    snprintf(tmp_file, sizeof(tmp_file), "%s%s", chan->ts_dbfile, DB_TMP_SUFFIX);
+    if ( (fp_new = fopen(tmp_file, "w")) == NULL ) {
+        LOGE("open file %s error", tmp_file);
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        fprintf(fp_new, "%s\n", entries[i].name);
+        last = entries[i].starttime;
+    }
+    pthread_mutex_lock(&chan->ts_db_mutex);
+    if ( (fp_old = fopen(chan->ts_dbfile, "r")) != NULL ) {
+        while ( (read = getline(&line, &len, fp_old)) > 0 ) {
+            if ( line[read-1] != '\n' )
+                break;
+            parse_one_record(line, &starttime, &endtime);
+            if ( starttime > last && slice_exists(line) )
+                fwrite(line, read, 1, fp_new);
+        }
+        free(line);
+        fclose(fp_old);
+    }
+    fclose(fp_new);
+    rename(tmp_file, chan->ts_dbfile);
+    chan->ts_db_gen++;
+    pthread_mutex_unlock(&chan->ts_db_mutex);
+    LOGI("rebuilt %s, %d slices", chan->ts_dbfile, count);
+    return 0;
+}
+
+static void *recover_thread(void *arg)
+{
+    unsigned int channel_mask = (unsigned int)(uintptr_t)arg;
+    recover_entry_t *entries = NULL, *tmp = NULL;
+    recover_job_t jobs[RECOVER_WORKER_NUM];
+    pthread_t tids[RECOVER_WORKER_NUM];
+    int count = 0, capacity = 0, i = 0, begin = 0;
+    struct dirent *dirent = NULL;
+    DIR *dir = NULL;
+
+    pthread_detach(pthread_self());
+    /* slices are saved relative to the working directory */
+    if ( (dir = opendir(".")) == NULL ) {
+        LOGE("opendir error, %s", strerror(errno));
+        return NULL;
+    }
+    while ( (dirent = readdir(dir)) != NULL ) {
+        recover_entry_t entry;
+
+        memset(&entry, 0, sizeof(entry));
+        if ( strlen(dirent->d_name) >= sizeof(entry.name)
+                || parse_ts_filename(dirent->d_name, &entry) < 0
+                || !(channel_mask & (1u << entry.channel)) )
+            continue;
+        if (count == capacity) {
+            capacity = capacity ? capacity*2 : 1024;
+            if ( (tmp = (recover_entry_t *)realloc(entries, capacity*sizeof(recover_entry_t))) == NULL ) {
+                LOGE("realloc error");
+                goto out;
+            }
+            entries = tmp;
+        }
+        strcpy(entry.name, dirent->d_name);
+        entries[count++] = entry;
+    }
+    for (i = 0; i < RECOVER_WORKER_NUM; i++) {
+        jobs[i].entries = entries;
+        jobs[i].begin = count*i/RECOVER_WORKER_NUM;
+        jobs[i].end = count*(i+1)/RECOVER_WORKER_NUM;
+        pthread_create(&tids[i], NULL, recover_worker, &jobs[i]);
+    }
+    for (i = 0; i < RECOVER_WORKER_NUM; i++)
+        pthread_join(tids[i], NULL);
+    for (i = 0, begin = 0; i < count; i++) {
+        if (entries[i].valid)
+            entries[begin++] = entries[i];
+    }
+    count = begin;
+    qsort(entries, count, sizeof(recover_entry_t), cmp_recover_entry);
+    for (i = 0, begin = 0; i < MAX_CHANNEL_NUM; i++) {
+        int end = begin;
+
+        while (end < count && entries[end].channel == i)
+            end++;
+        if (channel_mask & (1u << i))
+            rebuild_ts_index(&g_sdplay_info.channels[i], entries+begin, end-begin);
+        begin = end;
+    }
+out:
+    closedir(dir);
+    free(entries);
+    return NULL;
+}
+
+/* the channels of channel_mask that have slice files in the working directory */
+static unsigned int channels_with_slices(unsigned int channel_mask)
+{
+    unsigned int found = 0;
+    struct dirent *dirent = NULL;
+    recover_entry_t entry;
+    DIR *dir = NULL;
+
+    if ( (dir = opendir(".")) == NULL ) {
+        LOGE("opendir error, %s", strerror(errno));
+        return channel_mask;
+    }
+    while ( found != channel_mask && (dirent = readdir(dir)) != NULL ) {
+        if ( parse_ts_filename(dirent->d_name, &entry) == 0 )
+            found |= channel_mask & (1u << entry.channel);
+    }
+    closedir(dir);
+    return found;
+}
+
+/* the segmentdb_evXX lists there are, one directory read instead of probing every event type */
+static void check_event_dbs(const char *ts_path)
+{
+    char event_db[256] = {0};
+    struct dirent *dirent = NULL;
+    const char *name = NULL;
+    DIR *dir = NULL;
+    int i = 0, event = 0, n = 0;
+    size_t len = 0;
+
+    if ( (dir = opendir(ts_path)) == NULL ) {
+        LOGE("opendir %s error, %s", ts_path, strerror(errno));
+        return;
+    }
+    while ( (dirent = readdir(dir)) != NULL ) {
+        for (i = 0; i < MAX_CHANNEL_NUM; i++) {
+            sdp_channel_t *chan = &g_sdplay_info.channels[i];
+
+            name = strrchr(chan->segment_dbfile, '/') + 1;
+            len = strlen(name);
+            n = 0;
+            if ( strncmp(dirent->d_name, name, len) != 0
+                    || sscanf(dirent->d_name+len, "_ev%2x%n", &event, &n) != 1
+                    || n != 5 || dirent->d_name[len+n] != '\0' )
+                continue;
+            get_event_db_path(chan, event, event_db, sizeof(event_db));
+            check_segment_db(event_db);
+            break;
+        }
+    }
+    closedir(dir);
+}
+
+static void recover_channels(const char *ts_path)
+{
+    unsigned int channel_mask = 0, created_mask = 0;
+    pthread_t tid;
+    int i = 0, created = 0;
+
+    for (i = 0; i < MAX_CHANNEL_NUM; i++) {
+        sdp_channel_t *chan = &g_sdplay_info.channels[i];
+
+        created = 0;
+        if ( check_ts_index(chan, &created) ) {
+            if (created) {
+                created_mask |= 1u << i;
+            } else {
+                LOGE("ts index of channel %d needs rebuild", i);
+                channel_mask |= 1u << i;
+            }
+        }
+        check_segment_db(chan->segment_dbfile);
+    }
+    check_event_dbs(ts_path);
+    /* a new card has no index and nothing to rebuild it from */
+    if (created_mask) {
+        created_mask = channels_with_slices(created_mask);
+        for (i = 0; i < MAX_CHANNEL_NUM; i++) {
+            if (created_mask & (1u << i))
+                LOGE("ts index of channel %d is lost, rebuild", i);
+        }
+        channel_mask |= created_mask;
+    }
+    if (channel_mask)
+        pthread_create(&tid, NULL, recover_thread, (void *)(uintptr_t)channel_mask);
+}
+
+/*
+ * channel 0 keeps the original file names, so single lens devices
+ * upgrading in place still find their old index
+ */
+static char *make_db_path(const char *ts_path, const char *db_name, int channel)
+{
+    char *path = (char *)calloc(1, strlen(ts_path)+strlen(db_name)+16);
+
+    if (!path)
+        return NULL;
+    if (channel == 0)
+        sprintf(path, "%s/%s", ts_path, db_name);
+    else
+        sprintf(path, "%s/%s_ch%d", ts_path, db_name, channel);
+    return path;
+}
+
+int sdp_init( const char *ts_path,
+        const char *sd_mount_path,
+        const char *uid,
+        const char *dev_name,
+        const char *passwd)
+{
+    pthread_condattr_t cond_attr;
+    pthread_t tid;
+    char *thumb_db = NULL;
+    int i = 0;
+
+    ASSERT( ts_path );
+    ASSERT( sd_mount_path );
+    ASSERT( uid );
+    ASSERT( dev_name );
+    ASSERT( passwd );
+
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    for (i=0; i<MAX_CLIENT_NUM; i++) {
+        g_sdplay_info.clients[i].av_index = -1;
+        g_sdplay_info.clients[i].playback_ch = -1;
+        pthread_mutex_init( &g_sdplay_info.clients[i].mutex, NULL );
+        pthread_cond_init( &g_sdplay_info.clients[i].play_cond, &cond_attr );
+    }
+    for (i=0; i<MAX_CHANNEL_NUM; i++) {
+        sdp_channel_t *chan = &g_sdplay_info.channels[i];
+
+        if ( !(chan->ts_dbfile = make_db_path(ts_path, TS_INDEX_DB, i)) )
+            return -ERRNOMEM;
+        if ( !(chan->segment_dbfile = make_db_path(ts_path, SEGMENT_DB_FILENAME, i)) )
+            return -ERRNOMEM;
+        pthread_mutex_init( &chan->ts_db_mutex, NULL );
+        pthread_cond_init( &chan->ts_db_cond, &cond_attr );
+        pthread_mutex_init( &chan->segment_db_mutex, NULL );
+        chan->seg_max_len = -1;
+        pthread_mutex_init( &chan->rec_mutex, NULL );
+        if ( !(thumb_db = make_db_path(ts_path, THUMB_DB, i)) )
+            return -ERRNOMEM;
+        if ( thumb_store_init(&chan->thumbs, thumb_db) < 0 )
+            LOGE("init thumbnails of channel %d error", i);
+        free(thumb_db);
+    }
+    pthread_condattr_destroy(&cond_attr);
+    metrics_init();
+    /* the login goes on in the background while the index is checked */
+    lst_init( uid, dev_name, passwd, MAX_CLIENT_NUM );
+    for (i=0; i<MAX_CHANNEL_NUM; i++) {
+        if ( migrate_legacy_segment_db(&g_sdplay_info.channels[i]) < 0 )
+            LOGE("migrate segment db of channel %d error", i);
+    }
+    recover_channels(ts_path);
+    g_sdplay_info.running = 1;
+    g_sdplay_info.sd_mount_path = strdup(sd_mount_path);
+    g_sdplay_info.user = strdup(dev_name);
+    g_sdplay_info.passwd = strdup(passwd);
+    g_sdplay_info.ts_delete_count_when_full = DELETE_TS_COUNT;
+    pthread_mutex_init( &g_sdplay_info.retention_mutex, NULL );
+    pthread_create(&tid, NULL, sdplay_thread, NULL);
+
+    return 0;
+}
+
+static int get_sd_free_space(unsigned long long *free_space)
+{
+    struct statfs statbuf;
+
+    ASSERT( g_sdplay_info.sd_mount_path );
+    ASSERT( free_space);
+
+#if SDPLAY_DBG
+    *free_space = 1024;
+    return 0;
+#endif
+
+    if ( statfs(g_sdplay_info.sd_mount_path, &statbuf) < 0 ) {
+        LOGE("statfs error");
+        return -1;
+    }
+    *free_space = (statbuf.f_bfree)*(statbuf.f_bsize);
+
+    return 0;
+}
+
+static int add_record_to_index_db( sdp_channel_t *chan, const char *ts_name )
+{
+    FILE *fp = NULL;
+
+    ASSERT( ts_name );
+    ASSERT( chan->ts_dbfile );
+
+    LOGD("called");
+
+    pthread_mutex_lock( &chan->ts_db_mutex );
+    if ( (fp = fopen(chan->ts_dbfile, "a")) == NULL ) {
+        LOGE("open file %s error", chan->ts_dbfile);
+        pthread_mutex_unlock( &chan->ts_db_mutex );
+        return -1;
+    }
+    fwrite(ts_name, strlen(ts_name), 1, fp);
+    fwrite("\n", 1, 1, fp);
+    fclose(fp);
+    __atomic_add_fetch(&chan->ts_db_appends, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&chan->ts_db_cond);
+    pthread_mutex_unlock( &chan->ts_db_mutex );
+
+    return 0;
+}
+
+static int remove_records_from_index_db( sdp_channel_t *chan )
+{
+    int i = 0;
+    char *linep = NULL;
+    size_t len = 0;
+    ssize_t read = 0;
+    FILE *fp_old = NULL, *fp_new = NULL;
+    char new_db_file[256] = { 0 };
+    struct stat stat_buf;
+
+    ASSERT( chan->ts_dbfile );
+    LOGI("called");
+
+    /* keep the tmp file on the same filesystem, rename() can't cross mounts */
+    snprintf( new_db_file, sizeof(new_db_file), "%s%s", chan->ts_dbfile, DB_TMP_SUFFIX );
+    pthread_mutex_lock( &chan->ts_db_mutex );
+    if( stat(chan->ts_dbfile, &stat_buf) != 0 ) {
+        LOGE("get file %s stat error", chan->ts_dbfile );
+        pthread_mutex_unlock( &chan->ts_db_mutex );
+        return -1;
+    }
+    if( stat_buf.st_size == 0 ) {
+        LOGE("file %s size is 0", chan->ts_dbfile);
+        pthread_mutex_unlock( &chan->ts_db_mutex );
+        return -1;
+    }
+    fp_old = fopen(chan->ts_dbfile, "r");
+    if ( !fp_old ) {
+        LOGE("open file %s error", chan->ts_dbfile);
+        pthread_mutex_unlock( &chan->ts_db_mutex );
+        return -1;
+    }
+    fp_new = fopen( new_db_file, "w");
+    if ( !fp_new ) {
+        fclose( fp_old );
+        LOGE("open file %s error", new_db_file);
+        pthread_mutex_unlock( &chan->ts_db_mutex );
+        return -1;
+    }
+    while( (read = getline( &linep, &len, fp_old)) != -1 ) {
+        if ( ++i <= g_sdplay_info.ts_delete_count_when_full ) {
+            continue;
+        }
+        fwrite(linep, read, 1, fp_new);
+    }
+    free(linep);
+    fclose(fp_old);
+    fclose(fp_new);
+    remove(chan->ts_dbfile);
+    rename(new_db_file, chan->ts_dbfile);
+    chan->ts_db_gen++;
+    pthread_mutex_unlock(&chan->ts_db_mutex);
+    return 0;
+}
+
+static int release_sd_space( sdp_channel_t *chan )
+{
+    int i = 0;
+    FILE *fp = NULL;
+    size_t len = 0;
+    ssize_t read = 0;
+    char *line = NULL;
+
+    if ( (fp = fopen(chan->ts_dbfile, "r")) == NULL ) {
+        LOGE("open file %s error", chan->ts_dbfile );
+        return -1;
+    }
+    for (i = 0; i < g_sdplay_info.ts_delete_count_when_full; ++i) {
+        if ( (read = getline(&line, &len, fp)) < 0 )
+            break;
+        if ( read > 0 && line[read-1] == '\n' )
+            line[read-1] = '\0';
+        slice_cache_invalidate(line);
+        if( remove(line) < 0 )
+            LOGE("remove %s error, %s", line, strerror(errno));
+        else
+            metrics_inc(METRIC_SLICES_EVICTED, 1);
+    }
+    free(line);
+    fclose( fp );
+
+    return 0;
+}
+
+/*
+ * the sd card budget is shared by all channels, evict from the channel
+ * whose oldest slice is the oldest on the card
+ */
+static sdp_channel_t *pick_channel_to_evict()
+{
+    int i = 0, starttime = 0, endtime = 0, oldest = 0;
+    sdp_channel_t *victim = NULL;
+    char *line = NULL;
+    size_t len = 0;
+    FILE *fp = NULL;
+
+    for (i = 0; i < MAX_CHANNEL_NUM; i++) {
+        sdp_channel_t *chan = &g_sdplay_info.channels[i];
+
+        if ( (fp = fopen(chan->ts_dbfile, "r")) == NULL )
+            continue;
+        if ( getline(&line, &len, fp) > 0 ) {
+            parse_one_record(line, &starttime, &endtime);
+            if ( !victim || starttime < oldest ) {
+                victim = chan;
+                oldest = starttime;
+            }
+        }
+        fclose(fp);
+    }
+    free(line);
+
+    return victim;
+}
+
+static int make_ts_filename(int channel, int starttime, int endtime, char *out, size_t size)
+{
+    if (channel == 0)
+        return snprintf( out, size, "%d-%d.ts", starttime, endtime );
+    return snprintf( out, size, "%d-%d_ch%d.ts", starttime, endtime, channel );
+}
+
+/* caller holds retention_mutex */
+static int evict_oldest_slices()
+{
+    sdp_channel_t *victim = pick_channel_to_evict();
+
+    if (!victim)
+        return -1;
+    release_sd_space(victim);
+    return remove_records_from_index_db(victim);
+}
+
+int sdp_release_space()
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&g_sdplay_info.retention_mutex);
+    ret = evict_oldest_slices();
+    pthread_mutex_unlock(&g_sdplay_info.retention_mutex);
+    return ret;
+}
+
+/* one keyframe every interval seconds into the channel's thumbnail store */
+static void save_thumbnails(sdp_channel_t *chan, const uint8_t *ts_buf, int size, int starttime)
+{
+    ts_keyframe_t first, kf;
+    uint8_t *buf = NULL;
+    int from = 0, time = 0, len = 0;
+
+    while (ts_next_keyframe(ts_buf, size, from, &kf) == 0) {
+        if (!from)
+            first = kf;
+        from = kf.end;
+        time = keyframe_time(starttime, &kf, &first);
+        if (!thumb_store_want(&chan->thumbs, time))
+            continue;
+        if ( (buf = (uint8_t *)malloc(kf.end - kf.off + 2*TS_PKT_LEN)) == NULL )
+            return;
+        if ( (len = ts_copy_keyframe(ts_buf, size, &kf, buf, kf.end - kf.off + 2*TS_PKT_LEN)) > 0 )
+            thumb_store_add(&chan->thumbs, time, buf, len);
+        free(buf);
+    }
+}
+
+static int write_slice(int channel, const uint8_t *ts_buf, size_t size, int starttime, int endtime)
+{
+    char filename[512] = { 0 };
+    FILE *fp = NULL;
+    unsigned long long free_space = 0;
+    sdp_channel_t *chan = get_channel(channel);
+    int ret = 0;
+    int64_t begin = metrics_now_us(), write_begin = 0;
+
+    ASSERT( ts_buf );
+
+    if (!chan)
+        return -ERRINVAL;
+    pthread_mutex_lock(&g_sdplay_info.retention_mutex);
+    if ( get_sd_free_space(&free_space) < 0 ) {
+        pthread_mutex_unlock(&g_sdplay_info.retention_mutex);
+        return -1;
+    }
+    if ( free_space < SD_SPACE_THREHOLD )
+        evict_oldest_slices();
+    pthread_mutex_unlock(&g_sdplay_info.retention_mutex);
+    make_ts_filename( channel, starttime, endtime, filename, sizeof(filename) );
+    write_begin = metrics_now_us();
+    if( (fp = fopen(filename, "w")) == NULL ){
+        LOGE("open %s error, %s", filename, strerror(errno) );
+        metrics_inc(METRIC_SAVE_ERRORS, 1);
+        return -1;
+    }
+    ret = fwrite( ts_buf, size, 1, fp);
+    LOGD("ret = %d", ret );
+    fclose(fp);
+    metrics_observe_since(METRIC_HIST_SD_WRITE, write_begin);
+    if (ret != 1 && size)
+        metrics_inc(METRIC_SAVE_ERRORS, 1);
+    else
+        slice_cache_insert(filename, ts_buf, size);
+    save_thumbnails(chan, ts_buf, (int)size, starttime);
+    CALL( add_record_to_index_db(chan, filename) );
+    metrics_inc(METRIC_SLICES_SAVED, 1);
+    metrics_inc(METRIC_BYTES_SAVED, size);
+    metrics_observe_since(METRIC_HIST_SAVE_TS, begin);
+
+    return 0;
+}
+
+/* rec_mutex held, the merged slices go to the card as one */
+static int flush_pending(sdp_channel_t *chan, int channel)
+{
+    int len = chan->pend_len;
+
+    if (!len)
+        return 0;
+    chan->pend_len = 0;
+    return write_slice(channel, chan->pend_buf, len, chan->pend_start, chan->pend_end);
+}
+
+static int coalesced_enough(sdp_channel_t *chan, int duration, int size)
+{
+    return (chan->coalesce_sec && duration >= chan->coalesce_sec)
+        || (chan->coalesce_bytes && size >= chan->coalesce_bytes);
+}
+
+/* joined as one ts, what does not parse as ts is appended as it is */
+static int pending_append(sdp_channel_t *chan, const uint8_t *buf, int size, int starttime, int endtime)
+{
+    uint8_t *p = NULL;
+    int off = 0, n = 0;
+
+    if (chan->pend_len + size > chan->pend_size) {
+        n = MIN(MAX(chan->pend_len + size, chan->pend_size*2), COALESCE_MAX_BYTES);
+        if ( (p = (uint8_t *)realloc(chan->pend_buf, n)) == NULL )
+            return -ERRNOMEM;
+        chan->pend_buf = p;
+        chan->pend_size = n;
+    }
+    if (!chan->pend_len) {
+        ts_concat_init(&chan->pend_ts);
+        chan->pend_start = starttime;
+    }
+    ts_concat_slice(&chan->pend_ts, 0);
+    for (off = 0; off + TS_PKT_LEN <= size; off += TS_PKT_LEN) {
+        if ( (n = ts_concat_packet(&chan->pend_ts, buf + off, chan->pend_buf + chan->pend_len)) < 0 )
+            break;
+        chan->pend_len += n;
+    }
+    memcpy(chan->pend_buf + chan->pend_len, buf + off, size - off);
+    chan->pend_len += size - off;
+    chan->pend_end = endtime;
+    return 0;
+}
+
+/*
+ * rec_mutex held. with a minimum set, back to back slices shorter than
+ * it wait in ram and are stored as one file with one index record
+ */
+static int store_slice(int channel, const uint8_t *buf, int size, int starttime, int endtime)
+{
+    sdp_channel_t *chan = get_channel(channel);
+
+    if (!chan->coalesce_sec && !chan->coalesce_bytes)
+        return write_slice(channel, buf, size, starttime, endtime);
+    if (chan->pend_len && (starttime != chan->pend_end || chan->pend_len + size > COALESCE_MAX_BYTES))
+        CALL( flush_pending(chan, channel) );
+    if (!chan->pend_len && (size > COALESCE_MAX_BYTES || coalesced_enough(chan, endtime - starttime, size)))
+        return write_slice(channel, buf, size, starttime, endtime);
+    if (pending_append(chan, buf, size, starttime, endtime) < 0) {
+        CALL( flush_pending(chan, channel) );
+        return write_slice(channel, buf, size, starttime, endtime);
+    }
+    if (coalesced_enough(chan, chan->pend_end - chan->pend_start, chan->pend_len))
+        return flush_pending(chan, channel);
+    return 0;
+}
+
+/* rec_mutex held */
+static void close_event_segment(sdp_channel_t *chan, int channel)
+{
+    if (!chan->seg_open)
+        return;
+    chan->seg_open = 0;
+    /* the segment is listed once all of it is on the card */
+    if (flush_pending(chan, channel) < 0)
+        LOGE("write merged slices of channel %d error", channel);
+    if (chan->seg_end > chan->seg_start
+            && sdp_save_segment_info(channel, chan->seg_start, chan->seg_end, chan->seg_event) < 0)
+        LOGE("save segment %d-%d of channel %d error", chan->seg_start, chan->seg_end, channel);
+}
+
+static int write_preroll_slice(const uint8_t *buf, int size, int starttime, int endtime, void *arg)
+{
+    int channel = *(int *)arg;
+
+    CALL( store_slice(channel, buf, size, starttime, endtime) );
+    get_channel(channel)->seg_end = endtime;
+    return 0;
+}
+
+int sdp_save_ts(int channel, const uint8_t *ts_buf, size_t size, int starttime, int endtime)
+{
+    sdp_channel_t *chan = get_channel(channel);
+    int ret = 0;
+
+    ASSERT( ts_buf );
+
+    if (!chan)
+        return -ERRINVAL;
+    pthread_mutex_lock(&chan->rec_mutex);
+    if (chan->seg_open && starttime >= chan->seg_deadline)
+        close_event_segment(chan, channel);
+    if (chan->rec_mode == SDP_RECORD_EVENT && !chan->seg_open) {
+        /* quiet scene, only the ram ring sees it */
+        if ( (ret = preroll_push(&chan->preroll, ts_buf, (int)size, starttime, endtime)) < 0 )
+            LOGE("slice %d-%d of %zu bytes does not fit the pre-roll ring", starttime, endtime, size);
+    } else if ( (ret = store_slice(channel, ts_buf, (int)size, starttime, endtime)) == 0 && chan->seg_open ) {
+        chan->seg_end = endtime;
+    }
+    pthread_mutex_unlock(&chan->rec_mutex);
+    return ret;
+}
+
+int sdp_set_coalesce(int channel, int min_sec, int min_bytes)
+{
+    sdp_channel_t *chan = get_channel(channel);
+    int ret = 0;
+
+    if (!chan || min_sec < 0 || min_bytes < 0 || min_bytes > COALESCE_MAX_BYTES)
+        return -ERRINVAL;
+    pthread_mutex_lock(&chan->rec_mutex);
+    ret = flush_pending(chan, channel);
+    chan->coalesce_sec = min_sec;
+    chan->coalesce_bytes = min_bytes;
+    if (!min_sec && !min_bytes) {
+        free(chan->pend_buf);
+        chan->pend_buf = NULL;
+        chan->pend_size = 0;
+    }
+    pthread_mutex_unlock(&chan->rec_mutex);
+    LOGI("channel %d merges slices up to %ds or %d bytes", channel, min_sec, min_bytes);
+    return ret;
+}
+
+int sdp_flush_ts(int channel)
+{
+    sdp_channel_t *chan = get_channel(channel);
+    int ret = 0;
+
+    if (!chan)
+        return -ERRINVAL;
+    pthread_mutex_lock(&chan->rec_mutex);
+    ret = flush_pending(chan, channel);
+    pthread_mutex_unlock(&chan->rec_mutex);
+    return ret;
+}
+
+int sdp_set_thumb_interval(int channel, int interval)
+{
+    sdp_channel_t *chan = get_channel(channel);
+
+    if (!chan || interval < 0)
+        return -ERRINVAL;
+    thumb_store_set_interval(&chan->thumbs, interval);
     return 0;
 }
 
-static int release_sd_space()
+int sdp_set_record_mode(int channel, int mode, int preroll_sec, int postroll_sec)
 {
-    int i = 0;
-    FILE *fp = NULL;
-    char db_file[256] = { 0 };
-    size_t len = 0;
-    char *line = NULL;
+    sdp_channel_t *chan = get_channel(channel);
+    int ret = 0;
 
-    if ( (fp = fopen(g_sdplay_info.ts_dbfile, "r")) == NULL ) {
-        LOGE("open file %s error", db_file );
-        return -1;
-    }
-    for (i = 0; i < g_sdplay_info.ts_delete_count_when_full; ++i) {
-        CALL( getline(&line, &len, fp) );
-        if ( !line ) {
-            LOGE("check line error");
-            fclose( fp );
-            return -1;
-        }
-        if( remove(line) < 0 ) {
-            fclose( fp );
-            return -1;
+    if (!chan || preroll_sec < 0 || postroll_sec < 0)
+        return -ERRINVAL;
+    if (mode != SDP_RECORD_CONTINUOUS && mode != SDP_RECORD_EVENT)
+        return -ERRINVAL;
+    pthread_mutex_lock(&chan->rec_mutex);
+    close_event_segment(chan, channel);
+    if (flush_pending(chan, channel) < 0)
+        LOGE("write merged slices of channel %d error", channel);
+    preroll_free(&chan->preroll);
+    chan->rec_mode = SDP_RECORD_CONTINUOUS;
+    if (mode == SDP_RECORD_EVENT) {
+        if ( (ret = preroll_init(&chan->preroll, SDP_PREROLL_BYTES, preroll_sec)) == 0 ) {
+            chan->rec_mode = SDP_RECORD_EVENT;
+            chan->postroll_sec = postroll_sec;
         }
     }
-    fclose( fp );
-
-    return 0;
+    pthread_mutex_unlock(&chan->rec_mutex);
+    LOGI("channel %d record mode %d, pre-roll %ds post-roll %ds", channel, mode, preroll_sec, postroll_sec);
+    return ret;
 }
 
-int sdp_save_ts(const uint8_t *ts_buf, size_t size, int starttime, int endtime)
+/*
+ * the first event writes out the pre-roll and opens a segment starting
+ * at its oldest slice, every event pushes the end of it further
+ */
+int sdp_event_trigger(int channel, int event, int time)
 {
-    char filename[512] = { 0 };
-    FILE *fp = NULL;
-    unsigned long long free_space = 0;
+    sdp_channel_t *chan = get_channel(channel);
     int ret = 0;
 
-    ASSERT( ts_buf );
-
-    CALL(get_sd_free_space(&free_space));
-    if ( free_space < SD_SPACE_THREHOLD ) {
-        release_sd_space();
-        remove_records_from_index_db();
+    if (!chan || event <= AVIOCTRL_EVENT_ALL || event > 0xff)
+        return -ERRINVAL;
+    pthread_mutex_lock(&chan->rec_mutex);
+    if (chan->rec_mode != SDP_RECORD_EVENT) {
+        pthread_mutex_unlock(&chan->rec_mutex);
+        return -ERRINVAL;
     }
-    snprintf( filename, sizeof(filename), "%d-%d.ts", starttime, endtime );
-    if( (fp = fopen(filename, "w")) == NULL ){
-        LOGE("open %s error, %s", filename, strerror(errno) );
-        return -1;
+    if (!chan->seg_open) {
+        chan->seg_open = 1;
+        chan->seg_event = event;
+        chan->seg_start = preroll_oldest(&chan->preroll);
+        if (chan->seg_start < 0)
+            chan->seg_start = time;
+        chan->seg_end = chan->seg_start;
+        chan->seg_deadline = time;
+        if ( (ret = preroll_drain(&chan->preroll, write_preroll_slice, &channel)) < 0 )
+            LOGE("write pre-roll of channel %d error", channel);
     }
-    ret = fwrite( ts_buf, size, 1, fp);
-    LOGI("ret = %d", ret );
-    fclose(fp);
-    CALL( add_record_to_index_db(filename) );
-    CALL(get_sd_free_space(&free_space));
-
-    return 0;
+    chan->seg_deadline = MAX(chan->seg_deadline, time + chan->postroll_sec);
+    pthread_mutex_unlock(&chan->rec_mutex);
+    return ret;
 }
 
 static int get_file_size( const char *file )
@@ -515,6 +2569,18 @@ static inline int parse_one_record( char *record, int *starttime, int *endtime )
     return 0;
 }
 
+static inline int parse_segment_record( char *record, int *starttime, int *endtime, int *event )
+{
+    ASSERT( record );
+    ASSERT( event );
+
+    *event = AVIOCTRL_EVENT_MOTIONDECT;
+    if ( sscanf( record, "%d-%d-%x", starttime, endtime, event ) < 2 )
+        return -1;
+
+    return 0;
+}
+
 static int get_times( FILE *fp, int pos, int *starttime, int *endtime, int *next_starttime, int *next_endtime)
 {
     char *line = NULL;
@@ -523,14 +2589,18 @@ static int get_times( FILE *fp, int pos, int *starttime, int *endtime, int *next
     fseek( fp, pos, SEEK_SET);
     if ( getline(&line, &len, fp) < 0 ) {
         LOGE("getline error, %s, line:%s", strerror(errno), line);
+        free(line);
         return -ERRINTERNAL;
     }
     parse_one_record(line, starttime, endtime);
     if ( getline( &line, &len, fp) < 0 ) {
-        LOGE("getline error");
-        return -ERRINTERNAL;
+        /* last record, it covers everything after it */
+        *next_starttime = INT_MAX;
+        *next_endtime = INT_MAX;
+    } else {
+        parse_one_record(line, next_starttime, next_endtime);
     }
-    parse_one_record(line, next_starttime, next_endtime);
+    free(line);
     return 0;
 }
 
@@ -540,7 +2610,7 @@ static int binary_search_pos( const char *db_file, int time, int (*judge_cb)(FIL
     int record_len = 0,total = 0, ret = 0;
     FILE *fp = NULL;
 
-    LOGI("db_file:%s", db_file);
+    LOGD("db_file:%s", db_file);
     if ( get_record_info_in_db(db_file, &record_len, &total) < 0 ) 
         return -ERRINTERNAL;
     high = total-1;
@@ -558,12 +2628,14 @@ static int binary_search_pos( const char *db_file, int time, int (*judge_cb)(FIL
             LOGE("judge_cb error");
             goto err_close_file;
         }
-        LOGI("ret:%d, mid:%d, low:%d, high:%d", ret, mid, low, high);
-        if (ret == JUDGE_CURRENT)
+        LOGD("ret:%d, mid:%d, low:%d, high:%d", ret, mid, low, high);
+        if (ret == JUDGE_CURRENT) {
+            fclose(fp);
             return mid*record_len;
-        else if (ret == JUDGE_NEXT)
+        } else if (ret == JUDGE_NEXT) {
+            fclose(fp);
             return (mid+1)*record_len;
-        else if (ret == JUDGE_LEFT)
+        } else if (ret == JUDGE_LEFT)
             high = mid - 1;
         else if (ret == JUDGE_RIGHT)
             low = mid + 1;
@@ -572,6 +2644,7 @@ static int binary_search_pos( const char *db_file, int time, int (*judge_cb)(FIL
             goto err_close_file;
         }
     }
+    fclose(fp);
     if (mid == 0 || mid == total)
         return mid*record_len;
 
@@ -602,35 +2675,54 @@ static int find_start_judge_callback(FILE *fp, int pos, int time)
     return -ERRINTERNAL;
 }
 
-static int find_end_judge_callback(FILE *fp, int pos, int time)
+static int find_start_pos(const char *db_file, int starttime)
 {
-    int starttime, endtime, next_starttime, next_endtime;
-
-    if (get_times(fp, pos, &starttime, &endtime, &next_starttime, &next_endtime) < 0)
-        return -ERRINTERNAL;
-    LOGI("time:%d endtime:%d next:%d",time, endtime, next_endtime);
-    if (time == endtime ||
-            (time > endtime && time < next_endtime))
-        return JUDGE_CURRENT;
-    if (time == next_endtime)
-        return JUDGE_NEXT;
-    if (time > endtime)
-        return JUDGE_RIGHT;
-    if (time < endtime)
-        return JUDGE_LEFT;
+    int64_t begin = metrics_now_us();
+    int pos = binary_search_pos(db_file, starttime, find_start_judge_callback);
 
-    LOGE("unexpect error");
-    return -ERRINTERNAL;
+    metrics_observe_since(METRIC_HIST_LOOKUP, begin);
+    return pos;
 }
 
-static int find_start_pos(char *db_file, int starttime)
+/* caller holds ts_db_mutex */
+static int read_ts_record(sdp_channel_t *chan, int time, char *out_ts_file, int size)
 {
-    return(binary_search_pos(db_file, starttime, find_start_judge_callback));
+    FILE *fp = NULL;
+    char *line = NULL;
+    size_t len = 0;
+    ssize_t read = 0;
+    int pos = 0, ret = -ERRINTERNAL;
+
+    if ( (pos = find_start_pos(chan->ts_dbfile, time)) < 0 )
+        return ret;
+    if ( (fp = fopen(chan->ts_dbfile, "r")) == NULL ) {
+        LOGE("open file %s error", chan->ts_dbfile);
+        return ret;
+    }
+    if ( fseek(fp, pos, SEEK_SET) == 0 && (read = getline(&line, &len, fp)) > 0 ) {
+        if ( line[read-1] == '\n' )
+            line[read-1] = '\0';
+        snprintf(out_ts_file, size, "%s", line);
+        ret = 0;
+    }
+    free(line);
+    fclose(fp);
+    return ret;
 }
 
-static int find_end_pos(char *db_file, int endtime)
+int sdp_find_ts(int channel, int time, char *out_ts_file, int size)
 {
-    return(binary_search_pos(db_file, endtime, find_end_judge_callback));
+    sdp_channel_t *chan = get_channel(channel);
+    int ret = 0;
+
+    ASSERT( out_ts_file );
+
+    if (!chan)
+        return -ERRINVAL;
+    pthread_mutex_lock(&chan->ts_db_mutex);
+    ret = read_ts_record(chan, time, out_ts_file, size);
+    pthread_mutex_unlock(&chan->ts_db_mutex);
+    return ret;
 }
 
 static int get_record_info_in_db(const char *db_file, int *out_record_len, int *total_record_count)
@@ -658,43 +2750,25 @@ static int get_record_info_in_db(const char *db_file, int *out_record_len, int *
         return -1;
     }
     ret = getline( &line, &record_len, fp);
-    if (ret < 0) {
+    free(line);
+    fclose( fp );
+    if (ret <= 0) {
         LOGE("get record from %s error", db_file);
         return -1;
     }
     record_count = filesize/(int)ret;
     *out_record_len = (int)ret;
     *total_record_count = record_count;
-    fclose( fp );
-
-    return 0;
-}
-
-static int calc_ts_md5( uint8_t *inbuf, size_t inlen, char *outbuf )
-{
-    MD5_CONTEXT ctx;
-    int i = 0;
-
-    ASSERT( inbuf );
-    ASSERT( inlen );
-    ASSERT( outbuf );
-
-    md5_init (&ctx);
-    md5_write(&ctx, inbuf, inlen );
-    md5_final(&ctx);
-    for (i = 0; i < 16; ++i) {
-       sprintf( outbuf + strlen(outbuf), "%02x", ctx.buf[i] ); 
-    }
 
     return 0;
 }
 
-static inline FILE *open_ts_index_db(const char *mode)
+static inline FILE *open_ts_index_db(sdp_channel_t *chan, const char *mode)
 {
-    FILE *fp = fopen(g_sdplay_info.ts_dbfile, mode);
+    FILE *fp = fopen(chan->ts_dbfile, mode);
 
     if ( !fp ) {
-        LOGE("open file %s error", g_sdplay_info.ts_dbfile);
+        LOGE("open file %s error", chan->ts_dbfile);
     }
     return fp;
 }
@@ -718,7 +2792,7 @@ static int read_file_to_buf(const char *file, uint8_t **outbuf, int *outsize)
         LOGE("calloc error, size:%d", filesize);
         goto err;
     }
-    if ( fread( *outbuf, filesize, 1, fp) < 0 ) {
+    if ( fread( *outbuf, filesize, 1, fp) != 1 ) {
         LOGE("fread error");
         goto err;
     }
@@ -727,26 +2801,32 @@ static int read_file_to_buf(const char *file, uint8_t **outbuf, int *outsize)
 
     return 0;
 err:
-    if (*outbuf)
-        free(outbuf);
+    if (*outbuf) {
+        free(*outbuf);
+        *outbuf = NULL;
+    }
     if (fp)
         fclose(fp);
     return -1;
 }
 
 static int send_pkt(
+        int sid,
         int ch,
         int pkt_idx,
         int endflg,
         int starttime,
         int endtime,
-        char *md5,
-        uint8_t *pkt,
+        int digest_algo,
+        int pkt_crc,
+        char *digest,
+        const uint8_t *pkt,
         int pkt_len )
 {
-    int i = 0;
     tag_frame_header_t hdr;
+    int hdr_len = PKT_HDR_LEN;
 
+    memset(&hdr, 0, sizeof(hdr));
     hdr.index = pkt_idx;
     hdr.endflag = endflg;
     hdr.length = pkt_len;
@@ -754,148 +2834,538 @@ static int send_pkt(
         hdr.utctime = endtime;
     else
         hdr.utctime = starttime;
+    hdr.reserved[0] = (unsigned char)digest_algo;
     if (endflg)
-        memcpy(hdr.md5_str, md5, TS_MD5_LEN);
+        memcpy(hdr.md5_str, digest, DIGEST_STR_LEN);
+    if (pkt_crc) {
+        hdr.reserved[1] = PKT_CRC_FLAG;
+        hdr.pkt_crc = digest_crc32c(0, pkt, pkt_len);
+        hdr_len = sizeof(hdr);
+    }
+    /* waits for this session's share of the uplink */
+    if (sched_acquire(sid, SCHED_UPLINK, hdr_len+pkt_len) < 0)
+        return -1;
 
-    return(lst_send_data(ch, (uint8_t *)&hdr, sizeof(hdr), pkt, pkt_len));
+    return(lst_send_data(ch, (uint8_t *)&hdr, hdr_len, (uint8_t *)pkt, pkt_len));
 }
 
-static int send_ts(int ch, const char *ts_file, int starttime, int endtime)
+/* a slice cache miss, only then the read counts against the sd card share */
+static int load_slice(const char *ts_file, void *arg, uint8_t **buf, int *size)
 {
-    uint8_t *buf_ptr = NULL, *save= NULL;
-    int filesize = 0;
-    FILE *fp = NULL;
-    int pkt_count = 0, i = 0;
-    char md5[TS_MD5_LEN] = {0};
+    int sid = *(int *)arg;
 
-    ASSERT( ts_file );
+    if (sched_acquire(sid, SCHED_SD_READ, MAX(get_file_size(ts_file), 0)) < 0)
+        return -1;
+    return read_file_to_buf(ts_file, buf, size);
+}
 
-    if(read_file_to_buf(ts_file, &buf_ptr, &filesize) < 0)
-        goto err;
-    save = buf_ptr;
-    if( calc_ts_md5(buf_ptr, filesize, md5) < 0)
-        goto err;
-    pkt_count = filesize/MAX_PKT_SIZE;
-    if (pkt_count == 1) {
-        if(send_pkt(ch, i, 1, starttime, endtime, md5, buf_ptr, filesize)<0)
-            goto err;
-    } else {
-        for (i=0; i<pkt_count; i++) {
-            if(send_pkt(ch, i, 0, starttime, endtime, md5, buf_ptr, MAX_PKT_SIZE) < 0 )
-                goto err;
-            buf_ptr += MAX_PKT_SIZE;
-        }
-        if(send_pkt(ch, i, 1, starttime, endtime, md5, buf_ptr, filesize-(pkt_count*MAX_PKT_SIZE)) < 0)
-            goto err;
+/*
+ * a slice(or a keyframe cut out of one) in packets. packets before
+ * first_pkt are skipped, they keep their index so the app can merge
+ * them. returns the bytes sent
+ */
+static int send_slice_buf(int sid, int ch, const uint8_t *buf_ptr, int filesize, int starttime, int endtime,
+        int digest_algo, int pkt_crc, char *digest, int first_pkt)
+{
+    int pkt_count = (filesize + MAX_PKT_SIZE - 1)/MAX_PKT_SIZE;
+    int i = 0;
+
+    if (first_pkt < 0 || (first_pkt > 0 && first_pkt >= pkt_count))
+        return -ERRINVAL;
+    buf_ptr += first_pkt*MAX_PKT_SIZE;
+    for (i=first_pkt; i<pkt_count-1; i++) {
+        if(send_pkt(sid, ch, i, 0, starttime, endtime, digest_algo, pkt_crc, digest, buf_ptr, MAX_PKT_SIZE) < 0 )
+            return -1;
+        buf_ptr += MAX_PKT_SIZE;
     }
+    if(send_pkt(sid, ch, i, 1, starttime, endtime, digest_algo, pkt_crc, digest, buf_ptr, filesize-(i*MAX_PKT_SIZE)) < 0)
+        return -1;
+    return filesize - first_pkt*MAX_PKT_SIZE;
+}
 
-    fclose(fp);
-    free(save);
-    return 0;
-err:
-    if (fp)
-        fclose(fp);
-    if (save)
-        free(save);
-    return -1;
+/* ts_file through the slice cache, first_pkt as in send_slice_buf() */
+static int send_ts(int sid, int ch, const char *ts_file, int starttime, int endtime, int digest_algo, int pkt_crc, int first_pkt)
+{
+    slice_cache_entry_t *entry = NULL;
+    char digest[DIGEST_STR_LEN] = {0};
+    int64_t begin = metrics_now_us();
+    int ret = -1;
+
+    ASSERT( ts_file );
+
+    if (slice_cache_get(ts_file, load_slice, &sid, &entry) < 0)
+        return -1;
+    if( slice_cache_digest(entry, digest_algo, digest) < 0)
+        goto out;
+    ret = send_slice_buf(sid, ch, slice_cache_data(entry), slice_cache_size(entry),
+            starttime, endtime, digest_algo, pkt_crc, digest, first_pkt);
+    if (ret < 0)
+        goto out;
+    metrics_inc(METRIC_SLICES_SENT, 1);
+    metrics_inc(METRIC_BYTES_SENT, ret);
+    metrics_observe_since(METRIC_HIST_SEND_TS, begin);
+out:
+    slice_cache_put(entry);
+    return ret;
+}
+
+static inline void get_event_db_path(sdp_channel_t *chan, int event, char *out, size_t size)
+{
+    snprintf(out, size, "%s_ev%02x", chan->segment_dbfile, event);
 }
 
-int sdp_save_segment_info(int starttime, int endtime)
+static int append_segment_record(const char *db_file, const char *line)
 {
     FILE *fp = NULL;
-    char line[SEGMENT_RECORD_LEN] = {0};
 
-    if (starttime < 0 || endtime < 0)
-        return -ERRINVAL;
-    pthread_mutex_lock(&g_sdplay_info.segment_db_mutex);
-    snprintf(line, sizeof(line), "%" TIME_FILL_ZERO_LEN "d-%" TIME_FILL_ZERO_LEN "d\n", starttime, endtime );
-    if ( (fp = fopen(g_sdplay_info.segment_dbfile, "a") ) == NULL ) {
-        LOGE("open file %s error", g_sdplay_info.segment_dbfile);
-        pthread_mutex_unlock(&g_sdplay_info.segment_db_mutex);
+    if ( (fp = fopen(db_file, "a") ) == NULL ) {
+        LOGE("open file %s error", db_file);
         return -1;
     }
     fwrite(line, strlen(line), 1, fp);
     fclose(fp);
-    pthread_mutex_unlock(&g_sdplay_info.segment_db_mutex);
     return 0;
 }
 
-int sdp_send_segment_list(int ch, int in_starttime, int in_endtime)
+/*
+ * every segment goes to the channel's segmentdb and to a per event type
+ * list(segmentdb_evXX), so a filtered query only binary searches the
+ * records of that type
+ */
+int sdp_save_segment_info(int channel, int starttime, int endtime, int event)
 {
-    FILE *fp = NULL;
-    int start_pos = 0, end_pos = 0, count = 0;
-    int starttime = 0, endtime = 0;
+    char line[SEGMENT_RECORD_LEN] = {0};
+    char event_db[256] = {0};
+    sdp_channel_t *chan = get_channel(channel);
+    int ret = 0;
+
+    if (starttime < 0 || endtime < 0 || !chan)
+        return -ERRINVAL;
+    if (event <= AVIOCTRL_EVENT_ALL || event > 0xff)
+        return -ERRINVAL;
+    pthread_mutex_lock(&chan->segment_db_mutex);
+    snprintf(line, sizeof(line), "%" TIME_FILL_ZERO_LEN "d-%" TIME_FILL_ZERO_LEN "d-%02x\n",
+            starttime, endtime, event );
+    get_event_db_path(chan, event, event_db, sizeof(event_db));
+    if ( append_segment_record(chan->segment_dbfile, line) < 0
+            || append_segment_record(event_db, line) < 0 )
+        ret = -1;
+    else if (chan->seg_max_len >= 0 && endtime - starttime > chan->seg_max_len)
+        chan->seg_max_len = endtime - starttime;
+    pthread_mutex_unlock(&chan->segment_db_mutex);
+    return ret;
+}
+
+/*
+ * segmentdb written before event types were stored has shorter records,
+ * rewrite it once so binary search sees fixed length records again.
+ * all legacy segments were motion events
+ */
+static int migrate_legacy_segment_db(sdp_channel_t *chan)
+{
+    int record_len = 0, total = 0, starttime = 0, endtime = 0;
+    char tmp_file[256] = {0}, event_db[256] = {0}, out[SEGMENT_RECORD_LEN] = {0};
+    FILE *fp_old = NULL, *fp_new = NULL, *fp_event = NULL;
     char *line = NULL;
     size_t len = 0;
-    int record_len = 0, i = 0, total = 0, ret = -ERRINTERNAL;
-    SMsgAVIoctrlListEventResp *eventlist = NULL;
-
-    pthread_mutex_lock(&g_sdplay_info.segment_db_mutex);
-    if ( get_record_info_in_db(g_sdplay_info.segment_dbfile, &record_len, &total) < 0 ) {
-        LOGE("get record info error");
-        goto err_unlock;
-    }
-    LOGI("total:%d", total);
-    LOGI("in_starttime:%d", in_starttime);
-    LOGI("in_endtime:%d", in_endtime);
-    start_pos = find_start_pos(g_sdplay_info.segment_dbfile, in_starttime);
-    if (start_pos < 0)
-        goto err_unlock;
-    LOGI("start:%d", start_pos);
-    end_pos = find_end_pos(g_sdplay_info.segment_dbfile, in_endtime);
-    if (end_pos < 0)
-        goto err_unlock;
-    LOGI("start:%d end:%d", start_pos, end_pos);
-    if ((fp = fopen(g_sdplay_info.segment_dbfile, "r") ) == NULL) {
-        LOGE("open file %s error", g_sdplay_info.segment_dbfile );
-        goto err_close_file;
-    }
-    ASSERT(record_len);
-    count = (end_pos - start_pos)/record_len + 1;
-    LOGI("segment count:%d", count);
-    eventlist = (SMsgAVIoctrlListEventResp *)malloc(sizeof(SMsgAVIoctrlListEventResp)+sizeof(SAvEvent)*count);
-    if (!eventlist) {
-        LOGE("malloc error");
-        goto err_close_file;
-    }
-    memset(eventlist, 0, sizeof(SMsgAVIoctrlListEventResp)+sizeof(SAvEvent)*count);
-    eventlist->total = 1;
-    eventlist->index = 0;
-    eventlist->endflag = 1;
-    eventlist->count = count;
-    if(fseek(fp, start_pos, SEEK_SET) < 0) {
-        LOGE("fseek error");
-        goto err_free_buf;
-    }
-    for (i = 0; i < count; ++i) {
-        if ( getline(&line, &len, fp) < 0 ) {
-            LOGE("getline error");
-            goto err_free_buf;
-        }
-        if ( !line ) {
-            LOGE("get one line segment error");
-            goto err_free_buf;
-        }
-        if( parse_one_record(line, &starttime, &endtime) < 0 )
-            goto err_free_buf;
-        eventlist->stEvent[i].utcStartTime = starttime;
-        eventlist->stEvent[i].utcEndTime = endtime;
-        eventlist->stEvent[i].event = AVIOCTRL_EVENT_MOTIONDECT;
-        eventlist->stEvent[i].status = 0;
+
+    if ( access(chan->segment_dbfile, F_OK) != 0 )
+        return 0;
+    if ( get_record_info_in_db(chan->segment_dbfile, &record_len, &total) < 0
+            || record_len != LEGACY_SEGMENT_RECORD_LEN )
+        return 0;
+    LOGI("migrate %s, %d records", chan->segment_dbfile, total);
+    snprintf(tmp_file, sizeof(tmp_file), "%s%s", chan->segment_dbfile, DB_TMP_SUFFIX);
+    get_event_db_path(chan, AVIOCTRL_EVENT_MOTIONDECT, event_db, sizeof(event_db));
+    if ( (fp_old = fopen(chan->segment_dbfile, "r")) == NULL ) {
+        LOGE("open file %s error", chan->segment_dbfile);
+        return -1;
     }
-    if (lst_send_ioctl(
-                ch,
-                LST_USER_IPCAM_LISTEVENT_RESP,
-                (char*)eventlist,
-                sizeof(SMsgAVIoctrlListEventResp)+sizeof(SAvEvent)*count) < 0)
-        goto err_free_buf;
+    if ( (fp_new = fopen(tmp_file, "w")) == NULL ) {
+        LOGE("open file %s error", tmp_file);
+        goto err;
+    }
+    if ( (fp_event = fopen(event_db, "w")) == NULL ) {
+        LOGE("open file %s error", event_db);
+        goto err;
+    }
+    while ( getline(&line, &len, fp_old) > 0 ) {
+        parse_one_record(line, &starttime, &endtime);
+        snprintf(out, sizeof(out), "%" TIME_FILL_ZERO_LEN "d-%" TIME_FILL_ZERO_LEN "d-%02x\n",
+                starttime, endtime, AVIOCTRL_EVENT_MOTIONDECT );
+        fwrite(out, strlen(out), 1, fp_new);
+        fwrite(out, strlen(out), 1, fp_event);
+    }
+    free(line);
+    fclose(fp_old);
+    fclose(fp_new);
+    fclose(fp_event);
+    return rename(tmp_file, chan->segment_dbfile);
+err:
+    if (fp_new)
+        fclose(fp_new);
+    fclose(fp_old);
+    return -1;
+}
+
+/*
+ * the next segment in the list at *pos running in [starttime, endtime],
+ * 0 none left
+ */
+static int next_list_event(const char **pos, const char *end, int starttime, int endtime, SAvEvent *ev)
+{
+    int seg_start = 0, seg_end = 0, event = 0;
+
+
+    while (*pos < end) {
+        *pos = scan_record(*pos, end, &seg_start, &seg_end, &event);
+        if (seg_start > endtime) {
+            *pos = end;
+            break;
+        }
+        /* seek_segment() may start at one that already ended */
+        if (seg_start < 0 || seg_end < starttime)
+            continue;
+        if (ev) {
+            memset(ev, 0, sizeof(SAvEvent));
+            ev->utcStartTime = seg_start;
+            ev->utcEndTime = seg_end;
+            ev->event = event;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * the segments overlapping [in_starttime, in_endtime] go out in ioctls of
+ * SEGMENT_LIST_PKT_EVENTS, each built in the same buffer from a read only
+ * mapping of the list, so neither the window nor other requests are held
+ * up by segment_db_mutex. they are in start order, total is capped at
+ * SEGMENT_LIST_MAX_EVENTS and the app asks again from the start of the
+ * last one for the rest. a long segment may still run past the short
+ * ones after it, so the end would miss those
+ */
+int sdp_send_segment_list(int ch, int channel, int event, int in_starttime, int in_endtime)
+{
+    uint32_t buf[LST_MAX_IOCTL_SIZE/sizeof(uint32_t)];
+    SMsgAVIoctrlListEventResp *eventlist = (SMsgAVIoctrlListEventResp *)buf;
+    sdp_channel_t *chan = get_channel(channel);
+    char event_db[256] = {0};
+    const char *db_file = NULL, *base = NULL, *first = NULL, *pos = NULL;
+    size_t len = 0, map_len = 0;
+    int total = 0, sent = 0, n = 0, max_len = 0, ret = -ERRINTERNAL;
+    int64_t begin = metrics_now_us();
+
+    if (!chan)
+        return -ERRINVAL;
+    /* of every type, no list of one type has a longer one */
+    max_len = segment_max_len(chan);
+    if (event == AVIOCTRL_EVENT_ALL) {
+        db_file = chan->segment_dbfile;
+    } else {
+        get_event_db_path(chan, event, event_db, sizeof(event_db));
+        db_file = event_db;
+    }
+    if ( map_db(db_file, &base, &len, &map_len) < 0 )
+        goto out;
+    first = seek_segment(base, len, in_starttime, max_len);
+    /* total goes in every packet, count before sending */
+    for (pos = first; total < SEGMENT_LIST_MAX_EVENTS
+            && next_list_event(&pos, base+len, in_starttime, in_endtime, NULL); )
+        total++;
+    LOGD("segment count:%d", total);
+    memset(buf, 0, sizeof(buf));
+    eventlist->channel = channel;
+    eventlist->total = total;
+    pos = first;
+    do {
+        for (n = 0; n < SEGMENT_LIST_PKT_EVENTS && sent < total; n++, sent++) {
+            if ( !next_list_event(&pos, base+len, in_starttime, in_endtime, &eventlist->stEvent[n]) )
+                break;
+        }
+        eventlist->count = n;
+        eventlist->endflag = sent >= total;
+        if (lst_send_ioctl(
+                    ch,
+                    LST_USER_IPCAM_LISTEVENT_RESP,
+                    (char*)eventlist,
+                    offsetof(SMsgAVIoctrlListEventResp, stEvent)+sizeof(SAvEvent)*n) < 0)
+            goto out;
+        eventlist->index++;
+    } while (!eventlist->endflag && n);
     ret = 0;
-err_free_buf:
-    free(eventlist);
-err_close_file:
-    fclose(fp);
-err_unlock:
-    pthread_mutex_unlock(&g_sdplay_info.segment_db_mutex);
+out:
+    if (base)
+        munmap((void *)base, map_len);
+    metrics_observe_since(METRIC_HIST_SEGMENT_LIST, begin);
     return ret;
 }
 
+
+struct sdp_snapshot {
+    const char *slices;   /* tsindexdb, whole lines only */
+    size_t slices_len;
+    size_t slices_map;    /* mapped size */
+    const char *segments; /* segmentdb */
+    size_t segments_len;
+    size_t segments_map;
+    int seg_max_len;      /* longest segment, for seek_segment() */
+};
+
+/*
+ * the index is only appended to or replaced by a rename, so the inode
+ * mapped here never changes under the snapshot. the size is cut back to
+ * the last '\n' in case an append is half way
+ */
+static int map_db(const char *db_file, const char **base, size_t *len, size_t *map_len)
+{
+    struct stat stat_buf;
+    void *addr = NULL;
+    int fd = -1;
+
+    *base = NULL;
+    *len = 0;
+    *map_len = 0;
+    if ( (fd = open(db_file, O_RDONLY)) < 0 )
+        return errno == ENOENT ? 0 : -1;
+    if ( fstat(fd, &stat_buf) < 0 )
+        goto err;
+    if (stat_buf.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    addr = mmap(NULL, stat_buf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        LOGE("mmap %s error, %s", db_file, strerror(errno));
+        goto err;
+    }
+    close(fd);
+    *base = (const char *)addr;
+    *len = *map_len = stat_buf.st_size;
+    while ( *len > 0 && (*base)[*len-1] != '\n' )
+        (*len)--;
+    if (*len == 0) {
+        munmap(addr, *map_len);
+        *base = NULL;
+        *map_len = 0;
+    }
+    return 0;
+err:
+    close(fd);
+    return -1;
+}
+
+sdp_snapshot_t *sdp_snapshot_open(const char *ts_path, int channel)
+{
+    sdp_snapshot_t *snap = NULL;
+    char *db_file = NULL;
+    int ret = -1;
+
+    if ( !ts_path || channel < 0 || channel >= MAX_CHANNEL_NUM )
+        return NULL;
+    if ( !(snap = (sdp_snapshot_t *)calloc(1, sizeof(sdp_snapshot_t))) )
+        return NULL;
+    if ( !(db_file = make_db_path(ts_path, TS_INDEX_DB, channel)) )
+        goto out;
+    ret = map_db(db_file, &snap->slices, &snap->slices_len, &snap->slices_map);
+    free(db_file);
+    if (ret < 0)
+        goto out;
+    ret = -1;
+    if ( !(db_file = make_db_path(ts_path, SEGMENT_DB_FILENAME, channel)) )
+        goto out;
+    ret = map_db(db_file, &snap->segments, &snap->segments_len, &snap->segments_map);
+    free(db_file);
+    if (ret == 0)
+        snap->seg_max_len = segment_list_max_len(snap->segments, snap->segments_len);
+out:
+    if (ret < 0) {
+        sdp_snapshot_close(snap);
+        return NULL;
+    }
+    return snap;
+}
+
+void sdp_snapshot_close(sdp_snapshot_t *snap)
+{
+    if (!snap)
+        return;
+    if (snap->slices)
+        munmap((void *)snap->slices, snap->slices_map);
+    if (snap->segments)
+        munmap((void *)snap->segments, snap->segments_map);
+    free(snap);
+}
+
+/* digits at *p, -1 when there are none */
+static int scan_uint(const char **p, const char *end, int base)
+{
+    int val = 0, n = 0, d = 0;
+
+    for (; *p < end; (*p)++, n++) {
+        char c = **p;
+
+        if (c >= '0' && c <= '9')
+            d = c - '0';
+        else if (base == 16 && c >= 'a' && c <= 'f')
+            d = c - 'a' + 10;
+        else
+            break;
+        val = val*base + d;
+    }
+    return n ? val : -1;
+}
+
+/*
+ * "start-end" at the head of a line, for a slice followed by the rest of
+ * the file name, for a segment by "-event"(absent in legacy records).
+ * returns the start of the next line
+ */
+static const char *scan_record(const char *line, const char *end, int *starttime, int *endtime, int *event)
+{
+    const char *p = line;
+    const char *eol = (const char *)memchr(line, '\n', end-line);
+
+    eol = eol ? eol : end;
+    *starttime = scan_uint(&p, eol, 10);
+    *endtime = -1;
+    if (p < eol && *p == '-') {
+        p++;
+        *endtime = scan_uint(&p, eol, 10);
+    }
+    if (event) {
+        *event = AVIOCTRL_EVENT_MOTIONDECT;
+        if (p < eol && *p == '-') {
+            p++;
+            *event = scan_uint(&p, eol, 16);
+        }
+    }
+    return eol < end ? eol+1 : end;
+}
+
+/* the first line starting at or after starttime, lines are in start order */
+static const char *seek_start(const char *base, size_t len, int starttime)
+{
+    const char *lo = base, *hi = base+len, *mid = NULL, *next = NULL;
+    int start = 0, end = 0;
+
+    while (lo < hi) {
+        mid = lo + (hi-lo)/2;
+        while (mid > lo && mid[-1] != '\n')
+            mid--;
+        next = scan_record(mid, base+len, &start, &end, NULL);
+        if (start < starttime)
+            lo = next;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* slices never overlap, so their ends are in order too: the first one not ending before starttime */
+static const char *seek_record(const char *base, size_t len, int starttime)
+{
+    const char *lo = base, *hi = base+len, *mid = NULL, *next = NULL;
+    int start = 0, end = 0;
+
+    while (lo < hi) {
+        mid = lo + (hi-lo)/2;
+        while (mid > lo && mid[-1] != '\n')
+            mid--;
+        next = scan_record(mid, base+len, &start, &end, NULL);
+        if (end < starttime)
+            lo = next;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * segments of different types overlap, their ends are not in order. none
+ * is longer than max_len, so the first one that can still run at
+ * starttime starts at starttime-max_len or later. the caller skips the
+ * ones ending before starttime
+ */
+static const char *seek_segment(const char *base, size_t len, int starttime, int max_len)
+{
+    return seek_start(base, len, starttime > INT_MIN + max_len ? starttime - max_len : INT_MIN);
+}
+
+static int segment_list_max_len(const char *base, size_t len)
+{
+    const char *p = base;
+    int start = 0, end = 0, max_len = 0;
+
+    while (p < base+len) {
+        p = scan_record(p, base+len, &start, &end, NULL);
+        if (start >= 0 && end - start > max_len)
+            max_len = end - start;
+    }
+    return max_len;
+}
+
+int sdp_snapshot_slices(sdp_snapshot_t *snap, int starttime, int endtime, sdp_cursor_t *cur)
+{
+    if (!snap || !cur || starttime > endtime)
+        return -ERRINVAL;
+    cur->pos = seek_record(snap->slices, snap->slices_len, starttime);
+    cur->end = snap->slices + snap->slices_len;
+    cur->starttime = starttime;
+    cur->endtime = endtime;
+    cur->event = AVIOCTRL_EVENT_ALL;
+    return 0;
+}
+
+int sdp_snapshot_next_slice(sdp_cursor_t *cur, sdp_slice_rec_t *rec)
+{
+    const char *line = NULL;
+
+    while (cur->pos < cur->end) {
+        line = cur->pos;
+        cur->pos = scan_record(line, cur->end, &rec->starttime, &rec->endtime, NULL);
+        if (rec->starttime > cur->endtime) {
+            cur->pos = cur->end;
+            break;
+        }
+        if (rec->starttime < 0 || rec->endtime < 0)
+            continue;
+        rec->name = line;
+        rec->name_len = cur->pos - line - 1;
+        return 0;
+    }
+    return ERR_FILE_EMPTY;
+}
+
+int sdp_snapshot_segments(sdp_snapshot_t *snap, int starttime, int endtime, int event, sdp_cursor_t *cur)
+{
+    if (!snap || !cur || starttime > endtime)
+        return -ERRINVAL;
+    cur->pos = seek_segment(snap->segments, snap->segments_len, starttime, snap->seg_max_len);
+    cur->end = snap->segments + snap->segments_len;
+    cur->starttime = starttime;
+    cur->endtime = endtime;
+    cur->event = event;
+    return 0;
+}
+
+int sdp_snapshot_next_segment(sdp_cursor_t *cur, sdp_segment_rec_t *rec)
+{
+    while (cur->pos < cur->end) {
+        cur->pos = scan_record(cur->pos, cur->end, &rec->starttime, &rec->endtime, &rec->event);
+        if (rec->starttime > cur->endtime) {
+            cur->pos = cur->end;
+            break;
+        }
+        if (rec->starttime < 0 || rec->endtime < 0)
+            continue;
+        /* seek_segment() may start at one that already ended */
+        if (rec->endtime < cur->starttime)
+            continue;
+        if (cur->event != AVIOCTRL_EVENT_ALL && rec->event != cur->event)
+            continue;
+        return 0;
+    }
+    return ERR_FILE_EMPTY;
+}
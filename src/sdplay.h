@@ -8,15 +8,157 @@
 #ifndef _SDPLAY_H
 #define _SDPLAY_H
 
+#include <stdint.h>
+#include "digest.h"
+
 #define ERR_FILE_EMPTY -2
 
+enum {
+    SDP_RECORD_CONTINUOUS, /* default, every slice goes to the card */
+    SDP_RECORD_EVENT,
+};
+
+#define SDP_PREROLL_BYTES (4*1024*1024) /* ram ring of each channel in event mode */
+
+/*
+ * command of SMsgAVIoctrlPlayRecord added by sdplay: resend the slice
+ * starting at utcTime from packet Param. commands of sdplay's own start
+ * at 0x2100 like the LST_USER_SDP_xxx iotypes, far from the sdk's
+ * ENUM_PLAYCONTROL
+ */
+#define SDP_RECORD_PLAY_RESUME 0x2100
+
+enum {
+    SDP_EXPORT_START,
+    SDP_EXPORT_STOP,
+};
+
+#define SDP_EXPORT_MAGIC 0x58504453 /* "SDPX" */
+
+/*
+ * LST_USER_SDP_EXPORT_REQ. once a START is answered the app joins the
+ * bulk stream(tutk rdt) on the iotc channel in result. to go on after
+ * a broken export, resume_time is the start of the slice that was cut
+ * off and resume_offset the bytes of it already received
+ */
+typedef struct {
+    uint32_t command;     /* SDP_EXPORT_xxx */
+    uint32_t channel;
+    uint32_t starttime;
+    uint32_t endtime;
+    uint32_t digest_algo; /* DIGEST_xxx of each slice */
+    uint32_t resume_time; /* 0 a new export */
+    uint32_t resume_offset;
+} sdp_export_req_t;
+
+typedef struct {
+    uint32_t command;
+    int32_t result;       /* START: iotc channel of the stream, -1 error */
+} sdp_export_resp_t;
+
+/* in front of each slice on the stream, size 0 is the end of the export */
+typedef struct {
+    uint32_t magic;       /* SDP_EXPORT_MAGIC */
+    uint32_t starttime;
+    uint32_t endtime;
+    uint32_t size;        /* of the whole slice, size-offset bytes follow */
+    uint32_t offset;
+    uint32_t digest_algo;
+    char digest[DIGEST_STR_LEN]; /* of the whole slice */
+    char pad[3];
+} sdp_export_slice_hdr_t;
+
+/*
+ * data of a playback frame with FRAME_GAP_FLAG, nothing is recorded from
+ * gap_start until gap_end where the next slice starts
+ */
+typedef struct {
+    uint32_t gap_start;
+    uint32_t gap_end;
+} sdp_gap_marker_t;
+
+/*
+ * read only view of a channel's index for other processes, see
+ * sdp_snapshot_open(). records point into the mapping and stay valid
+ * until the snapshot is closed
+ */
+typedef struct sdp_snapshot sdp_snapshot_t;
+
+typedef struct {
+    int starttime;
+    int endtime;
+    const char *name; /* file name under ts_path, not '\0' terminated */
+    int name_len;
+} sdp_slice_rec_t;
+
+typedef struct {
+    int starttime;
+    int endtime;
+    int event;        /* AVIOCTRL_EVENT_xxx */
+} sdp_segment_rec_t;
+
+/* filled by sdp_snapshot_slices()/sdp_snapshot_segments(), opaque */
+typedef struct {
+    const char *pos;
+    const char *end;
+    int starttime;
+    int endtime;
+    int event;
+} sdp_cursor_t;
+
 extern int sdp_init( const char *ts_path,
         const char *sd_mount_path,
         const char *uid,
         const char *dev_name,
         const char *passwd);
-extern int sdp_save_ts(const uint8_t *ts_buf, size_t size, int starttime, int endtime);
-extern int sdp_save_segment_info(int starttime, int endtime);
-extern int sdp_send_segment_list(int ch, int in_starttime, int in_endtime);
+/* channel: camera index(lens), 0 for single lens devices */
+extern int sdp_save_ts(int channel, const uint8_t *ts_buf, size_t size, int starttime, int endtime);
+/*
+ * event: AVIOCTRL_EVENT_xxx the segment was recorded for, AVIOCTRL_EVENT_ALL
+ * lists every type. segments of all types go to one list in start order,
+ * save them in the order they start
+ */
+extern int sdp_save_segment_info(int channel, int starttime, int endtime, int event);
+extern int sdp_send_segment_list(int ch, int channel, int event, int in_starttime, int in_endtime);
+/*
+ * event mode keeps the last preroll_sec of slices in ram, and only writes
+ * from an event until postroll_sec after the last one. the segments are
+ * saved by sdplay then, times are in the clock of the slices
+ */
+extern int sdp_set_record_mode(int channel, int mode, int preroll_sec, int postroll_sec);
+extern int sdp_event_trigger(int channel, int event, int time);
+/*
+ * back to back slices shorter than min_sec seconds or min_bytes are
+ * kept in ram and stored as one slice once they reach either, 0 and 0
+ * (default) stores every slice as it comes. a power cut loses what is
+ * still in ram, sdp_flush_ts() writes it out now
+ */
+extern int sdp_set_coalesce(int channel, int min_sec, int min_bytes);
+extern int sdp_flush_ts(int channel);
+/* seconds between two keyframe thumbnails taken at ingest, 0 takes none */
+extern int sdp_set_thumb_interval(int channel, int interval);
+/* ts slice of channel covering time, copied into out_ts_file */
+extern int sdp_find_ts(int channel, int time, char *out_ts_file, int size);
+/* evict the oldest slices on the card now, same as when the card gets full */
+extern int sdp_release_space();
+/*
+ * map the slice index and the segment list of channel under ts_path as
+ * they are now, needs no sdp_init() in the caller's process. records
+ * appended later are not seen, a slice may be evicted from the card
+ * while the snapshot is open. the segment list is read through once
+ * here for its longest segment
+ */
+extern sdp_snapshot_t *sdp_snapshot_open(const char *ts_path, int channel);
+extern void sdp_snapshot_close(sdp_snapshot_t *snap);
+/* slices overlapping [starttime, endtime], oldest first */
+extern int sdp_snapshot_slices(sdp_snapshot_t *snap, int starttime, int endtime, sdp_cursor_t *cur);
+/* 0 a record, ERR_FILE_EMPTY after the last one */
+extern int sdp_snapshot_next_slice(sdp_cursor_t *cur, sdp_slice_rec_t *rec);
+/*
+ * segments overlapping [starttime, endtime] in start order, event
+ * AVIOCTRL_EVENT_ALL for every type
+ */
+extern int sdp_snapshot_segments(sdp_snapshot_t *snap, int starttime, int endtime, int event, sdp_cursor_t *cur);
+extern int sdp_snapshot_next_segment(sdp_cursor_t *cur, sdp_segment_rec_t *rec);
 
 #endif
@@ -0,0 +1,303 @@
+/**
+* @file slice_cache.c
+* @author rigensen
+* @brief  slice cache, see slice_cache.h
+* @date 一 10/28 09:40:12 2019
+*/
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <pthread.h>
+#include "slice_cache.h"
+#include "digest.h"
+#include "metrics.h"
+#include "dbg.h"
+#include "public.h"
+
+#define SLICE_CACHE_BUCKETS 64 /* power of 2 */
+#define SLICE_NAME_LEN 256
+
+struct slice_cache_entry {
+    struct slice_cache_entry *hnext;
+    struct slice_cache_entry *prev; /* lru, head is the most recent */
+    struct slice_cache_entry *next;
+    char name[SLICE_NAME_LEN];
+    uint8_t *data;
+    int size;
+    int refs;
+    int loading;
+    int cached; /* in the hash and the lru, counted in bytes */
+    unsigned int digest_mask;
+    char digest[DIGEST_NUM][DIGEST_STR_LEN];
+};
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond; /* a load finished */
+    int64_t limit;
+    int64_t bytes;
+    slice_cache_entry_t *hash[SLICE_CACHE_BUCKETS];
+    slice_cache_entry_t *lru_head;
+    slice_cache_entry_t *lru_tail;
+} slice_cache_t;
+
+static slice_cache_t g_cache = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .limit = SLICE_CACHE_DEFAULT_BYTES,
+};
+
+static unsigned int hash_name(const char *name)
+{
+    unsigned int h = 5381;
+
+    while (*name)
+        h = h*33 + (unsigned char)*name++;
+    return h & (SLICE_CACHE_BUCKETS-1);
+}
+
+/* below, g_cache.mutex held */
+static slice_cache_entry_t *lookup(const char *name)
+{
+    slice_cache_entry_t *e = g_cache.hash[hash_name(name)];
+
+    while (e && strcmp(e->name, name))
+        e = e->hnext;
+    return e;
+}
+
+static void lru_unlink(slice_cache_entry_t *e)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        g_cache.lru_head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        g_cache.lru_tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void lru_push(slice_cache_entry_t *e)
+{
+    e->prev = NULL;
+    e->next = g_cache.lru_head;
+    if (g_cache.lru_head)
+        g_cache.lru_head->prev = e;
+    else
+        g_cache.lru_tail = e;
+    g_cache.lru_head = e;
+}
+
+static void link_entry(slice_cache_entry_t *e)
+{
+    unsigned int h = hash_name(e->name);
+
+    e->hnext = g_cache.hash[h];
+    g_cache.hash[h] = e;
+    lru_push(e);
+    g_cache.bytes += e->size;
+    e->cached = 1;
+}
+
+/* the entry lives on until its last put */
+static void unlink_entry(slice_cache_entry_t *e)
+{
+    slice_cache_entry_t **pp = &g_cache.hash[hash_name(e->name)];
+
+    if (!e->cached)
+        return;
+    while (*pp && *pp != e)
+        pp = &(*pp)->hnext;
+    if (*pp)
+        *pp = e->hnext;
+    lru_unlink(e);
+    g_cache.bytes -= e->size;
+    e->cached = 0;
+}
+
+static void free_entry(slice_cache_entry_t *e)
+{
+    free(e->data);
+    free(e);
+}
+
+/* slices in use are skipped, they may keep the cache above its limit */
+static void trim()
+{
+    slice_cache_entry_t *e = g_cache.lru_tail, *prev = NULL;
+
+    for (; e && g_cache.bytes > g_cache.limit; e = prev) {
+        prev = e->prev;
+        if (e->refs || e->loading)
+            continue;
+        unlink_entry(e);
+        free_entry(e);
+    }
+}
+
+void slice_cache_set_limit(int64_t bytes)
+{
+    pthread_mutex_lock(&g_cache.mutex);
+    g_cache.limit = bytes > 0 ? bytes : 0;
+    trim();
+    pthread_mutex_unlock(&g_cache.mutex);
+}
+
+int slice_cache_get(const char *name, slice_cache_load_cb_t load, void *arg, slice_cache_entry_t **out)
+{
+    slice_cache_entry_t *e = NULL;
+    uint8_t *buf = NULL;
+    int size = 0, ret = 0;
+
+    ASSERT( name );
+    ASSERT( load );
+    ASSERT( out );
+
+    pthread_mutex_lock(&g_cache.mutex);
+    /* a failed load unlinks its entry, look again after every wakeup */
+    while ( (e = lookup(name)) != NULL && e->loading )
+        pthread_cond_wait(&g_cache.cond, &g_cache.mutex);
+    if (e) {
+        e->refs++;
+        lru_unlink(e);
+        lru_push(e);
+        pthread_mutex_unlock(&g_cache.mutex);
+        metrics_inc(METRIC_CACHE_HITS, 1);
+        *out = e;
+        return 0;
+    }
+    if ( (e = (slice_cache_entry_t *)calloc(1, sizeof(*e))) == NULL ) {
+        pthread_mutex_unlock(&g_cache.mutex);
+        return -ERRNOMEM;
+    }
+    snprintf(e->name, sizeof(e->name), "%s", name);
+    e->refs = 1;
+    e->loading = 1;
+    /* too long a name to share, this caller keeps it to itself */
+    if (strlen(name) < sizeof(e->name))
+        link_entry(e);
+    pthread_mutex_unlock(&g_cache.mutex);
+    metrics_inc(METRIC_CACHE_MISSES, 1);
+
+    ret = load(name, arg, &buf, &size);
+
+    pthread_mutex_lock(&g_cache.mutex);
+    e->loading = 0;
+    if (ret < 0) {
+        unlink_entry(e);
+        pthread_cond_broadcast(&g_cache.cond);
+        pthread_mutex_unlock(&g_cache.mutex);
+        free_entry(e);
+        return ret;
+    }
+    e->data = buf;
+    e->size = size;
+    if (e->cached)
+        g_cache.bytes += size;
+    pthread_cond_broadcast(&g_cache.cond);
+    pthread_mutex_unlock(&g_cache.mutex);
+    *out = e;
+    return 0;
+}
+
+void slice_cache_put(slice_cache_entry_t *e)
+{
+    if (!e)
+        return;
+    pthread_mutex_lock(&g_cache.mutex);
+    if (--e->refs == 0 && !e->cached) {
+        pthread_mutex_unlock(&g_cache.mutex);
+        free_entry(e);
+        return;
+    }
+    trim();
+    pthread_mutex_unlock(&g_cache.mutex);
+}
+
+const uint8_t *slice_cache_data(slice_cache_entry_t *e)
+{
+    return e->data;
+}
+
+int slice_cache_size(slice_cache_entry_t *e)
+{
+    return e->size;
+}
+
+int slice_cache_digest(slice_cache_entry_t *e, int algo, char *out)
+{
+    char digest[DIGEST_STR_LEN] = {0};
+
+    if (algo < 0 || algo >= DIGEST_NUM)
+        return -ERRINVAL;
+    pthread_mutex_lock(&g_cache.mutex);
+    if (e->digest_mask & (1u << algo)) {
+        memcpy(out, e->digest[algo], DIGEST_STR_LEN);
+        pthread_mutex_unlock(&g_cache.mutex);
+        return 0;
+    }
+    pthread_mutex_unlock(&g_cache.mutex);
+    /* two first readers may both hash it, same result */
+    if (digest_calc(algo, e->data, e->size, digest) < 0)
+        return -ERRINTERNAL;
+    pthread_mutex_lock(&g_cache.mutex);
+    memcpy(e->digest[algo], digest, DIGEST_STR_LEN);
+    e->digest_mask |= 1u << algo;
+    pthread_mutex_unlock(&g_cache.mutex);
+    memcpy(out, digest, DIGEST_STR_LEN);
+    return 0;
+}
+
+void slice_cache_insert(const char *name, const uint8_t *buf, int size)
+{
+    slice_cache_entry_t *e = NULL, *old = NULL;
+
+    ASSERT( name );
+
+    if (size < 0 || size > __atomic_load_n(&g_cache.limit, __ATOMIC_RELAXED)
+            || strlen(name) >= SLICE_NAME_LEN)
+        return;
+    if ( (e = (slice_cache_entry_t *)calloc(1, sizeof(*e))) == NULL )
+        return;
+    if ( size && (e->data = (uint8_t *)malloc(size)) == NULL ) {
+        free(e);
+        return;
+    }
+    memcpy(e->data, buf, size);
+    e->size = size;
+    snprintf(e->name, sizeof(e->name), "%s", name);
+    pthread_mutex_lock(&g_cache.mutex);
+    /* rewritten, whoever holds the old one finishes with it */
+    if ( (old = lookup(name)) != NULL ) {
+        if (old->loading) {
+            pthread_mutex_unlock(&g_cache.mutex);
+            free_entry(e);
+            return;
+        }
+        unlink_entry(old);
+        if (!old->refs)
+            free_entry(old);
+    }
+    link_entry(e);
+    trim();
+    pthread_mutex_unlock(&g_cache.mutex);
+}
+
+void slice_cache_invalidate(const char *name)
+{
+    slice_cache_entry_t *e = NULL;
+
+    ASSERT( name );
+
+    pthread_mutex_lock(&g_cache.mutex);
+    if ( (e = lookup(name)) != NULL && !e->loading ) {
+        unlink_entry(e);
+        if (!e->refs)
+            free_entry(e);
+    }
+    pthread_mutex_unlock(&g_cache.mutex);
+}
@@ -0,0 +1,40 @@
+/**
+* @file slice_cache.h
+* @author rigensen
+* @brief  ts slices read from the sd card, shared by every playback.
+*         reference counted, bounded in bytes, least recently used
+*         slices go first. a slice is read from the card once however
+*         many clients ask for it at the same time
+* @date 一 10/28 09:40:12 2019
+*/
+
+#ifndef _SLICE_CACHE_H
+
+#include <stdint.h>
+
+#define SLICE_CACHE_DEFAULT_BYTES (8*1024*1024)
+
+typedef struct slice_cache_entry slice_cache_entry_t;
+
+/* reads a slice on a miss, *buf is malloc()ed and owned by the cache after */
+typedef int (*slice_cache_load_cb_t)(const char *name, void *arg, uint8_t **buf, int *size);
+
+/* 0 turns the cache off, slices are still shared while they are in use */
+extern void slice_cache_set_limit(int64_t bytes);
+/*
+ * the slice called name, loaded with load on a miss. others asking for
+ * it meanwhile wait for that load. release with slice_cache_put()
+ */
+extern int slice_cache_get(const char *name, slice_cache_load_cb_t load, void *arg, slice_cache_entry_t **out);
+extern void slice_cache_put(slice_cache_entry_t *entry);
+extern const uint8_t *slice_cache_data(slice_cache_entry_t *entry);
+extern int slice_cache_size(slice_cache_entry_t *entry);
+/* hex digest of the slice, computed once per algorithm */
+extern int slice_cache_digest(slice_cache_entry_t *entry, int algo, char *out);
+/* a slice just written, kept warm for the playback that usually follows */
+extern void slice_cache_insert(const char *name, const uint8_t *buf, int size);
+/* the slice is gone from the card */
+extern void slice_cache_invalidate(const char *name);
+
+#define _SLICE_CACHE_H
+#endif
@@ -0,0 +1,235 @@
+/**
+* @file thumb.c
+* @author rigensen
+* @brief  thumbnail store, see thumb.h
+* @date 二 10/29 16:48:03 2019
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/stat.h>
+#include "thumb.h"
+#include "dbg.h"
+#include "public.h"
+
+#define THUMB_INDEX_SUFFIX ".idx"
+#define THUMB_OLD_SUFFIX ".old"
+#define THUMB_RECORD_LEN 30 /* "%010d-%010ld-%07d\n", time offset size */
+
+typedef struct {
+    int starttime;
+    int endtime;
+    int max_count;
+    int max_bytes;
+    int count;
+    int bytes;
+    int full;
+    thumb_cb_t cb;
+    void *arg;
+} thumb_query_t;
+
+static long file_size(const char *file)
+{
+    struct stat stat_buf;
+
+    if (stat(file, &stat_buf) != 0)
+        return 0;
+    return (long)stat_buf.st_size;
+}
+
+static int read_record(FILE *fp, long i, int *time, long *off, int *size)
+{
+    char line[THUMB_RECORD_LEN+1] = {0};
+
+    if ( fseek(fp, i*THUMB_RECORD_LEN, SEEK_SET) < 0
+            || fread(line, THUMB_RECORD_LEN, 1, fp) != 1
+            || sscanf(line, "%d-%ld-%d", time, off, size) != 3 )
+        return -ERRINTERNAL;
+    return 0;
+}
+
+int thumb_store_init(thumb_store_t *store, const char *prefix)
+{
+    long size = 0, off = 0;
+    int len = 0;
+    FILE *fp = NULL;
+
+    ASSERT( store );
+    ASSERT( prefix );
+
+    memset(store, 0, sizeof(*store));
+    pthread_mutex_init(&store->mutex, NULL);
+    store->interval = THUMB_DEFAULT_INTERVAL;
+    store->last_time = -1;
+    snprintf(store->data_file, sizeof(store->data_file), "%s", prefix);
+    snprintf(store->index_file, sizeof(store->index_file), "%s" THUMB_INDEX_SUFFIX, prefix);
+    /* a torn record would shift every record appended after it */
+    size = file_size(store->index_file);
+    if (size % THUMB_RECORD_LEN) {
+        LOGE("%s has a torn record, cut to %ld bytes", store->index_file, size/THUMB_RECORD_LEN*THUMB_RECORD_LEN);
+        size = size/THUMB_RECORD_LEN*THUMB_RECORD_LEN;
+        if (truncate(store->index_file, size) < 0)
+            return -ERRINTERNAL;
+    }
+    if (size && (fp = fopen(store->index_file, "r")) != NULL) {
+        if (read_record(fp, size/THUMB_RECORD_LEN - 1, &store->last_time, &off, &len) < 0)
+            store->last_time = -1;
+        fclose(fp);
+    }
+    return 0;
+}
+
+void thumb_store_set_interval(thumb_store_t *store, int interval)
+{
+    pthread_mutex_lock(&store->mutex);
+    store->interval = interval > 0 ? interval : 0;
+    pthread_mutex_unlock(&store->mutex);
+}
+
+int thumb_store_want(thumb_store_t *store, int time)
+{
+    int want = 0;
+
+    pthread_mutex_lock(&store->mutex);
+    /* a clock set back starts over */
+    want = store->interval > 0 && (store->last_time < 0 || time < store->last_time
+            || time >= store->last_time + store->interval);
+    pthread_mutex_unlock(&store->mutex);
+    return want;
+}
+
+/* mutex held */
+static void rotate(thumb_store_t *store)
+{
+    char old[sizeof(store->index_file) + sizeof(THUMB_OLD_SUFFIX)];
+
+    snprintf(old, sizeof(old), "%s" THUMB_OLD_SUFFIX, store->data_file);
+    rename(store->data_file, old);
+    snprintf(old, sizeof(old), "%s" THUMB_OLD_SUFFIX, store->index_file);
+    rename(store->index_file, old);
+    LOGI("%s full, started a new one", store->data_file);
+}
+
+int thumb_store_add(thumb_store_t *store, int time, const uint8_t *buf, int size)
+{
+    FILE *fp = NULL;
+    long off = 0;
+    int ret = -ERRINTERNAL;
+
+    ASSERT( buf );
+
+    if (size <= 0 || size > THUMB_DB_MAX_BYTES)
+        return -ERRINVAL;
+    pthread_mutex_lock(&store->mutex);
+    if ( (off = file_size(store->data_file)) + size > THUMB_DB_MAX_BYTES ) {
+        rotate(store);
+        off = 0;
+    }
+    /* the frame first, a record never points past the data */
+    if ( (fp = fopen(store->data_file, "a")) == NULL ) {
+        LOGE("open file %s error, %s", store->data_file, strerror(errno));
+        goto out;
+    }
+    if (fwrite(buf, size, 1, fp) != 1) {
+        fclose(fp);
+        goto out;
+    }
+    fclose(fp);
+    if ( (fp = fopen(store->index_file, "a")) == NULL ) {
+        LOGE("open file %s error, %s", store->index_file, strerror(errno));
+        goto out;
+    }
+    fprintf(fp, "%010d-%010ld-%07d\n", time, off, size);
+    fclose(fp);
+    store->last_time = time;
+    ret = 0;
+out:
+    pthread_mutex_unlock(&store->mutex);
+    return ret;
+}
+
+static int query_gen(const char *data_file, const char *index_file, thumb_query_t *q)
+{
+    FILE *fp_idx = NULL, *fp_data = NULL;
+    long total = file_size(index_file)/THUMB_RECORD_LEN, low = 0, high = total, mid = 0, off = 0;
+    int time = 0, size = 0, ret = 0;
+    uint8_t *buf = NULL;
+
+    if ( !total || (fp_idx = fopen(index_file, "r")) == NULL )
+        return 0;
+    if ( (fp_data = fopen(data_file, "r")) == NULL ) {
+        fclose(fp_idx);
+        return 0;
+    }
+    /* the first one at or after starttime */
+    while (low < high) {
+        mid = (low + high)/2;
+        if ( (ret = read_record(fp_idx, mid, &time, &off, &size)) < 0 )
+            goto out;
+        if (time < q->starttime)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    for (; low < total && q->count < q->max_count; low++) {
+        if ( (ret = read_record(fp_idx, low, &time, &off, &size)) < 0 )
+            goto out;
+        if (time > q->endtime)
+            break;
+        if (q->bytes + size > q->max_bytes) {
+            q->full = 1;
+            break;
+        }
+        if ( (buf = (uint8_t *)malloc(size)) == NULL ) {
+            ret = -ERRNOMEM;
+            goto out;
+        }
+        if ( fseek(fp_data, off, SEEK_SET) < 0 || fread(buf, size, 1, fp_data) != 1 ) {
+            LOGE("read thumbnail at %d from %s error", time, data_file);
+            free(buf);
+            continue;
+        }
+        ret = q->cb(time, buf, size, q->arg);
+        free(buf);
+        if (ret < 0)
+            goto out;
+        q->count++;
+        q->bytes += size;
+    }
+    ret = 0;
+out:
+    fclose(fp_idx);
+    fclose(fp_data);
+    return ret;
+}
+
+int thumb_store_query(thumb_store_t *store, int starttime, int endtime,
+        int max_count, int max_bytes, thumb_cb_t cb, void *arg)
+{
+    char old_data[sizeof(store->data_file) + sizeof(THUMB_OLD_SUFFIX)];
+    char old_index[sizeof(store->index_file) + sizeof(THUMB_OLD_SUFFIX)];
+    thumb_query_t q;
+    int ret = 0;
+
+    ASSERT( cb );
+
+    memset(&q, 0, sizeof(q));
+    q.starttime = starttime;
+    q.endtime = endtime;
+    q.max_count = max_count;
+    q.max_bytes = max_bytes;
+    q.cb = cb;
+    q.arg = arg;
+    snprintf(old_data, sizeof(old_data), "%s" THUMB_OLD_SUFFIX, store->data_file);
+    snprintf(old_index, sizeof(old_index), "%s" THUMB_OLD_SUFFIX, store->index_file);
+    pthread_mutex_lock(&store->mutex);
+    /* the older generation first, the newer one goes on where it stopped */
+    if ( (ret = query_gen(old_data, old_index, &q)) == 0 && !q.full && q.count < q.max_count )
+        ret = query_gen(store->data_file, store->index_file, &q);
+    pthread_mutex_unlock(&store->mutex);
+    return ret < 0 ? ret : q.count;
+}
@@ -0,0 +1,65 @@
+/**
+* @file thumb.h
+* @author rigensen
+* @brief  keyframe thumbnails of a channel, taken at ingest every few
+*         seconds. the frames are appended to a data file, a fixed
+*         length index is binary searched by time. two generations
+*         are kept, the older one is dropped when the newer is full
+* @date 二 10/29 16:48:03 2019
+*/
+
+#ifndef _THUMB_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define THUMB_DEFAULT_INTERVAL 10 /* seconds between two thumbnails */
+#define THUMB_DB_MAX_BYTES (8*1024*1024) /* one generation */
+#define THUMB_DEFAULT_COUNT 16
+#define THUMB_MAX_COUNT 256 /* of one request */
+#define THUMB_BATCH_MAX_BYTES (256*1024)
+
+typedef struct {
+    pthread_mutex_t mutex;
+    char data_file[256];
+    char index_file[256];
+    int interval;  /* 0 no thumbnails */
+    int last_time; /* of the newest one, -1 none */
+} thumb_store_t;
+
+/* called for each thumbnail oldest first, buf is only valid during the call */
+typedef int (*thumb_cb_t)(int time, const uint8_t *buf, int size, void *arg);
+
+/* the store lives in prefix and prefix.idx, and prefix.old... before */
+extern int thumb_store_init(thumb_store_t *store, const char *prefix);
+/* seconds between two thumbnails, 0 takes none */
+extern void thumb_store_set_interval(thumb_store_t *store, int interval);
+/* keeps it when interval seconds passed since the last one */
+extern int thumb_store_want(thumb_store_t *store, int time);
+extern int thumb_store_add(thumb_store_t *store, int time, const uint8_t *buf, int size);
+/* thumbnails in [starttime, endtime], at most max_count and max_bytes */
+extern int thumb_store_query(thumb_store_t *store, int starttime, int endtime,
+        int max_count, int max_bytes, thumb_cb_t cb, void *arg);
+
+/*
+ * LST_USER_SDP_THUMB_REQ carries sdp_thumb_req_t. the response is one or
+ * more LST_USER_SDP_THUMB_RESP, each a sdp_thumb_resp_hdr_t and len bytes
+ * of data. the data of all of them together is a uint32_t count, then
+ * count times: uint32_t time, uint32_t size, size bytes of ts
+ */
+typedef struct {
+    uint32_t channel;
+    uint32_t starttime;
+    uint32_t endtime;
+    uint32_t max_count; /* 0 THUMB_DEFAULT_COUNT, THUMB_MAX_COUNT at most */
+} sdp_thumb_req_t;
+
+typedef struct {
+    uint32_t channel;
+    uint32_t index;   /* of this message, from 0 */
+    uint32_t endflag; /* 1 on the last one */
+    uint32_t len;
+} sdp_thumb_resp_hdr_t;
+
+#define _THUMB_H
+#endif
@@ -2,230 +2,408 @@
 * @file transfer.c
 * @author rigensen
 * @brief  lst - live stream transport
+*         forwards to a pluggable backend, tutk on device,
+*         loopback for host side tests and benchmarks
 * @date 一 10/14 18:42:54 2019
 */
 
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
-#include <ctype.h>
-#include <pthread.h>
-#include <unistd.h>
 #include <assert.h>
-#include "IOTCAPIs.h"
-#include "AVAPIs.h"
-#include "P2PCam/AVFRAMEINFO.h"
-#include "P2PCam/AVIOCTRLDEFs.h"
+#include <pthread.h>
+#include <time.h>
 #include "transfer.h"
 #include "dbg.h"
 #include "public.h"
 
-#define MAX_SIZE_IOCTRL_BUF     1024
+#define LST_DISPATCH_WORKERS 2 /* a session always goes to worker sid%LST_DISPATCH_WORKERS */
+#define LST_DISPATCH_QUEUE_LEN 32
+
+enum {
+    LST_EVENT_OPEN,
+    LST_EVENT_IOCTL,
+    LST_EVENT_CLOSE,
+};
 
 typedef struct {
-    const char *uid;
-    const char *dev_name;
-    const char *passwd;
-    int login_success;
-    pthread_t login_tid;
-} lst_info_t;
+    int type;
+    int sid;
+    int ch;
+    unsigned int cmd;
+    int size;
+    char data[LST_MAX_IOCTL_SIZE];
+} lst_event_t;
 
-static lst_info_t g_lst_info;
+typedef struct {
+    int sid;
+    int ch;
+} lst_close_t;
 
-static void login_cb(unsigned int info)
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int head;
+    int count;
+    lst_event_t queue[LST_DISPATCH_QUEUE_LEN];
+    lst_close_t closes[LST_DISPATCH_QUEUE_LEN]; /* found the queue full, go in as slots free up */
+    int close_count;
+} lst_worker_t;
+
+/* login readiness, set by the backend, waited on by sdplay */
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int logged_in;
+} lst_login_t;
+
+static lst_handlers_t g_handlers;
+static lst_worker_t g_workers[LST_DISPATCH_WORKERS];
+static lst_login_t g_login = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+static pthread_once_t g_login_once = PTHREAD_ONCE_INIT;
+static lst_session_lost_cb_t g_session_lost_cb;
+
+#ifdef LST_NO_TUTK
+static const lst_transport_t *g_transport = &lst_loopback_transport;
+#else
+static const lst_transport_t *g_transport = &lst_tutk_transport;
+#endif
+
+int lst_set_transport(const lst_transport_t *transport)
 {
-    if((info & 0x04)) {
-        LOGI("I can be connected via Internet");
-    } else if((info & 0x08)) {
-        LOGI("I am be banned by IOTC Server because UID multi-login");
-    }
+    if (!transport)
+        return -ERRINVAL;
+    g_transport = transport;
+    LOGI("transport:%s", transport->name);
+    return 0;
 }
 
-static void *login_thread(void *arg)
+/* monotonic, a clock step while offline must not stretch a timed wait */
+static void login_cond_init(void)
 {
-    int ret = 0;
+    pthread_condattr_t attr;
 
-    ASSERT( g_lst_info.dev_name );
-    ASSERT( g_lst_info.uid );
-    ASSERT( g_lst_info.passwd );
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&g_login.cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
 
-    for (;;) {
-        ret = IOTC_Device_Login( g_lst_info.uid, g_lst_info.dev_name, g_lst_info.passwd );
-        if (ret == IOTC_ER_NoERROR) {
-            LOGI("login success");
-            g_lst_info.login_success = 1;
-            break;
-        } else {
-            LOGE("ret = %d\n", ret );
-            sleep(1);
-        }
-    }
+int lst_init(const char *uid, const char *dev_name, const char *passwd, int max_client_num)
+{
+    ASSERT( uid );
+    ASSERT( dev_name );
+    ASSERT( passwd );
 
-    return NULL;
+    pthread_once(&g_login_once, login_cond_init);
+    return g_transport->init(uid, dev_name, passwd, max_client_num);
 }
 
 int lst_login_success()
 {
-    return g_lst_info.login_success;
+    return g_transport->login_success();
 }
 
-int lst_init(const char *uid, const char *dev_name, const char *passwd, int max_client_num)
+void lst_notify_login(int logged_in)
+{
+    pthread_once(&g_login_once, login_cond_init);
+    pthread_mutex_lock(&g_login.mutex);
+    g_login.logged_in = logged_in;
+    if (logged_in)
+        pthread_cond_broadcast(&g_login.cond);
+    pthread_mutex_unlock(&g_login.mutex);
+}
+
+int lst_wait_login(int timeout_ms)
 {
+    struct timespec deadline;
     int ret = 0;
 
-    ASSERT( uid );
-    ASSERT( dev_name );
-    ASSERT( passwd );
+    pthread_once(&g_login_once, login_cond_init);
+    if (timeout_ms >= 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout_ms/1000;
+        deadline.tv_nsec += (long)(timeout_ms%1000)*1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+    pthread_mutex_lock(&g_login.mutex);
+    while (!g_login.logged_in && ret == 0) {
+        if (timeout_ms < 0)
+            pthread_cond_wait(&g_login.cond, &g_login.mutex);
+        else
+            ret = pthread_cond_timedwait(&g_login.cond, &g_login.mutex, &deadline);
+    }
+    ret = g_login.logged_in ? 0 : LST_ERR_TIMEOUT;
+    pthread_mutex_unlock(&g_login.mutex);
+    return ret;
+}
 
-    g_lst_info.uid = strdup(uid);
-    g_lst_info.dev_name = strdup(dev_name);
-    g_lst_info.passwd = strdup(passwd);
+int lst_send_data( int ch, uint8_t *header, int hdr_len, uint8_t *data, int len)
+{
+    return g_transport->send_data(ch, header, hdr_len, data, len);
+}
 
-    IOTC_Set_Max_Session_Number(max_client_num);
-    ret = IOTC_Initialize2(0);
-    if(ret != IOTC_ER_NoERROR) {
-        LOGE("IOTC_Initialize2(), ret=[%d]\n", ret);
-        return -1;
-    }
-    IOTC_Get_Login_Info_ByCallBackFn( login_cb );
-    avInitialize(max_client_num*3);
-    pthread_create( &g_lst_info.login_tid, NULL, login_thread, NULL );
+int lst_listen( int timeout )
+{
+    return g_transport->listen(timeout);
+}
 
-    return 0;
+int lst_create_data_channel( int sid, auth_cb_t cb )
+{
+    return g_transport->create_data_channel(sid, cb);
 }
 
-int lst_send_data( int ch, uint8_t *header, int hdr_len, uint8_t *data, int len)
+int lst_recv_ioctl( int ch, unsigned int *out_cmd, char *out_data, int max_size, unsigned int timeout )
 {
-    int ret = 0;
+    ASSERT(out_data);
 
-    ret = avSendFrameData( ch, (const char *)data, len, (void *)header, hdr_len );
-    if ( ret < 0 ) {
-        LOGE("avSendFrameData error,ret = %d", ret);
-        return -1;
-    }
+    return g_transport->recv_ioctl(ch, out_cmd, out_data, max_size, timeout);
+}
 
-    return 0;
+int lst_send_ioctl(int ch, unsigned int cmd, const char *data, int data_size)
+{
+    return g_transport->send_ioctl(ch, cmd, data, data_size);
 }
 
-int lst_listen( int timeout )
+int lst_create_data_channel2(int sid, const char *user, const char *passwd, int free_ch)
 {
-    int sid = 0;
+    return g_transport->create_data_channel2(sid, user, passwd, free_ch);
+}
 
-    sid = IOTC_Listen( timeout );
-    if ( sid < 0 ) {
-        LOGE("IOTC_Listen() error, sid = %d", sid );
-        sleep(1);
-        return -1;
-    }
+int lst_session_get_free_channel(int sid)
+{
+    return g_transport->session_get_free_channel(sid);
+}
+
+void lst_close_channel(int ch)
+{
+    if (ch >= 0 && g_transport->close_channel)
+        g_transport->close_channel(ch);
+}
 
-    return sid;
+void lst_close_session(int sid)
+{
+    if (sid >= 0 && g_transport->close_session)
+        g_transport->close_session(sid);
 }
 
-int lst_create_data_channel( int sid, auth_cb_t cb )
+int lst_bulk_supported()
 {
-    int resend=-1;
-    int index = avServStart3( sid, cb, 0, 0, 0, &resend);
-    struct st_SInfo s_info;
+    return g_transport->open_bulk != NULL;
+}
 
-    if ( index < 0 ) {
-        IOTC_Session_Close(sid);
-        return -1;
-    }
-    avServSetResendSize(index, 1024*1024);
-
-    if( IOTC_Session_Check(sid, &s_info) == IOTC_ER_NoERROR ) {
-        char *mode[3] = {"P2P", "RLY", "LAN"};
-
-        if( isdigit( s_info.RemoteIP[0] ) )
-            LOGI("Client is from[IP:%s, Port:%d] Mode[%s] VPG[%d:%d:%d] VER[%X] NAT[%d] AES[%d]",
-                   s_info.RemoteIP,
-                   s_info.RemotePort,
-                   mode[(int)s_info.Mode],
-                   s_info.VID,
-                   s_info.PID,
-                   s_info.GID,
-                   s_info.IOTCVersion,
-                   s_info.NatType,
-                   s_info.isSecure);
-    }
-    return index;
+int lst_open_bulk(int sid, int ch, int timeout_ms)
+{
+    if (!g_transport->open_bulk)
+        return -ERRINVAL;
+    return g_transport->open_bulk(sid, ch, timeout_ms);
 }
 
-int lst_recv_ioctl( int ch, unsigned int *out_cmd, char *out_data, int max_size, unsigned int timeout )
+int lst_write_bulk(int bulk, const uint8_t *data, int len)
 {
-    int ret = 0;
-    unsigned int cmd = 0;
+    ASSERT( data );
 
-    ASSERT(out_data);
+    return g_transport->write_bulk(bulk, data, len);
+}
 
-    ret = avRecvIOCtrl( ch, &cmd, out_data, max_size, timeout );
-    if ( ret < 0 ) {
-        if ( ret == AV_ER_TIMEOUT ) {
-            return LST_ERR_TIMEOUT;
-        } else if (ret == AV_ER_SESSION_CLOSE_BY_REMOTE) {
-            LOGE("session closed by remote");
-            return LST_ERR_SESSION_CLOSE_BY_REMOTE;
-        } else {
-            LOGE("avRecvIOCtrl error, ret = %d", ret);
-            return -1;
-        }
-    }
+void lst_close_bulk(int bulk, int abort)
+{
+    if (bulk >= 0 && g_transport->close_bulk)
+        g_transport->close_bulk(bulk, abort);
+}
+
+int lst_watch_session(int sid, lst_session_lost_cb_t on_lost)
+{
+    if (!g_transport->watch_session)
+        return -ERRINVAL;
+    __atomic_store_n(&g_session_lost_cb, on_lost, __ATOMIC_RELEASE);
+    return g_transport->watch_session(sid);
+}
+
+void lst_notify_session_lost(int sid)
+{
+    lst_session_lost_cb_t cb = __atomic_load_n(&g_session_lost_cb, __ATOMIC_ACQUIRE);
+
+    if (cb)
+        cb(sid);
+}
+
+int lst_event_driven()
+{
+    return g_transport->serve != NULL;
+}
 
-    LOGI("recv cmd:0x%x", cmd );
-    switch( cmd ) {
+unsigned int lst_map_iotype(unsigned int iotype)
+{
+    switch( iotype ) {
     case IOTYPE_USER_IPCAM_START:
-        *out_cmd = LST_START_PLAY;
-        break;
+        return LST_START_PLAY;
     case IOTYPE_USER_IPCAM_STOP:
-        *out_cmd = LST_STOP_PLAY;
-        break;
+        return LST_STOP_PLAY;
     case IOTYPE_USER_IPCAM_LISTEVENT_REQ:
-        *out_cmd = LST_USER_IPCAM_LISTEVENT_REQ;
-        break;
+        return LST_USER_IPCAM_LISTEVENT_REQ;
     case IOTYPE_USER_IPCAM_RECORD_PLAYCONTROL:
-        *out_cmd = LST_USER_IPCAM_RECORD_PLAYCONTROL;
-        break;
+        return LST_USER_IPCAM_RECORD_PLAYCONTROL;
     case IOTYPE_USER_IPCAM_AUDIOSTART:
-        *out_cmd = LST_USER_IPCAM_AUDIOSTART;
-        break;
+        return LST_USER_IPCAM_AUDIOSTART;
     case IOTYPE_USER_IPCAM_PTZ_COMMAND:
-        *out_cmd = LST_USER_IPCAM_PTZ_COMMAND;
-        break;
+        return LST_USER_IPCAM_PTZ_COMMAND;
+    case LST_USER_SDP_METRICS_REQ:
+        return LST_USER_SDP_METRICS_REQ;
+    case LST_USER_SDP_THUMB_REQ:
+        return LST_USER_SDP_THUMB_REQ;
+    case LST_USER_SDP_EXPORT_REQ:
+        return LST_USER_SDP_EXPORT_REQ;
     default:
-        break;
+        return 0;
     }
+}
 
-    return 0;
+/* worker->mutex held and a slot free */
+static void queue_event(lst_worker_t *worker, int type, int sid, int ch, unsigned int cmd, const char *data, int size)
+{
+    lst_event_t *event = &worker->queue[(worker->head + worker->count) % LST_DISPATCH_QUEUE_LEN];
+
+    event->type = type;
+    event->sid = sid;
+    event->ch = ch;
+    event->cmd = cmd;
+    if (size < 0)
+        size = 0;
+    if (size > LST_MAX_IOCTL_SIZE)
+        size = LST_MAX_IOCTL_SIZE;
+    event->size = size;
+    memset(event->data, 0, sizeof(event->data));
+    if (size)
+        memcpy(event->data, data, size);
+    worker->count++;
 }
-int lst_send_ioctl(int ch, unsigned int cmd, const char *data, int data_size)
+
+static void *dispatch_thread(void *arg)
 {
-    int ret;
+    lst_worker_t *worker = (lst_worker_t *)arg;
+    lst_event_t *event = NULL;
 
-    ret = avSendIOCtrl(ch, cmd, data, data_size);
-    if (ret < 0) {
-        LOGE("avSendIOCtrl error, ret = %d", ret);
-        return -ERRINTERNAL;
-    }
+    for (;;) {
+        pthread_mutex_lock(&worker->mutex);
+        while (!worker->count)
+            pthread_cond_wait(&worker->cond, &worker->mutex);
+        event = &worker->queue[worker->head];
+        pthread_mutex_unlock(&worker->mutex);
+
+        /* the slot stays ours until head moves */
+        switch (event->type) {
+        case LST_EVENT_OPEN:
+            if (g_handlers.on_open)
+                g_handlers.on_open(event->sid, event->ch);
+            break;
+        case LST_EVENT_IOCTL:
+            if (g_handlers.on_ioctl)
+                g_handlers.on_ioctl(event->sid, event->ch, event->cmd, event->data, event->size);
+            break;
+        case LST_EVENT_CLOSE:
+            if (g_handlers.on_close)
+                g_handlers.on_close(event->sid, event->ch);
+            break;
+        default:
+            break;
+        }
 
-    return 0;
+        pthread_mutex_lock(&worker->mutex);
+        worker->head = (worker->head+1) % LST_DISPATCH_QUEUE_LEN;
+        worker->count--;
+        /* in the freed slot at once, nothing that came later gets ahead of it */
+        if (worker->close_count) {
+            queue_event(worker, LST_EVENT_CLOSE, worker->closes[0].sid, worker->closes[0].ch, 0, NULL, 0);
+            worker->close_count--;
+            memmove(&worker->closes[0], &worker->closes[1], sizeof(lst_close_t)*worker->close_count);
+        }
+        pthread_mutex_unlock(&worker->mutex);
+    }
+    return NULL;
 }
 
-int lst_create_data_channel2(int sid, const char *user, const char *passwd, int free_ch)
+/* worker->mutex held, a close of the same canal waiting already is enough */
+static void defer_close(lst_worker_t *worker, int sid, int ch)
 {
-    int ch = 0;
+    int i = 0;
 
-    LOGI("free_ch:%d", free_ch);
-    ch = avServStart(sid, user, passwd, 0, 0, free_ch);
-    if (ch < 0) {
-        LOGE("avServStart error");
-        return -ERRINTERNAL;
+    for (i = 0; i < worker->close_count; i++) {
+        if (worker->closes[i].sid == sid && worker->closes[i].ch == ch)
+            return;
     }
-    LOGI("ch:%d", ch);
+    if (worker->close_count == LST_DISPATCH_QUEUE_LEN) {
+        LOGE("dispatch queue full, drop close of sid %d ch %d", sid, ch);
+        return;
+    }
+    worker->closes[worker->close_count].sid = sid;
+    worker->closes[worker->close_count].ch = ch;
+    worker->close_count++;
+}
 
-    return ch;
+/*
+ * called on the sdk threads, never blocks. a full queue drops ioctls(the
+ * app resends) and opens(the app connects again), closes wait aside and
+ * go in as slots free up
+ */
+static void dispatch(int type, int sid, int ch, unsigned int cmd, const char *data, int size)
+{
+    lst_worker_t *worker = NULL;
+
+    if (sid < 0)
+        return;
+    worker = &g_workers[sid % LST_DISPATCH_WORKERS];
+    pthread_mutex_lock(&worker->mutex);
+    if (worker->count == LST_DISPATCH_QUEUE_LEN) {
+        if (type == LST_EVENT_CLOSE)
+            defer_close(worker, sid, ch);
+        else
+            LOGE("dispatch queue full, drop %s 0x%x of sid %d", type == LST_EVENT_OPEN ? "open" : "cmd", cmd, sid);
+        pthread_mutex_unlock(&worker->mutex);
+        return;
+    }
+    queue_event(worker, type, sid, ch, cmd, data, size);
+    pthread_cond_broadcast(&worker->cond);
+    pthread_mutex_unlock(&worker->mutex);
 }
 
-int lst_session_get_free_channel(int sid)
+void lst_dispatch_open(int sid, int ch)
+{
+    dispatch(LST_EVENT_OPEN, sid, ch, 0, NULL, 0);
+}
+
+void lst_dispatch_ioctl(int sid, int ch, unsigned int cmd, const char *data, int size)
+{
+    LOGD("sid:%d ch:%d cmd:0x%x", sid, ch, cmd);
+    dispatch(LST_EVENT_IOCTL, sid, ch, cmd, data, size);
+}
+
+void lst_dispatch_close(int sid, int ch)
 {
-    return(IOTC_Session_Get_Free_Channel(sid));
+    dispatch(LST_EVENT_CLOSE, sid, ch, 0, NULL, 0);
 }
 
+int lst_serve(const lst_handlers_t *handlers)
+{
+    pthread_t tid;
+    int i = 0;
+
+    ASSERT( handlers );
+
+    if (!g_transport->serve)
+        return -ERRINVAL;
+    g_handlers = *handlers;
+    for (i = 0; i < LST_DISPATCH_WORKERS; i++) {
+        pthread_mutex_init(&g_workers[i].mutex, NULL);
+        pthread_cond_init(&g_workers[i].cond, NULL);
+        if (pthread_create(&tid, NULL, dispatch_thread, &g_workers[i]) != 0)
+            return -ERRINTERNAL;
+        pthread_detach(tid);
+    }
+    return g_transport->serve(handlers->auth);
+}
@@ -8,6 +8,7 @@
 #ifndef _TRANSFER_H
 
 #include "P2PCam/AVIOCTRLDEFs.h"
+#include <stdint.h>
 #include "IOTCAPIs.h"
 
 enum {
@@ -19,22 +20,116 @@ enum {
     LST_USER_IPCAM_RECORD_PLAYCONTROL = 0x031A,
     LST_USER_IPCAM_RECORD_PLAYCONTROL_RESP = 0x031B,
     LST_USER_IPCAM_PTZ_COMMAND = 0x1001,
+    LST_USER_SDP_METRICS_REQ = 0x2100, /* no payload */
+    LST_USER_SDP_METRICS_RESP = 0x2101, /* metrics_report_t */
+    LST_USER_SDP_THUMB_REQ = 0x2102, /* sdp_thumb_req_t */
+    LST_USER_SDP_THUMB_RESP = 0x2103, /* sdp_thumb_resp_hdr_t and data, see thumb.h */
+    LST_USER_SDP_EXPORT_REQ = 0x2104, /* sdp_export_req_t */
+    LST_USER_SDP_EXPORT_RESP = 0x2105, /* sdp_export_resp_t */
 };
 
 #define LST_ERR_TIMEOUT -2
 #define LST_ERR_SESSION_CLOSE_BY_REMOTE -3
+#define LST_MAX_IOCTL_SIZE 1024
 
 typedef int (*auth_cb_t)( char *user, char *passwd );
 
+/*
+ * handlers of an event driven backend. they run on the lst dispatcher,
+ * never on the sdk's own threads, and the events of one session are
+ * delivered in order. data of on_ioctl is LST_MAX_IOCTL_SIZE bytes,
+ * zero filled after size
+ */
+typedef struct {
+    auth_cb_t auth;
+    void (*on_open)(int sid, int ch);
+    void (*on_ioctl)(int sid, int ch, unsigned int cmd, char *data, int size);
+    void (*on_close)(int sid, int ch);
+} lst_handlers_t;
+
+/*
+ * a transport backend, the lst_* functions below forward to the
+ * selected one. ch is always the av index returned by the backend
+ */
+typedef struct {
+    const char *name;
+    int (*init)(const char *uid, const char *dev_name, const char *passwd, int max_client_num);
+    int (*login_success)();
+    int (*listen)(int timeout);
+    int (*create_data_channel)(int sid, auth_cb_t cb);
+    int (*create_data_channel2)(int sid, const char *user, const char *passwd, int free_ch);
+    int (*session_get_free_channel)(int sid);
+    int (*recv_ioctl)(int ch, unsigned int *out_cmd, char *out_data, int max_size, unsigned int timeout);
+    int (*send_ioctl)(int ch, unsigned int cmd, const char *data, int data_size);
+    int (*send_data)(int ch, uint8_t *header, int hdr_len, uint8_t *data, int len);
+    /*
+     * event driven backends only: start serving, sessions and ioctls are
+     * reported through lst_dispatch_xxx. listen, create_data_channel and
+     * recv_ioctl are not used then
+     */
+    int (*serve)(auth_cb_t auth);
+    /* optional, releases an av index of create_data_channel(2) */
+    void (*close_channel)(int ch);
+    /* optional, the sid may be handed out again afterwards */
+    void (*close_session)(int sid);
+    /* optional, report a remote close with lst_notify_session_lost() as soon as it is seen */
+    int (*watch_session)(int sid);
+    /*
+     * optional, a reliable byte stream for bulk transfer on iotc channel
+     * ch of the session(tutk rdt). open waits up to timeout_ms for the
+     * app to join, write blocks until all of len is queued, close with
+     * abort set drops what is still queued
+     */
+    int (*open_bulk)(int sid, int ch, int timeout_ms);
+    int (*write_bulk)(int bulk, const uint8_t *data, int len);
+    void (*close_bulk)(int bulk, int abort);
+} lst_transport_t;
+
+typedef void (*lst_session_lost_cb_t)(int sid);
+
+#ifndef LST_NO_TUTK
+extern const lst_transport_t lst_tutk_transport;
+extern const lst_transport_t lst_avapi2_transport;
+#endif
+extern const lst_transport_t lst_loopback_transport;
+extern const lst_transport_t lst_loopback_event_transport;
+
+/* must be called before lst_init, default is tutk when it is built in */
+extern int lst_set_transport(const lst_transport_t *transport);
+
 extern int lst_recv_ioctl( int ch, unsigned int *out_cmd, char *out_data, int max_size, unsigned int timeout );
 extern int lst_send_data( int ch, uint8_t *header, int hdr_len, uint8_t *data, int len);
 extern int lst_listen( int timeout );
 extern int lst_create_data_channel( int sid, auth_cb_t cb );
 extern int lst_init(const char *uid, const char *dev_name, const char *passwd, int max_client_num);
 extern int lst_login_success();
+/* blocks until the backend is logged in, timeout_ms < 0 waits forever. 0 or LST_ERR_TIMEOUT */
+extern int lst_wait_login(int timeout_ms);
 extern int lst_send_ioctl(int ch, unsigned int cmd, const char *data, int data_size);
 extern int lst_create_data_channel2(int sid, const char *user, const char *passwd, int free_ch);
 extern int lst_session_get_free_channel(int sid);
+extern int lst_event_driven();
+extern void lst_close_channel(int ch);
+extern void lst_close_session(int sid);
+/* on_lost runs on a backend thread and must not block */
+extern int lst_watch_session(int sid, lst_session_lost_cb_t on_lost);
+/* 0 when the backend has no bulk stream(e.g. avapi2) */
+extern int lst_bulk_supported();
+/* bulk stream of the backend, -ERRINVAL when it has none */
+extern int lst_open_bulk(int sid, int ch, int timeout_ms);
+extern int lst_write_bulk(int bulk, const uint8_t *data, int len);
+extern void lst_close_bulk(int bulk, int abort);
+/* event driven backends, instead of the lst_listen()/lst_recv_ioctl() loop */
+extern int lst_serve(const lst_handlers_t *handlers);
+
+/* for backends */
+/* login state changed, wakes lst_wait_login() */
+extern void lst_notify_login(int logged_in);
+extern void lst_notify_session_lost(int sid);
+extern unsigned int lst_map_iotype(unsigned int iotype);
+extern void lst_dispatch_open(int sid, int ch);
+extern void lst_dispatch_ioctl(int sid, int ch, unsigned int cmd, const char *data, int size);
+extern void lst_dispatch_close(int sid, int ch);
 
 #define _TRANSFER_H
 #endif
@@ -0,0 +1,216 @@
+/**
+* @file transfer_avapi2.c
+* @author rigensen
+* @brief  lst transport over tutk AVAPI2, event driven: ioctls and
+*         canal status come in callbacks and are handed to the lst
+*         dispatcher, no thread is parked in avRecvIOCtrl per client
+* @date 日 10/27 10:05:31 2019
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <assert.h>
+#include "IOTCAPIs.h"
+#include "AVAPIs.h"
+#include "AVAPIs2.h"
+#include "P2PCam/AVIOCTRLDEFs.h"
+#include "transfer.h"
+#include "dbg.h"
+#include "public.h"
+
+#define AVAPI2_CHANNEL_LIMIT 4 /* ioctl canal + playback canals of one session */
+#define AVAPI2_CREATE_TIMEOUT_SEC 10
+#define AVAPI2_SEND_RETRY_US (5*1000)
+#define AVAPI2_SEND_TIMEOUT_US (10*1000*1000)
+
+typedef struct {
+    const char *uid;
+    int login_success;
+    auth_cb_t auth;
+} avapi2_info_t;
+
+static avapi2_info_t g_avapi2;
+
+static int auth_cb(char *user, char *passwd)
+{
+    if (!g_avapi2.auth)
+        return 0;
+    return g_avapi2.auth(user, passwd);
+}
+
+static int server_status_cb(int status, int error, int canal, unsigned char channel, struct st_SInfo *s_info, void *user_data)
+{
+    (void)channel;
+    (void)s_info;
+    (void)user_data;
+
+    switch (status) {
+    case AVAPI2_SERVER_STATUS_LOGINED:
+        LOGI("login success");
+        g_avapi2.login_success = 1;
+        lst_notify_login(1);
+        break;
+    case AVAPI2_SERVER_STATUS_LOGIN_FAILED:
+        LOGE("login failed, error = %d", error);
+        g_avapi2.login_success = 0;
+        lst_notify_login(0);
+        break;
+    case AVAPI2_SERVER_STATUS_CLIENT_LOGINED:
+        LOGI("client logined, canal:%d", canal);
+        lst_dispatch_open(AVAPI2_GetSessionIDByAVCanal(canal), canal);
+        break;
+    case AVAPI2_SERVER_STATUS_START_CANAL_FAILED:
+        LOGE("start canal failed, error = %d", error);
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
+
+/* reported as soon as the sdk sees the canal go, no recv loop has to time out */
+static int canal_status_cb(int canal, int error, unsigned char channel, struct st_SInfo *s_info, void *user_data)
+{
+    (void)s_info;
+    (void)user_data;
+
+    if (error >= 0)
+        return 0;
+    LOGI("canal %d(channel %d) closed, error = %d", canal, channel, error);
+    /* the canal is stopped by whoever owns it, on lst_close_channel() */
+    lst_dispatch_close(AVAPI2_GetSessionIDByAVCanal(canal), canal);
+    return 0;
+}
+
+static int ioctl_recv_cb(int canal, unsigned int type, unsigned char *buf, unsigned int len, void *user_data)
+{
+    unsigned int cmd = lst_map_iotype(type);
+
+    (void)user_data;
+
+    LOGD("recv cmd:0x%x", type);
+    if (!cmd)
+        return 0;
+    lst_dispatch_ioctl(AVAPI2_GetSessionIDByAVCanal(canal), canal, cmd, (const char *)buf, (int)len);
+    return 0;
+}
+
+/* dev_name/passwd are not used, AVAPI2_ServerStart logs in by uid */
+static int avapi2_init(const char *uid, const char *dev_name, const char *passwd, int max_client_num)
+{
+    int ret = 0;
+
+    ASSERT( uid );
+    (void)dev_name;
+    (void)passwd;
+
+    g_avapi2.uid = strdup(uid);
+    ret = AVAPI2_ServerInitial(max_client_num, AVAPI2_CHANNEL_LIMIT, 0);
+    if (ret < 0) {
+        LOGE("AVAPI2_ServerInitial(), ret=[%d]", ret);
+        return -1;
+    }
+    return 0;
+}
+
+static int avapi2_serve(auth_cb_t auth)
+{
+    int ret = 0;
+
+    g_avapi2.auth = auth;
+    ret = AVAPI2_ServerStart((char *)g_avapi2.uid, 0, 0, auth_cb, server_status_cb, canal_status_cb, ioctl_recv_cb);
+    if (ret < 0) {
+        LOGE("AVAPI2_ServerStart(), ret=[%d]", ret);
+        return -ERRINTERNAL;
+    }
+    return 0;
+}
+
+static int avapi2_login_success()
+{
+    return g_avapi2.login_success;
+}
+
+/*
+ * the frame header goes as meta info, same as the frame info of
+ * avSendFrameData, so the payload needs no copy
+ */
+static int avapi2_send_data(int ch, uint8_t *header, int hdr_len, uint8_t *data, int len)
+{
+    int ret = 0, waited = 0;
+
+    for (;;) {
+        ret = AVAPI2_SendMetaData(ch, (char *)data, len, header, hdr_len);
+        if (ret != AV_ER_EXCEED_MAX_SIZE || waited >= AVAPI2_SEND_TIMEOUT_US)
+            break;
+        usleep(AVAPI2_SEND_RETRY_US);
+        waited += AVAPI2_SEND_RETRY_US;
+    }
+    if (ret < 0) {
+        LOGE("AVAPI2_SendMetaData error, ret = %d", ret);
+        return -1;
+    }
+    return 0;
+}
+
+static int avapi2_send_ioctl(int ch, unsigned int cmd, const char *data, int data_size)
+{
+    int ret = AVAPI2_SendIOCtrl(ch, cmd, data, data_size);
+
+    if (ret < 0) {
+        LOGE("AVAPI2_SendIOCtrl error, ret = %d", ret);
+        return -ERRINTERNAL;
+    }
+    return 0;
+}
+
+static int avapi2_create_data_channel2(int sid, const char *user, const char *passwd, int free_ch)
+{
+    int resend = 1, canal = 0;
+
+    (void)user;
+    (void)passwd;
+
+    LOGI("free_ch:%d", free_ch);
+    canal = AVAPI2_CreateChannelForSend(sid, AVAPI2_CREATE_TIMEOUT_SEC, 0, (unsigned char)free_ch, resend,
+            server_status_cb, canal_status_cb);
+    if (canal < 0) {
+        LOGE("AVAPI2_CreateChannelForSend error, ret = %d", canal);
+        return -ERRINTERNAL;
+    }
+    /* slices must not be dropped under congestion */
+    AVAPI2_ServerSetCongestionCtrlMode(canal, AVAPI2_CONGESTION_CTRL_META);
+    LOGI("canal:%d", canal);
+    return canal;
+}
+
+static int avapi2_session_get_free_channel(int sid)
+{
+    return(IOTC_Session_Get_Free_Channel(sid));
+}
+
+static void avapi2_close_channel(int canal)
+{
+    AVAPI2_ServerStopCanal(canal);
+}
+
+/* once its canals are stopped, the sid is free for the next client */
+static void avapi2_close_session(int sid)
+{
+    IOTC_Session_Close(sid);
+}
+
+const lst_transport_t lst_avapi2_transport = {
+    .name = "avapi2",
+    .init = avapi2_init,
+    .login_success = avapi2_login_success,
+    .create_data_channel2 = avapi2_create_data_channel2,
+    .session_get_free_channel = avapi2_session_get_free_channel,
+    .send_ioctl = avapi2_send_ioctl,
+    .send_data = avapi2_send_data,
+    .serve = avapi2_serve,
+    .close_channel = avapi2_close_channel,
+    .close_session = avapi2_close_session,
+};
@@ -0,0 +1,525 @@
+/**
+* @file transfer_loopback.c
+* @author rigensen
+* @brief  lst transport in process, records what the device sends and
+*         injects link latency/bandwidth, so the playback path can be
+*         run and measured on a host without tutk
+* @date 三 10/23 15:20:05 2019
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/time.h>
+#include <sys/param.h>
+#include "transfer.h"
+#include "transfer_loopback.h"
+#include "dbg.h"
+#include "public.h"
+
+#define LOOPBACK_MAX_SESSION 16
+#define LOOPBACK_MAX_CH 4 /* av channels per session, index = sid*LOOPBACK_MAX_CH+ch */
+#define LOOPBACK_IOCTL_QUEUE_LEN 16
+#define LOOPBACK_MAX_IOCTL_SIZE 1024
+
+typedef struct {
+    unsigned int cmd;
+    int size;
+    char data[LOOPBACK_MAX_IOCTL_SIZE];
+} loopback_ioctl_t;
+
+typedef struct {
+    int used;
+    int accepted;
+    int closed;
+    int watched; /* lst_watch_session(), disconnect reports the loss */
+    unsigned int busy_ch; /* bit per av channel, 0 is the ioctl channel */
+    int head;
+    int count;
+    loopback_ioctl_t queue[LOOPBACK_IOCTL_QUEUE_LEN];
+    int64_t link_free_us;
+    lst_loopback_stats_t stats[LOOPBACK_MAX_CH];
+} loopback_session_t;
+
+typedef struct {
+    int login_success;
+    int event_mode; /* lst_loopback_event_transport, no listen/recv loop */
+    int latency_us;
+    int64_t bandwidth_bps;
+    lst_loopback_frame_cb_t frame_cb;
+    lst_loopback_ioctl_cb_t ioctl_cb;
+    lst_loopback_bulk_cb_t bulk_cb;
+    void *cb_arg;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    loopback_session_t sessions[LOOPBACK_MAX_SESSION];
+} loopback_info_t;
+
+static loopback_info_t g_loopback = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static int64_t get_time_us()
+{
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return tp.tv_sec*(int64_t)1000000 + tp.tv_nsec/1000;
+}
+
+static void get_abstime(unsigned int timeout_ms, struct timespec *ts)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    ts->tv_sec = now.tv_sec + timeout_ms/1000;
+    ts->tv_nsec = now.tv_usec*1000 + (timeout_ms%1000)*1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+static inline loopback_session_t *get_session(int ch)
+{
+    int sid = ch/LOOPBACK_MAX_CH;
+
+    if (ch < 0 || sid >= LOOPBACK_MAX_SESSION || !g_loopback.sessions[sid].used)
+        return NULL;
+    return &g_loopback.sessions[sid];
+}
+
+void lst_loopback_set_link(int latency_us, int64_t bandwidth_bps)
+{
+    pthread_mutex_lock(&g_loopback.mutex);
+    g_loopback.latency_us = latency_us;
+    g_loopback.bandwidth_bps = bandwidth_bps;
+    pthread_mutex_unlock(&g_loopback.mutex);
+}
+
+void lst_loopback_set_callbacks(lst_loopback_frame_cb_t frame_cb, lst_loopback_ioctl_cb_t ioctl_cb, void *arg)
+{
+    pthread_mutex_lock(&g_loopback.mutex);
+    g_loopback.frame_cb = frame_cb;
+    g_loopback.ioctl_cb = ioctl_cb;
+    g_loopback.cb_arg = arg;
+    pthread_mutex_unlock(&g_loopback.mutex);
+}
+
+void lst_loopback_set_bulk_callback(lst_loopback_bulk_cb_t bulk_cb)
+{
+    pthread_mutex_lock(&g_loopback.mutex);
+    g_loopback.bulk_cb = bulk_cb;
+    pthread_mutex_unlock(&g_loopback.mutex);
+}
+
+int lst_loopback_connect()
+{
+    int sid = 0;
+
+    pthread_mutex_lock(&g_loopback.mutex);
+    for (sid = 0; sid < LOOPBACK_MAX_SESSION; sid++) {
+        loopback_session_t *session = &g_loopback.sessions[sid];
+
+        if (session->used)
+            continue;
+        memset(session, 0, sizeof(*session));
+        session->used = 1;
+        session->busy_ch = 1;
+        session->accepted = g_loopback.event_mode;
+        pthread_cond_broadcast(&g_loopback.cond);
+        pthread_mutex_unlock(&g_loopback.mutex);
+        if (session->accepted)
+            lst_dispatch_open(sid, sid*LOOPBACK_MAX_CH);
+        return sid;
+    }
+    pthread_mutex_unlock(&g_loopback.mutex);
+    LOGE("no free session");
+    return -ERRNOMEM;
+}
+
+void lst_loopback_disconnect(int sid)
+{
+    int notify = 0, lost = 0;
+
+    pthread_mutex_lock(&g_loopback.mutex);
+    if (sid >= 0 && sid < LOOPBACK_MAX_SESSION && g_loopback.sessions[sid].used
+            && !g_loopback.sessions[sid].closed) {
+        g_loopback.sessions[sid].closed = 1;
+        notify = g_loopback.event_mode;
+        lost = g_loopback.sessions[sid].watched;
+        pthread_cond_broadcast(&g_loopback.cond);
+    }
+    pthread_mutex_unlock(&g_loopback.mutex);
+    if (notify)
+        lst_dispatch_close(sid, sid*LOOPBACK_MAX_CH);
+    if (lost)
+        lst_notify_session_lost(sid);
+}
+
+int lst_loopback_session_used(int sid)
+{
+    int used = 0;
+
+    pthread_mutex_lock(&g_loopback.mutex);
+    if (sid >= 0 && sid < LOOPBACK_MAX_SESSION)
+        used = g_loopback.sessions[sid].used;
+    pthread_mutex_unlock(&g_loopback.mutex);
+    return used;
+}
+
+int lst_loopback_push_ioctl(int sid, unsigned int cmd, const void *data, int size)
+{
+    loopback_session_t *session = NULL;
+    loopback_ioctl_t *ioctl = NULL;
+
+    if (size < 0 || size > LOOPBACK_MAX_IOCTL_SIZE)
+        return -ERRINVAL;
+    pthread_mutex_lock(&g_loopback.mutex);
+    session = get_session(sid*LOOPBACK_MAX_CH);
+    if (!session || session->closed || session->count == LOOPBACK_IOCTL_QUEUE_LEN) {
+        pthread_mutex_unlock(&g_loopback.mutex);
+        return -ERRINVAL;
+    }
+    if (g_loopback.event_mode) {
+        pthread_mutex_unlock(&g_loopback.mutex);
+        lst_dispatch_ioctl(sid, sid*LOOPBACK_MAX_CH, cmd, data, size);
+        return 0;
+    }
+    ioctl = &session->queue[(session->head + session->count) % LOOPBACK_IOCTL_QUEUE_LEN];
+    ioctl->cmd = cmd;
+    ioctl->size = size;
+    if (size)
+        memcpy(ioctl->data, data, size);
+    session->count++;
+    pthread_cond_broadcast(&g_loopback.cond);
+    pthread_mutex_unlock(&g_loopback.mutex);
+    return 0;
+}
+
+int lst_loopback_get_stats(int ch, lst_loopback_stats_t *stats)
+{
+    loopback_session_t *session = NULL;
+
+    ASSERT( stats );
+
+    pthread_mutex_lock(&g_loopback.mutex);
+    if ( (session = get_session(ch)) == NULL ) {
+        pthread_mutex_unlock(&g_loopback.mutex);
+        return -ERRINVAL;
+    }
+    *stats = session->stats[ch%LOOPBACK_MAX_CH];
+    pthread_mutex_unlock(&g_loopback.mutex);
+    return 0;
+}
+
+static int loopback_init(const char *uid, const char *dev_name, const char *passwd, int max_client_num)
+{
+    (void)uid;
+    (void)dev_name;
+    (void)passwd;
+
+    if (max_client_num > LOOPBACK_MAX_SESSION)
+        LOGE("max_client_num %d, only %d sessions", max_client_num, LOOPBACK_MAX_SESSION);
+    g_loopback.login_success = 1;
+    lst_notify_login(1);
+    return 0;
+}
+
+static int loopback_serve(auth_cb_t auth)
+{
+    (void)auth;
+
+    pthread_mutex_lock(&g_loopback.mutex);
+    g_loopback.event_mode = 1;
+    pthread_mutex_unlock(&g_loopback.mutex);
+    return 0;
+}
+
+static int loopback_login_success()
+{
+    return g_loopback.login_success;
+}
+
+static int loopback_listen(int timeout)
+{
+    struct timespec abstime;
+    int sid = 0, ret = 0;
+
+    get_abstime(timeout, &abstime);
+    pthread_mutex_lock(&g_loopback.mutex);
+    for (;;) {
+        for (sid = 0; sid < LOOPBACK_MAX_SESSION; sid++) {
+            loopback_session_t *session = &g_loopback.sessions[sid];
+
+            if (session->used && !session->accepted) {
+                session->accepted = 1;
+                pthread_mutex_unlock(&g_loopback.mutex);
+                return sid;
+            }
+        }
+        /* same as IOTC_Listen(), 0 waits forever */
+        if (timeout == 0)
+            ret = pthread_cond_wait(&g_loopback.cond, &g_loopback.mutex);
+        else
+            ret = pthread_cond_timedwait(&g_loopback.cond, &g_loopback.mutex, &abstime);
+        if (ret == ETIMEDOUT)
+            break;
+    }
+    pthread_mutex_unlock(&g_loopback.mutex);
+    return -1;
+}
+
+static int loopback_create_data_channel(int sid, auth_cb_t cb)
+{
+    (void)cb;
+
+    if ( !get_session(sid*LOOPBACK_MAX_CH) )
+        return -1;
+    return sid*LOOPBACK_MAX_CH;
+}
+
+static int loopback_create_data_channel2(int sid, const char *user, const char *passwd, int free_ch)
+{
+    loopback_session_t *session = NULL;
+    int ch = -ERRINTERNAL;
+
+    (void)user;
+    (void)passwd;
+
+    pthread_mutex_lock(&g_loopback.mutex);
+    if ( (session = get_session(sid*LOOPBACK_MAX_CH)) && free_ch > 0 && free_ch < LOOPBACK_MAX_CH ) {
+        session->busy_ch |= 1u << free_ch;
+        ch = sid*LOOPBACK_MAX_CH + free_ch;
+    }
+    pthread_mutex_unlock(&g_loopback.mutex);
+    return ch;
+}
+
+/* reserves the channel like IOTC_Session_Get_Free_Channel() does */
+static int loopback_session_get_free_channel(int sid)
+{
+    loopback_session_t *session = NULL;
+    int ch = 0;
+
+    pthread_mutex_lock(&g_loopback.mutex);
+    if ( (session = get_session(sid*LOOPBACK_MAX_CH)) ) {
+        for (ch = 1; ch < LOOPBACK_MAX_CH; ch++) {
+            if (!(session->busy_ch & (1u << ch))) {
+                session->busy_ch |= 1u << ch;
+                pthread_mutex_unlock(&g_loopback.mutex);
+                return ch;
+            }
+        }
+    }
+    pthread_mutex_unlock(&g_loopback.mutex);
+    return -1;
+}
+
+static void loopback_close_channel(int ch)
+{
+    loopback_session_t *session = NULL;
+
+    pthread_mutex_lock(&g_loopback.mutex);
+    if ( (session = get_session(ch)) )
+        session->busy_ch &= ~(1u << (ch%LOOPBACK_MAX_CH));
+    pthread_mutex_unlock(&g_loopback.mutex);
+}
+
+static void loopback_close_session(int sid)
+{
+    loopback_session_t *session = NULL;
+
+    pthread_mutex_lock(&g_loopback.mutex);
+    if ( (session = get_session(sid*LOOPBACK_MAX_CH)) ) {
+        session->used = 0;
+        pthread_cond_broadcast(&g_loopback.cond);
+    }
+    pthread_mutex_unlock(&g_loopback.mutex);
+}
+
+static int loopback_watch_session(int sid)
+{
+    loopback_session_t *session = NULL;
+    int ret = -ERRINVAL;
+
+    pthread_mutex_lock(&g_loopback.mutex);
+    if ( (session = get_session(sid*LOOPBACK_MAX_CH)) ) {
+        session->watched = 1;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&g_loopback.mutex);
+    return ret;
+}
+
+static int loopback_recv_ioctl(int ch, unsigned int *out_cmd, char *out_data, int max_size, unsigned int timeout)
+{
+    loopback_session_t *session = NULL;
+    loopback_ioctl_t *ioctl = NULL;
+    struct timespec abstime;
+
+    get_abstime(timeout, &abstime);
+    pthread_mutex_lock(&g_loopback.mutex);
+    if ( (session = get_session(ch)) == NULL ) {
+        pthread_mutex_unlock(&g_loopback.mutex);
+        return -1;
+    }
+    while (!session->count && !session->closed) {
+        if (pthread_cond_timedwait(&g_loopback.cond, &g_loopback.mutex, &abstime) == ETIMEDOUT) {
+            pthread_mutex_unlock(&g_loopback.mutex);
+            return LST_ERR_TIMEOUT;
+        }
+    }
+    if (!session->count) {
+        pthread_mutex_unlock(&g_loopback.mutex);
+        LOGE("session closed by remote");
+        return LST_ERR_SESSION_CLOSE_BY_REMOTE;
+    }
+    ioctl = &session->queue[session->head];
+    *out_cmd = ioctl->cmd;
+    memcpy(out_data, ioctl->data, MIN(ioctl->size, max_size));
+    session->head = (session->head+1) % LOOPBACK_IOCTL_QUEUE_LEN;
+    session->count--;
+    pthread_mutex_unlock(&g_loopback.mutex);
+    LOGD("recv cmd:0x%x", *out_cmd);
+    return 0;
+}
+
+/* sleep until the session link has room for len more bytes */
+static int pace_send(int ch, int len, lst_loopback_stats_t **stats)
+{
+    loopback_session_t *session = NULL;
+    int64_t now = 0, wait_until = 0;
+
+    pthread_mutex_lock(&g_loopback.mutex);
+    if ( (session = get_session(ch)) == NULL || session->closed
+            || !(session->busy_ch & (1u << (ch%LOOPBACK_MAX_CH))) ) {
+        pthread_mutex_unlock(&g_loopback.mutex);
+        return -1;
+    }
+    now = get_time_us();
+    wait_until = MAX(now, session->link_free_us);
+    if (g_loopback.bandwidth_bps > 0)
+        session->link_free_us = wait_until + (int64_t)len*8*1000000/g_loopback.bandwidth_bps;
+    else
+        session->link_free_us = wait_until;
+    wait_until = session->link_free_us + g_loopback.latency_us;
+    *stats = &session->stats[ch%LOOPBACK_MAX_CH];
+    pthread_mutex_unlock(&g_loopback.mutex);
+    if (wait_until > now)
+        usleep(wait_until - now);
+    return 0;
+}
+
+static int loopback_send_ioctl(int ch, unsigned int cmd, const char *data, int data_size)
+{
+    lst_loopback_stats_t *stats = NULL;
+
+    if (pace_send(ch, data_size, &stats) < 0) {
+        LOGE("send ioctl on closed ch %d", ch);
+        return -ERRINTERNAL;
+    }
+    pthread_mutex_lock(&g_loopback.mutex);
+    stats->ioctls++;
+    pthread_mutex_unlock(&g_loopback.mutex);
+    if (g_loopback.ioctl_cb)
+        g_loopback.ioctl_cb(ch, cmd, data, data_size, g_loopback.cb_arg);
+    return 0;
+}
+
+static int loopback_send_data(int ch, uint8_t *header, int hdr_len, uint8_t *data, int len)
+{
+    lst_loopback_stats_t *stats = NULL;
+
+    if (pace_send(ch, hdr_len+len, &stats) < 0) {
+        LOGE("send data on closed ch %d", ch);
+        return -1;
+    }
+    pthread_mutex_lock(&g_loopback.mutex);
+    stats->frames++;
+    stats->bytes += len;
+    pthread_mutex_unlock(&g_loopback.mutex);
+    if (g_loopback.frame_cb)
+        g_loopback.frame_cb(ch, header, hdr_len, data, len, g_loopback.cb_arg);
+    return 0;
+}
+
+/* the app side is always there, the bulk stream is the channel itself */
+static int loopback_open_bulk(int sid, int ch, int timeout_ms)
+{
+    loopback_session_t *session = NULL;
+    int bulk = -ERRINTERNAL;
+
+    (void)timeout_ms;
+
+    pthread_mutex_lock(&g_loopback.mutex);
+    if ( (session = get_session(sid*LOOPBACK_MAX_CH)) && !session->closed
+            && ch > 0 && ch < LOOPBACK_MAX_CH && (session->busy_ch & (1u << ch)) )
+        bulk = sid*LOOPBACK_MAX_CH + ch;
+    pthread_mutex_unlock(&g_loopback.mutex);
+    return bulk;
+}
+
+static int loopback_write_bulk(int bulk, const uint8_t *data, int len)
+{
+    lst_loopback_stats_t *stats = NULL;
+
+    if (pace_send(bulk, len, &stats) < 0) {
+        LOGE("write bulk on closed ch %d", bulk);
+        return -1;
+    }
+    pthread_mutex_lock(&g_loopback.mutex);
+    stats->bytes += len;
+    pthread_mutex_unlock(&g_loopback.mutex);
+    if (g_loopback.bulk_cb)
+        g_loopback.bulk_cb(bulk, data, len, 0, g_loopback.cb_arg);
+    return 0;
+}
+
+static void loopback_close_bulk(int bulk, int abort)
+{
+    loopback_close_channel(bulk);
+    if (g_loopback.bulk_cb)
+        g_loopback.bulk_cb(bulk, NULL, 0, abort, g_loopback.cb_arg);
+}
+
+const lst_transport_t lst_loopback_transport = {
+    .name = "loopback",
+    .init = loopback_init,
+    .login_success = loopback_login_success,
+    .listen = loopback_listen,
+    .create_data_channel = loopback_create_data_channel,
+    .create_data_channel2 = loopback_create_data_channel2,
+    .session_get_free_channel = loopback_session_get_free_channel,
+    .recv_ioctl = loopback_recv_ioctl,
+    .send_ioctl = loopback_send_ioctl,
+    .send_data = loopback_send_data,
+    .close_channel = loopback_close_channel,
+    .close_session = loopback_close_session,
+    .watch_session = loopback_watch_session,
+    .open_bulk = loopback_open_bulk,
+    .write_bulk = loopback_write_bulk,
+    .close_bulk = loopback_close_bulk,
+};
+
+/* same link, sessions and ioctls go through the lst dispatcher */
+const lst_transport_t lst_loopback_event_transport = {
+    .name = "loopback_event",
+    .init = loopback_init,
+    .login_success = loopback_login_success,
+    .create_data_channel2 = loopback_create_data_channel2,
+    .session_get_free_channel = loopback_session_get_free_channel,
+    .send_ioctl = loopback_send_ioctl,
+    .send_data = loopback_send_data,
+    .serve = loopback_serve,
+    .close_channel = loopback_close_channel,
+    .close_session = loopback_close_session,
+    .open_bulk = loopback_open_bulk,
+    .write_bulk = loopback_write_bulk,
+    .close_bulk = loopback_close_bulk,
+};
@@ -0,0 +1,46 @@
+/**
+* @file transfer_loopback.h
+* @author rigensen
+* @brief  in process lst transport, the "client" side is driven by
+*         the functions below instead of a phone app
+* @date 三 10/23 15:20:05 2019
+*/
+
+#ifndef _TRANSFER_LOOPBACK_H
+
+#include <stdint.h>
+
+typedef struct {
+    uint64_t frames;
+    uint64_t bytes;
+    uint64_t ioctls;
+} lst_loopback_stats_t;
+
+/* every frame/ioctl the device sends, ch is the av index it was sent on */
+typedef void (*lst_loopback_frame_cb_t)(int ch, const uint8_t *hdr, int hdr_len, const uint8_t *data, int len, void *arg);
+typedef void (*lst_loopback_ioctl_cb_t)(int ch, unsigned int cmd, const char *data, int size, void *arg);
+/* bytes written to a bulk stream, data is NULL once the device closed it, abort when it dropped the rest */
+typedef void (*lst_loopback_bulk_cb_t)(int bulk, const uint8_t *data, int len, int abort, void *arg);
+
+/*
+ * latency_us is added to every send, bandwidth_bps caps each session's
+ * link, 0 means unlimited
+ */
+extern void lst_loopback_set_link(int latency_us, int64_t bandwidth_bps);
+extern void lst_loopback_set_callbacks(lst_loopback_frame_cb_t frame_cb, lst_loopback_ioctl_cb_t ioctl_cb, void *arg);
+/* same arg as lst_loopback_set_callbacks() */
+extern void lst_loopback_set_bulk_callback(lst_loopback_bulk_cb_t bulk_cb);
+/*
+ * new client session, returned by the next lst_listen(), or reported
+ * to on_open with lst_loopback_event_transport
+ */
+extern int lst_loopback_connect();
+extern void lst_loopback_disconnect(int sid);
+/* 0 once the device closed the session and the sid can be reused */
+extern int lst_loopback_session_used(int sid);
+/* cmd is the LST_xxx command as lst_recv_ioctl() reports it */
+extern int lst_loopback_push_ioctl(int sid, unsigned int cmd, const void *data, int size);
+extern int lst_loopback_get_stats(int ch, lst_loopback_stats_t *stats);
+
+#define _TRANSFER_LOOPBACK_H
+#endif
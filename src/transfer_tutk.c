@@ -0,0 +1,414 @@
+/**
+* @file transfer_tutk.c
+* @author rigensen
+* @brief  lst transport over tutk IOTCAPIs/AVAPIs
+* @date 一 10/14 18:42:54 2019
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <assert.h>
+#include <time.h>
+#include "IOTCAPIs.h"
+#include "AVAPIs.h"
+#include "RDTAPIs.h"
+#include "P2PCam/AVFRAMEINFO.h"
+#include "P2PCam/AVIOCTRLDEFs.h"
+#include "transfer.h"
+#include "dbg.h"
+#include "public.h"
+
+#define MAX_SIZE_IOCTRL_BUF     1024
+
+#define LOGIN_BACKOFF_MIN_MS 1000
+#define LOGIN_BACKOFF_MAX_MS (64*1000)
+
+#define RDT_SEND_BUFFER_SIZE (2*1024*1024) /* queued in the sdk, writes block beyond */
+#define RDT_RETRY_US (2*1000)
+
+enum {
+    LOGIN_PENDING,  /* IOTC_Device_LoginNB called, no answer yet */
+    LOGIN_DONE,
+    LOGIN_FAILED,
+};
+
+typedef struct {
+    const char *uid;
+    const char *dev_name;
+    const char *passwd;
+    int login_success;
+    int login_state;
+    pthread_mutex_t login_mutex;
+    pthread_cond_t login_cond;
+    pthread_t login_tid;
+} lst_info_t;
+
+static lst_info_t g_lst_info = {
+    .login_mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* iotc channel under each rdt id, turned off again when it is closed */
+typedef struct {
+    int sid;
+    int ch;
+} rdt_chan_t;
+
+static rdt_chan_t g_rdt_chans[MAX_DEFAULT_RDT_CHANNEL_NUMBER];
+
+static void login_cb(unsigned int info)
+{
+    if((info & 0x04)) {
+        LOGI("I can be connected via Internet");
+    } else if((info & 0x08)) {
+        LOGI("I am be banned by IOTC Server because UID multi-login");
+    }
+}
+
+static void set_login_state(int state)
+{
+    pthread_mutex_lock(&g_lst_info.login_mutex);
+    g_lst_info.login_state = state;
+    g_lst_info.login_success = state == LOGIN_DONE;
+    pthread_cond_signal(&g_lst_info.login_cond);
+    pthread_mutex_unlock(&g_lst_info.login_mutex);
+    lst_notify_login(state == LOGIN_DONE);
+}
+
+/* called on the sdk thread, must not block */
+static void login_state_handler(IOTCDeviceLoginState state, int err, void *user_data)
+{
+    (void)user_data;
+
+    switch (state) {
+    case IOTC_DEVLOGIN_ST_LOGINED:
+        LOGI("login success");
+        set_login_state(LOGIN_DONE);
+        break;
+    case IOTC_DEVLOGIN_ST_LOGIN_FAILED:
+        LOGE("login failed, err = %d", err);
+        set_login_state(LOGIN_FAILED);
+        break;
+    case IOTC_DEVLOGIN_ST_RELOGINING:
+        LOGI("relogining");
+        break;
+    case IOTC_DEVLOGIN_ST_MULTI_LOGIN:
+        LOGE("UID multi-login");
+        break;
+    default:
+        break;
+    }
+}
+
+/* login_mutex held, returns early if the sdk logs in meanwhile */
+static void login_backoff(int ms)
+{
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += ms/1000;
+    deadline.tv_nsec += (long)(ms%1000)*1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    while (g_lst_info.login_state != LOGIN_DONE
+            && pthread_cond_timedwait(&g_lst_info.login_cond, &g_lst_info.login_mutex, &deadline) == 0)
+        ;
+}
+
+/*
+ * the login itself runs in the sdk, this thread sleeps on login_cond
+ * until the state handler reports a result. failures are retried with
+ * exponential backoff, a success resets it
+ */
+static void *login_thread(void *arg)
+{
+    int ret = 0, backoff = LOGIN_BACKOFF_MIN_MS;
+
+    (void)arg;
+    ASSERT( g_lst_info.dev_name );
+    ASSERT( g_lst_info.uid );
+    ASSERT( g_lst_info.passwd );
+
+    pthread_mutex_lock(&g_lst_info.login_mutex);
+    for (;;) {
+        if (g_lst_info.login_state != LOGIN_DONE) {
+            g_lst_info.login_state = LOGIN_PENDING;
+            pthread_mutex_unlock(&g_lst_info.login_mutex);
+            ret = IOTC_Device_LoginNB( g_lst_info.uid, g_lst_info.dev_name, g_lst_info.passwd,
+                    login_state_handler, NULL );
+            pthread_mutex_lock(&g_lst_info.login_mutex);
+            if (ret != IOTC_ER_NoERROR && ret != IOTC_ER_LOGIN_ALREADY_CALLED) {
+                LOGE("IOTC_Device_LoginNB ret = %d", ret);
+                g_lst_info.login_state = LOGIN_FAILED;
+            }
+            while (g_lst_info.login_state == LOGIN_PENDING)
+                pthread_cond_wait(&g_lst_info.login_cond, &g_lst_info.login_mutex);
+        }
+        if (g_lst_info.login_state == LOGIN_DONE) {
+            backoff = LOGIN_BACKOFF_MIN_MS;
+            /* the sdk keeps a login alive by itself, wake up only when it gives up */
+            while (g_lst_info.login_state == LOGIN_DONE)
+                pthread_cond_wait(&g_lst_info.login_cond, &g_lst_info.login_mutex);
+            continue;
+        }
+        LOGI("retry login in %d ms", backoff);
+        login_backoff(backoff);
+        if (backoff < LOGIN_BACKOFF_MAX_MS)
+            backoff *= 2;
+    }
+    pthread_mutex_unlock(&g_lst_info.login_mutex);
+
+    return NULL;
+}
+
+static int tutk_login_success()
+{
+    return g_lst_info.login_success;
+}
+
+static int tutk_init(const char *uid, const char *dev_name, const char *passwd, int max_client_num)
+{
+    pthread_condattr_t attr;
+    int ret = 0;
+
+    ASSERT( uid );
+    ASSERT( dev_name );
+    ASSERT( passwd );
+
+    g_lst_info.uid = strdup(uid);
+    g_lst_info.dev_name = strdup(dev_name);
+    g_lst_info.passwd = strdup(passwd);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&g_lst_info.login_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    IOTC_Set_Max_Session_Number(max_client_num);
+    ret = IOTC_Initialize2(0);
+    if(ret != IOTC_ER_NoERROR) {
+        LOGE("IOTC_Initialize2(), ret=[%d]\n", ret);
+        return -1;
+    }
+    IOTC_Get_Login_Info_ByCallBackFn( login_cb );
+    avInitialize(max_client_num*3);
+    if ( (ret = RDT_Initialize()) < 0 )
+        LOGE("RDT_Initialize(), ret=[%d], no bulk transfer", ret);
+    pthread_create( &g_lst_info.login_tid, NULL, login_thread, NULL );
+
+    return 0;
+}
+
+static int tutk_send_data( int ch, uint8_t *header, int hdr_len, uint8_t *data, int len)
+{
+    int ret = 0;
+
+    ret = avSendFrameData( ch, (const char *)data, len, (void *)header, hdr_len );
+    if ( ret < 0 ) {
+        LOGE("avSendFrameData error,ret = %d", ret);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int tutk_listen( int timeout )
+{
+    int sid = 0;
+
+    sid = IOTC_Listen( timeout );
+    if ( sid < 0 ) {
+        LOGE("IOTC_Listen() error, sid = %d", sid );
+        sleep(1);
+        return -1;
+    }
+
+    return sid;
+}
+
+static int tutk_create_data_channel( int sid, auth_cb_t cb )
+{
+    int resend=-1;
+    int index = avServStart3( sid, cb, 0, 0, 0, &resend);
+    struct st_SInfo s_info;
+
+    if ( index < 0 ) {
+        IOTC_Session_Close(sid);
+        return -1;
+    }
+    avServSetResendSize(index, 1024*1024);
+
+    if( IOTC_Session_Check(sid, &s_info) == IOTC_ER_NoERROR ) {
+        char *mode[3] = {"P2P", "RLY", "LAN"};
+
+        if( isdigit( s_info.RemoteIP[0] ) )
+            LOGI("Client is from[IP:%s, Port:%d] Mode[%s] VPG[%d:%d:%d] VER[%X] NAT[%d] AES[%d]",
+                   s_info.RemoteIP,
+                   s_info.RemotePort,
+                   mode[(int)s_info.Mode],
+                   s_info.VID,
+                   s_info.PID,
+                   s_info.GID,
+                   s_info.IOTCVersion,
+                   s_info.NatType,
+                   s_info.isSecure);
+    }
+    return index;
+}
+
+static int tutk_recv_ioctl( int ch, unsigned int *out_cmd, char *out_data, int max_size, unsigned int timeout )
+{
+    int ret = 0;
+    unsigned int cmd = 0;
+
+    ASSERT(out_data);
+
+    ret = avRecvIOCtrl( ch, &cmd, out_data, max_size, timeout );
+    if ( ret < 0 ) {
+        if ( ret == AV_ER_TIMEOUT ) {
+            return LST_ERR_TIMEOUT;
+        } else if (ret == AV_ER_SESSION_CLOSE_BY_REMOTE) {
+            LOGE("session closed by remote");
+            return LST_ERR_SESSION_CLOSE_BY_REMOTE;
+        } else {
+            LOGE("avRecvIOCtrl error, ret = %d", ret);
+            return -1;
+        }
+    }
+
+    LOGD("recv cmd:0x%x", cmd );
+    *out_cmd = lst_map_iotype(cmd);
+
+    return 0;
+}
+static int tutk_send_ioctl(int ch, unsigned int cmd, const char *data, int data_size)
+{
+    int ret;
+
+    ret = avSendIOCtrl(ch, cmd, data, data_size);
+    if (ret < 0) {
+        LOGE("avSendIOCtrl error, ret = %d", ret);
+        return -ERRINTERNAL;
+    }
+
+    return 0;
+}
+
+static int tutk_create_data_channel2(int sid, const char *user, const char *passwd, int free_ch)
+{
+    int ch = 0;
+
+    LOGI("free_ch:%d", free_ch);
+    ch = avServStart(sid, user, passwd, 0, 0, free_ch);
+    if (ch < 0) {
+        LOGE("avServStart error");
+        return -ERRINTERNAL;
+    }
+    LOGI("ch:%d", ch);
+
+    return ch;
+}
+
+static int tutk_session_get_free_channel(int sid)
+{
+    return(IOTC_Session_Get_Free_Channel(sid));
+}
+
+static void tutk_close_channel(int ch)
+{
+    avServStop(ch);
+}
+
+static void tutk_close_session(int sid)
+{
+    IOTC_Session_Close(sid);
+}
+
+static void session_status_cb(int sid, int err)
+{
+    LOGI("session %d lost, err = %d", sid, err);
+    lst_notify_session_lost(sid);
+}
+
+/* called back as soon as iotc sees the remote close, not only when the av heartbeat expires */
+static int tutk_watch_session(int sid)
+{
+    int ret = IOTC_Session_Check_ByCallBackFn(sid, session_status_cb);
+
+    if (ret < 0) {
+        LOGE("IOTC_Session_Check_ByCallBackFn error, ret = %d", ret);
+        return -ERRINTERNAL;
+    }
+    return 0;
+}
+
+static int tutk_open_bulk(int sid, int ch, int timeout_ms)
+{
+    int rdt = RDT_Create(sid, timeout_ms, ch);
+
+    if (rdt < 0) {
+        LOGE("RDT_Create error, ret = %d", rdt);
+        IOTC_Session_Channel_OFF(sid, ch);
+        return -ERRINTERNAL;
+    }
+    if (rdt < MAX_DEFAULT_RDT_CHANNEL_NUMBER) {
+        g_rdt_chans[rdt].sid = sid;
+        g_rdt_chans[rdt].ch = ch;
+    }
+    RDT_Set_Max_SendBuffer_Size(rdt, RDT_SEND_BUFFER_SIZE);
+    return rdt;
+}
+
+static int tutk_write_bulk(int bulk, const uint8_t *data, int len)
+{
+    int ret = 0, off = 0;
+
+    while (off < len) {
+        ret = RDT_Write(bulk, (const char *)data + off, len - off);
+        if (ret == RDT_ER_SEND_BUFFER_FULL) {
+            usleep(RDT_RETRY_US);
+            continue;
+        }
+        if (ret < 0) {
+            LOGE("RDT_Write error, ret = %d", ret);
+            return -1;
+        }
+        off += ret;
+    }
+    return 0;
+}
+
+/* a destroy waits for the app to read everything and close its side */
+static void tutk_close_bulk(int bulk, int abort)
+{
+    if (abort) {
+        RDT_Abort(bulk);
+    } else {
+        RDT_Flush(bulk);
+        RDT_Destroy(bulk);
+    }
+    if (bulk < MAX_DEFAULT_RDT_CHANNEL_NUMBER)
+        IOTC_Session_Channel_OFF(g_rdt_chans[bulk].sid, g_rdt_chans[bulk].ch);
+}
+
+const lst_transport_t lst_tutk_transport = {
+    .name = "tutk",
+    .init = tutk_init,
+    .login_success = tutk_login_success,
+    .listen = tutk_listen,
+    .create_data_channel = tutk_create_data_channel,
+    .create_data_channel2 = tutk_create_data_channel2,
+    .session_get_free_channel = tutk_session_get_free_channel,
+    .recv_ioctl = tutk_recv_ioctl,
+    .send_ioctl = tutk_send_ioctl,
+    .send_data = tutk_send_data,
+    .close_channel = tutk_close_channel,
+    .close_session = tutk_close_session,
+    .watch_session = tutk_watch_session,
+    .open_bulk = tutk_open_bulk,
+    .write_bulk = tutk_write_bulk,
+    .close_bulk = tutk_close_bulk,
+};
@@ -0,0 +1,333 @@
+/**
+* @file ts_parse.c
+* @author rigensen
+* @brief  keyframes of a ts slice and joining slices, see ts_parse.h
+* @date 二 10/29 10:05:41 2019
+*/
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include "ts_parse.h"
+#include "dbg.h"
+#include "public.h"
+
+#define TS_SYNC_BYTE 0x47
+#define PAT_PID 0
+#define NULL_PID 0x1fff
+#define STREAM_TYPE_H264 0x1b
+#define STREAM_TYPE_H265 0x24
+
+typedef struct {
+    int pid;
+    int pusi;
+    int rai; /* random_access_indicator of the adaptation field */
+    const uint8_t *payload;
+    int payload_len;
+} ts_pkt_t;
+
+typedef struct {
+    int pat_off;
+    int pmt_off;
+    int pmt_pid;
+    int video_pid;
+    int stream_type;
+} ts_psi_t;
+
+static int parse_pkt(const uint8_t *p, ts_pkt_t *pkt)
+{
+    int afc = (p[3] >> 4) & 0x3, off = 4;
+
+    if (p[0] != TS_SYNC_BYTE)
+        return -1;
+    pkt->pid = ((p[1] & 0x1f) << 8) | p[2];
+    pkt->pusi = !!(p[1] & 0x40);
+    pkt->rai = 0;
+    if (afc & 0x2) {
+        if (p[4] > TS_PKT_LEN - 5)
+            return -1;
+        if (p[4])
+            pkt->rai = !!(p[5] & 0x40);
+        off += 1 + p[4];
+    }
+    pkt->payload = NULL;
+    pkt->payload_len = 0;
+    if ((afc & 0x1) && off < TS_PKT_LEN) {
+        pkt->payload = p + off;
+        pkt->payload_len = TS_PKT_LEN - off;
+    }
+    return 0;
+}
+
+/* the section a psi packet starts, its length without the crc */
+static const uint8_t *psi_section(const ts_pkt_t *pkt, int *len)
+{
+    const uint8_t *s = NULL;
+
+    if (!pkt->pusi || pkt->payload_len < 1 || 1 + pkt->payload[0] + 3 > pkt->payload_len)
+        return NULL;
+    s = pkt->payload + 1 + pkt->payload[0];
+    *len = 3 + (((s[1] & 0x0f) << 8) | s[2]) - 4;
+    if (*len > pkt->payload_len - 1 - pkt->payload[0])
+        return NULL;
+    return s;
+}
+
+static int parse_pat(const ts_pkt_t *pkt, ts_psi_t *psi)
+{
+    const uint8_t *s = NULL;
+    int len = 0, i = 0;
+
+    if ( (s = psi_section(pkt, &len)) == NULL || s[0] != 0x00 )
+        return -1;
+    for (i = 8; i + 4 <= len; i += 4) {
+        /* program 0 is the network pid */
+        if (((s[i] << 8) | s[i+1]) == 0)
+            continue;
+        psi->pmt_pid = ((s[i+2] & 0x1f) << 8) | s[i+3];
+        return 0;
+    }
+    return -1;
+}
+
+static int parse_pmt(const ts_pkt_t *pkt, ts_psi_t *psi)
+{
+    const uint8_t *s = NULL;
+    int len = 0, i = 0;
+
+    if ( (s = psi_section(pkt, &len)) == NULL || s[0] != 0x02 || len < 12 )
+        return -1;
+    for (i = 12 + (((s[10] & 0x0f) << 8) | s[11]); i + 5 <= len;
+            i += 5 + (((s[i+3] & 0x0f) << 8) | s[i+4])) {
+        if (s[i] == STREAM_TYPE_H264 || s[i] == STREAM_TYPE_H265) {
+            psi->stream_type = s[i];
+            psi->video_pid = ((s[i+1] & 0x1f) << 8) | s[i+2];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int find_psi(const uint8_t *ts, int size, ts_psi_t *psi)
+{
+    ts_pkt_t pkt;
+    int off = 0;
+
+    memset(psi, 0, sizeof(*psi));
+    psi->pat_off = psi->pmt_off = psi->pmt_pid = -1;
+    for (off = 0; off + TS_PKT_LEN <= size; off += TS_PKT_LEN) {
+        if (parse_pkt(ts + off, &pkt) < 0)
+            return -1;
+        if (pkt.pid == PAT_PID && psi->pat_off < 0 && parse_pat(&pkt, psi) == 0)
+            psi->pat_off = off;
+        else if (psi->pmt_pid > 0 && pkt.pid == psi->pmt_pid && parse_pmt(&pkt, psi) == 0)
+            psi->pmt_off = off;
+        if (psi->pat_off >= 0 && psi->pmt_off >= 0)
+            return 0;
+    }
+    return -1;
+}
+
+static int64_t parse_pts(const uint8_t *p)
+{
+    return ((int64_t)((p[0] >> 1) & 0x07) << 30) | (p[1] << 22) | ((p[2] >> 1) << 15)
+        | (p[3] << 7) | (p[4] >> 1);
+}
+
+/* an idr or parameter sets before any other slice, or the muxer said so */
+static int is_keyframe(const ts_pkt_t *pkt, int stream_type, int64_t *pts)
+{
+    const uint8_t *pes = pkt->payload;
+    int len = pkt->payload_len, i = 0, type = 0;
+
+    *pts = -1;
+    if (len < 9 || pes[0] || pes[1] || pes[2] != 1)
+        return 0;
+    if ((pes[7] & 0x80) && len >= 14)
+        *pts = parse_pts(pes + 9);
+    if (pkt->rai)
+        return 1;
+    for (i = 9 + pes[8]; i + 3 < len; i++) {
+        if (pes[i] || pes[i+1] || pes[i+2] != 1)
+            continue;
+        if (stream_type == STREAM_TYPE_H264) {
+            type = pes[i+3] & 0x1f;
+            if (type == 5 || type == 7)
+                return 1;
+            if (type == 1)
+                return 0;
+        } else {
+            type = (pes[i+3] >> 1) & 0x3f;
+            if ((type >= 16 && type <= 21) || (type >= 32 && type <= 34))
+                return 1;
+            if (type < 16)
+                return 0;
+        }
+    }
+    return 0;
+}
+
+int ts_next_keyframe(const uint8_t *ts, int size, int from, ts_keyframe_t *kf)
+{
+    ts_psi_t psi;
+    ts_pkt_t pkt;
+    int off = 0;
+
+    ASSERT( ts );
+    ASSERT( kf );
+
+    if (find_psi(ts, size, &psi) < 0)
+        return -1;
+    kf->off = -1;
+    for (off = (from + TS_PKT_LEN - 1)/TS_PKT_LEN*TS_PKT_LEN; off + TS_PKT_LEN <= size; off += TS_PKT_LEN) {
+        if (parse_pkt(ts + off, &pkt) < 0)
+            return -1;
+        if (pkt.pid != psi.video_pid)
+            continue;
+        if (kf->off >= 0 && pkt.pusi)
+            return 0;
+        if (kf->off >= 0) {
+            kf->end = off + TS_PKT_LEN;
+            continue;
+        }
+        if (pkt.pusi && is_keyframe(&pkt, psi.stream_type, &kf->pts)) {
+            kf->off = off;
+            kf->end = off + TS_PKT_LEN;
+        }
+    }
+    return kf->off >= 0 ? 0 : -1;
+}
+
+int ts_copy_keyframe(const uint8_t *ts, int size, const ts_keyframe_t *kf, uint8_t *out, int out_size)
+{
+    ts_psi_t psi;
+    ts_pkt_t pkt;
+    int off = 0, len = 0;
+
+    ASSERT( ts );
+    ASSERT( kf );
+    ASSERT( out );
+
+    if (find_psi(ts, size, &psi) < 0 || kf->end > size)
+        return -1;
+    if (out_size < 2*TS_PKT_LEN)
+        return -ERRINVAL;
+    memcpy(out, ts + psi.pat_off, TS_PKT_LEN);
+    memcpy(out + TS_PKT_LEN, ts + psi.pmt_off, TS_PKT_LEN);
+    len = 2*TS_PKT_LEN;
+    for (off = kf->off; off < kf->end; off += TS_PKT_LEN) {
+        if (parse_pkt(ts + off, &pkt) < 0)
+            return -1;
+        if (pkt.pid != psi.video_pid)
+            continue;
+        if (len + TS_PKT_LEN > out_size)
+            return -ERRINVAL;
+        memcpy(out + len, ts + off, TS_PKT_LEN);
+        len += TS_PKT_LEN;
+    }
+    return len;
+}
+
+static uint32_t crc32_mpeg(const uint8_t *buf, int len)
+{
+    uint32_t crc = 0xffffffff;
+    int i = 0;
+
+    while (len--) {
+        crc ^= (uint32_t)*buf++ << 24;
+        for (i = 0; i < 8; i++)
+            crc = crc & 0x80000000 ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+    }
+    return crc;
+}
+
+void ts_concat_init(ts_concat_t *c)
+{
+    ASSERT( c );
+
+    memset(c, 0, sizeof(*c));
+    memset(c->cc, 0xff, sizeof(c->cc));
+    c->pmt_pid = -1;
+    c->pat_version = c->pmt_version = -1;
+}
+
+void ts_concat_slice(ts_concat_t *c, int gap)
+{
+    c->head = 1;
+    c->discontinuity = gap && c->pat_version >= 0;
+}
+
+/*
+ * the section of pkt(parsed in place) against the current table,
+ * version and crc aside. returns 1 when it repeats it, otherwise it
+ * becomes the current one with the version after the last one sent.
+ * sections over more than one packet are left alone
+ */
+static int update_table(const ts_pkt_t *pkt, uint8_t *table, int *table_len, int *version)
+{
+    uint8_t *s = NULL;
+    int len = 0, same = 0;
+    uint32_t crc = 0;
+
+    if ( (s = (uint8_t *)psi_section(pkt, &len)) == NULL || len < 8
+            || s + len + 4 > pkt->payload + pkt->payload_len )
+        return 0;
+    if (*version < 0)
+        *version = (s[5] >> 1) & 0x1f;
+    else if (len == *table_len && !memcmp(s, table, 5) && !memcmp(s + 6, table + 6, len - 6))
+        same = 1;
+    else
+        *version = (*version + 1) & 0x1f;
+    if (((s[5] >> 1) & 0x1f) != *version) {
+        s[5] = (s[5] & 0xc1) | (*version << 1);
+        crc = crc32_mpeg(s, len);
+        s[len] = crc >> 24;
+        s[len+1] = crc >> 16;
+        s[len+2] = crc >> 8;
+        s[len+3] = crc;
+    }
+    memcpy(table, s, len);
+    *table_len = len;
+    return same;
+}
+
+int ts_concat_packet(ts_concat_t *c, const uint8_t *in, uint8_t *out)
+{
+    ts_pkt_t pkt;
+    ts_psi_t psi;
+    int afc = 0, same = 0;
+
+    ASSERT( c );
+    ASSERT( in );
+    ASSERT( out );
+
+    memcpy(out, in, TS_PKT_LEN);
+    if (parse_pkt(out, &pkt) < 0)
+        return -1;
+    if (pkt.pid == NULL_PID)
+        return 0;
+    afc = (out[3] >> 4) & 0x3;
+    if (pkt.pid == PAT_PID) {
+        same = update_table(&pkt, c->pat, &c->pat_len, &c->pat_version);
+        if (parse_pat(&pkt, &psi) == 0)
+            c->pmt_pid = psi.pmt_pid;
+    } else if (pkt.pid == c->pmt_pid) {
+        same = update_table(&pkt, c->pmt, &c->pmt_len, &c->pmt_version);
+    } else {
+        c->head = 0;
+        /* the clock jumps, the decoder must not take it for an error */
+        if (c->discontinuity && (afc & 0x2) && out[4] && (out[5] & 0x10)) {
+            out[5] |= 0x80;
+            c->discontinuity = 0;
+        }
+    }
+    if (same && c->head)
+        return 0;
+    /* a counter only moves with a payload */
+    if (c->cc[pkt.pid] == 0xff)
+        c->cc[pkt.pid] = out[3] & 0x0f;
+    else if (afc & 0x1)
+        c->cc[pkt.pid] = (c->cc[pkt.pid] + 1) & 0x0f;
+    out[3] = (out[3] & 0xf0) | c->cc[pkt.pid];
+    return TS_PKT_LEN;
+}
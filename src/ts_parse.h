@@ -0,0 +1,58 @@
+/**
+* @file ts_parse.h
+* @author rigensen
+* @brief  just enough mpeg-ts parsing to find the keyframes of a slice
+*         and cut them out as small ts of their own. h264 and h265.
+*         and to join slices into one continuous ts
+* @date 二 10/29 10:05:41 2019
+*/
+
+#ifndef _TS_PARSE_H
+
+#include <stdint.h>
+
+#define TS_PKT_LEN 188
+#define TS_PTS_HZ 90000
+#define TS_PID_NUM 8192
+
+typedef struct {
+    int64_t pts; /* TS_PTS_HZ, -1 when the pes carries none */
+    int off;     /* first packet of the keyframe pes */
+    int end;     /* past its last packet, other pids may be in between */
+} ts_keyframe_t;
+
+/* next keyframe starting at or after byte from, 0 or -1 when there is none */
+extern int ts_next_keyframe(const uint8_t *ts, int size, int from, ts_keyframe_t *kf);
+/*
+ * pat, pmt and the video packets of kf into out, a ts a player decodes
+ * into one picture. returns its size, -ERRINVAL when out is too small
+ */
+extern int ts_copy_keyframe(const uint8_t *ts, int size, const ts_keyframe_t *kf, uint8_t *out, int out_size);
+
+/*
+ * slices fed one after the other come out as one stream: continuity
+ * counters run on across slices, the pat/pmt a slice starts with are
+ * dropped when they repeat the current ones, a changed table gets the
+ * next version, null packets are dropped
+ */
+typedef struct {
+    uint8_t cc[TS_PID_NUM];  /* last counter sent, 0xff none yet */
+    int head;                /* still in the tables a slice starts with */
+    int discontinuity;       /* mark the next pcr, the slices are not back to back */
+    int pmt_pid;
+    int pat_version;         /* -1 none sent yet */
+    int pmt_version;
+    int pat_len;
+    int pmt_len;
+    uint8_t pat[TS_PKT_LEN]; /* sections of the current tables */
+    uint8_t pmt[TS_PKT_LEN];
+} ts_concat_t;
+
+extern void ts_concat_init(ts_concat_t *c);
+/* before the first packet of each slice, gap when it does not follow the last one */
+extern void ts_concat_slice(ts_concat_t *c, int gap);
+/* one packet of the slice to out, returns TS_PKT_LEN, 0 when dropped, -1 not ts */
+extern int ts_concat_packet(ts_concat_t *c, const uint8_t *in, uint8_t *out);
+
+#define _TS_PARSE_H
+#endif
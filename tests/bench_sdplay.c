@@ -0,0 +1,548 @@
+/**
+* @file tests/bench_sdplay.c
+* @author rigensen
+* @brief storage benchmark, ingest / lookup / segment list / retention
+*        against synthetic indexes of days to months of recordings,
+*        playback end to end over the loopback transport.
+*        results are json lines, one object per measurement
+* @date 二 10/22 10:12:40 2019
+*/
+
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "sdplay.h"
+#include "transfer.h"
+#include "transfer_loopback.h"
+#include "P2PCam/AVIOCTRLDEFs.h"
+#include "dbg.h"
+
+#define MAX_DAYS_NUM 16
+#define TOUCH_TS_COUNT 64 /* slices that really exist on disk, enough for retention rounds */
+#define PLAYBACK_CHANNEL 1 /* real slices for playback live on their own channel */
+#define WAIT_TIMEOUT_MS 30000
+
+typedef struct {
+    int days[MAX_DAYS_NUM];
+    int days_num;
+    int slice_sec;
+    int segment_sec;
+    int ingest_count;
+    int ts_size;
+    int lookup_count;
+    int retention_count;
+    int playback_slices;
+    int playback_ts_size;
+    int playback_rounds;
+    int latency_us;
+    int64_t bandwidth_bps;
+    const char *work_dir;
+    const char *out_file;
+} bench_opt_t;
+
+typedef struct {
+    int n;
+    double avg;
+    int64_t min, p50, p90, p99, max;
+} bench_stat_t;
+
+static bench_opt_t g_opt = {
+    .days = { 1, 7, 30 },
+    .days_num = 3,
+    .slice_sec = 10,
+    .segment_sec = 600,
+    .ingest_count = 500,
+    .ts_size = 64*1024,
+    .lookup_count = 2000,
+    .retention_count = 20,
+    .playback_slices = 30,
+    .playback_ts_size = 512*1024,
+    .playback_rounds = 5,
+    .work_dir = "./bench_data",
+    .out_file = "bench_result.json",
+};
+
+/* frame header on the wire, see doc/protocol.md */
+typedef struct {
+    unsigned int index;
+    unsigned int endflag;
+    unsigned int utctime;
+    unsigned int length;
+} bench_frame_hdr_t;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int slices;
+    int list_resp;
+    int64_t first_frame_us;
+    int64_t bytes;
+} bench_recv_t;
+
+static FILE *g_out;
+static int g_list_sid;
+static bench_recv_t g_recv = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static int64_t get_time_us()
+{
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return tp.tv_sec*(int64_t)1000000 + tp.tv_nsec/1000;
+}
+
+static void frame_cb(int ch, const uint8_t *hdr, int hdr_len, const uint8_t *data, int len, void *arg)
+{
+    const bench_frame_hdr_t *frame_hdr = (const bench_frame_hdr_t *)hdr;
+
+    (void)ch;
+    (void)data;
+    (void)arg;
+    pthread_mutex_lock(&g_recv.mutex);
+    if (!g_recv.first_frame_us)
+        g_recv.first_frame_us = get_time_us();
+    g_recv.bytes += len;
+    if (hdr_len >= (int)sizeof(bench_frame_hdr_t) && frame_hdr->endflag)
+        g_recv.slices++;
+    pthread_cond_broadcast(&g_recv.cond);
+    pthread_mutex_unlock(&g_recv.mutex);
+}
+
+/* a list may come in several packets, only the last one counts */
+static void ioctl_cb(int ch, unsigned int cmd, const char *data, int size, void *arg)
+{
+    (void)ch;
+    (void)size;
+    (void)arg;
+    if (cmd != LST_USER_IPCAM_LISTEVENT_RESP || !((const SMsgAVIoctrlListEventResp *)data)->endflag)
+        return;
+    pthread_mutex_lock(&g_recv.mutex);
+    g_recv.list_resp++;
+    pthread_cond_broadcast(&g_recv.cond);
+    pthread_mutex_unlock(&g_recv.mutex);
+}
+
+static void reset_recv()
+{
+    pthread_mutex_lock(&g_recv.mutex);
+    g_recv.slices = 0;
+    g_recv.list_resp = 0;
+    g_recv.first_frame_us = 0;
+    g_recv.bytes = 0;
+    pthread_mutex_unlock(&g_recv.mutex);
+}
+
+/* wait until *counter reaches target, counters are protected by g_recv.mutex */
+static int wait_recv(int *counter, int target)
+{
+    struct timespec abstime;
+    struct timeval now;
+    int ret = 0;
+
+    gettimeofday(&now, NULL);
+    abstime.tv_sec = now.tv_sec + WAIT_TIMEOUT_MS/1000;
+    abstime.tv_nsec = now.tv_usec*1000;
+    pthread_mutex_lock(&g_recv.mutex);
+    while (*counter < target && ret == 0)
+        ret = pthread_cond_timedwait(&g_recv.cond, &g_recv.mutex, &abstime);
+    ret = *counter >= target ? 0 : -1;
+    pthread_mutex_unlock(&g_recv.mutex);
+    return ret;
+}
+
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+    return x < y ? -1 : (x > y);
+}
+
+static void calc_stat(int64_t *samples, int n, bench_stat_t *st)
+{
+    int i = 0;
+    int64_t sum = 0;
+
+    memset(st, 0, sizeof(*st));
+    if (n <= 0)
+        return;
+    qsort(samples, n, sizeof(int64_t), cmp_int64);
+    for (i = 0; i < n; i++)
+        sum += samples[i];
+    st->n = n;
+    st->avg = (double)sum/n;
+    st->min = samples[0];
+    st->p50 = samples[n*50/100];
+    st->p90 = samples[n*90/100];
+    st->p99 = samples[n*99/100];
+    st->max = samples[n-1];
+}
+
+static void emit(const char *bench, int days, int records, bench_stat_t *st, const char *extra)
+{
+    fprintf(g_out, "{\"bench\":\"%s\",\"days\":%d,\"records\":%d,\"n\":%d,"
+            "\"avg_us\":%.1f,\"min_us\":%"PRId64",\"p50_us\":%"PRId64","
+            "\"p90_us\":%"PRId64",\"p99_us\":%"PRId64",\"max_us\":%"PRId64"%s%s}\n",
+            bench, days, records, st->n, st->avg, st->min, st->p50, st->p90, st->p99, st->max,
+            extra ? "," : "", extra ? extra : "");
+    fflush(g_out);
+    fprintf(stderr, "%-12s days:%-4d records:%-8d p50:%"PRId64"us p99:%"PRId64"us\n",
+            bench, days, records, st->p50, st->p99);
+}
+
+static void clean_db()
+{
+    char file[64] = {0};
+    int i = 0;
+
+    remove("tsindexdb");
+    remove("segmentdb");
+    for (i = 0; i <= 0xff; i++) {
+        snprintf(file, sizeof(file), "segmentdb_ev%02x", i);
+        remove(file);
+    }
+}
+
+/*
+ * ts index is written directly, months of slices as real files would
+ * take longer to create than to benchmark
+ */
+static int gen_ts_index(int base, int days)
+{
+    FILE *fp = fopen("tsindexdb", "w");
+    int i = 0, count = days*86400/g_opt.slice_sec;
+    char name[64] = {0};
+
+    if (!fp) {
+        LOGE("open tsindexdb error");
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        int starttime = base + i*g_opt.slice_sec;
+
+        snprintf(name, sizeof(name), "%d-%d.ts", starttime, starttime+g_opt.slice_sec);
+        fprintf(fp, "%s\n", name);
+        if (i < TOUCH_TS_COUNT) {
+            FILE *ts = fopen(name, "w");
+
+            if (ts)
+                fclose(ts);
+        }
+    }
+    fclose(fp);
+    return count;
+}
+
+static int gen_segments(int base, int days)
+{
+    static const int events[] = {
+        AVIOCTRL_EVENT_MOTIONDECT,
+        AVIOCTRL_EVENT_IOALARM,
+        AVIOCTRL_EVENT_FULLTIME_RECORDING,
+        AVIOCTRL_EVENT_PIR,
+    };
+    int t = base, end = base + days*86400, count = 0;
+
+    while (t < end) {
+        int len = g_opt.segment_sec/2 + rand()%g_opt.segment_sec;
+
+        if (sdp_save_segment_info(0, t, t+len, events[count%4]) < 0)
+            return -1;
+        t += len + 1;
+        count++;
+    }
+    return count;
+}
+
+static void bench_ingest(int days, int records, int starttime)
+{
+    uint8_t *buf = (uint8_t *)calloc(1, g_opt.ts_size);
+    int64_t *samples = (int64_t *)calloc(g_opt.ingest_count, sizeof(int64_t));
+    int64_t begin = 0, total = 0;
+    bench_stat_t st;
+    char extra[128] = {0};
+    int i = 0;
+
+    if (!buf || !samples)
+        goto out;
+    for (i = 0; i < g_opt.ingest_count; i++) {
+        int t = starttime + i*g_opt.slice_sec;
+        char name[64] = {0};
+
+        begin = get_time_us();
+        sdp_save_ts(0, buf, g_opt.ts_size, t, t+g_opt.slice_sec);
+        samples[i] = get_time_us() - begin;
+        total += samples[i];
+        snprintf(name, sizeof(name), "%d-%d.ts", t, t+g_opt.slice_sec);
+        remove(name);
+    }
+    calc_stat(samples, g_opt.ingest_count, &st);
+    snprintf(extra, sizeof(extra), "\"ts_size\":%d,\"slices_per_sec\":%.1f,\"mb_per_sec\":%.2f",
+            g_opt.ts_size,
+            total ? g_opt.ingest_count*1e6/total : 0,
+            total ? (double)g_opt.ingest_count*g_opt.ts_size/total : 0);
+    emit("ingest", days, records, &st, extra);
+out:
+    free(buf);
+    free(samples);
+}
+
+static void bench_lookup(int days, int records, int base)
+{
+    int64_t *samples = (int64_t *)calloc(g_opt.lookup_count, sizeof(int64_t));
+    int64_t begin = 0;
+    bench_stat_t st;
+    char ts_file[64] = {0}, extra[64] = {0};
+    int i = 0, miss = 0;
+
+    if (!samples)
+        return;
+    for (i = 0; i < g_opt.lookup_count; i++) {
+        int t = base + rand()%(days*86400);
+
+        begin = get_time_us();
+        if (sdp_find_ts(0, t, ts_file, sizeof(ts_file)) < 0)
+            miss++;
+        samples[i] = get_time_us() - begin;
+    }
+    calc_stat(samples, g_opt.lookup_count, &st);
+    snprintf(extra, sizeof(extra), "\"miss\":%d", miss);
+    emit("lookup", days, records, &st, extra);
+    free(samples);
+}
+
+static void bench_segment_list(int days, int segments, int base)
+{
+    static const struct {
+        const char *name;
+        int window;
+        int event;
+    } cases[] = {
+        { "list_hour", 3600, AVIOCTRL_EVENT_ALL },
+        { "list_day", 86400, AVIOCTRL_EVENT_ALL },
+        { "list_day_pir", 86400, AVIOCTRL_EVENT_PIR },
+    };
+    int64_t samples[64];
+    int64_t begin = 0;
+    bench_stat_t st;
+    char extra[64] = {0};
+    int i = 0, j = 0, fail = 0, end = base + days*86400;
+
+    for (j = 0; j < (int)(sizeof(cases)/sizeof(cases[0])); j++) {
+        fail = 0;
+        for (i = 0; i < 64; i++) {
+            int t = base + rand()%(end - base - cases[j].window + 1);
+
+            SMsgAVIoctrlListEventReq req;
+
+            memset(&req, 0, sizeof(req));
+            req.channel = 0;
+            req.event = cases[j].event;
+            req.utcStartTime = t;
+            req.utcEndTime = t+cases[j].window;
+            reset_recv();
+            begin = get_time_us();
+            if (lst_loopback_push_ioctl(g_list_sid, LST_USER_IPCAM_LISTEVENT_REQ, &req, sizeof(req)) < 0
+                    || wait_recv(&g_recv.list_resp, 1) < 0)
+                fail++;
+            samples[i] = get_time_us() - begin;
+        }
+        calc_stat(samples, 64, &st);
+        snprintf(extra, sizeof(extra), "\"window\":%d,\"fail\":%d", cases[j].window, fail);
+        emit(cases[j].name, days, segments, &st, extra);
+    }
+}
+
+static void bench_retention(int days, int records)
+{
+    int64_t *samples = (int64_t *)calloc(g_opt.retention_count, sizeof(int64_t));
+    int64_t begin = 0;
+    bench_stat_t st;
+    int i = 0;
+
+    if (!samples)
+        return;
+    for (i = 0; i < g_opt.retention_count; i++) {
+        begin = get_time_us();
+        sdp_release_space();
+        samples[i] = get_time_us() - begin;
+    }
+    calc_stat(samples, g_opt.retention_count, &st);
+    emit("retention", days, records, &st, NULL);
+    free(samples);
+}
+
+/*
+ * start playback from the first slice and wait for all of them,
+ * every round uses a new session like a reconnecting app does
+ */
+static void bench_playback()
+{
+    uint8_t *buf = (uint8_t *)calloc(1, g_opt.playback_ts_size);
+    int64_t *start_samples = (int64_t *)calloc(g_opt.playback_rounds, sizeof(int64_t));
+    int64_t *total_samples = (int64_t *)calloc(g_opt.playback_rounds, sizeof(int64_t));
+    int base = 1600000000, i = 0, n = 0, fail = 0;
+    int64_t begin = 0, bytes = 0, total = 0;
+    bench_stat_t st;
+    char extra[256] = {0};
+
+    if (!buf || !start_samples || !total_samples)
+        goto out;
+    for (i = 0; i < g_opt.playback_slices; i++) {
+        int t = base + i*g_opt.slice_sec;
+
+        memset(buf, i, g_opt.playback_ts_size);
+        sdp_save_ts(PLAYBACK_CHANNEL, buf, g_opt.playback_ts_size, t, t+g_opt.slice_sec);
+    }
+    lst_loopback_set_link(g_opt.latency_us, g_opt.bandwidth_bps);
+    for (i = 0; i < g_opt.playback_rounds; i++) {
+        SMsgAVIoctrlPlayRecord req;
+        int sid = lst_loopback_connect();
+
+        if (sid < 0)
+            break;
+        memset(&req, 0, sizeof(req));
+        req.channel = PLAYBACK_CHANNEL;
+        req.command = AVIOCTRL_RECORD_PLAY_START;
+        req.utcTime = base;
+        reset_recv();
+        begin = get_time_us();
+        if (lst_loopback_push_ioctl(sid, LST_USER_IPCAM_RECORD_PLAYCONTROL, &req, sizeof(req)) < 0
+                || wait_recv(&g_recv.slices, g_opt.playback_slices) < 0) {
+            fail++;
+        } else {
+            pthread_mutex_lock(&g_recv.mutex);
+            start_samples[n] = g_recv.first_frame_us - begin;
+            total_samples[n] = get_time_us() - begin;
+            bytes += g_recv.bytes;
+            total += total_samples[n];
+            pthread_mutex_unlock(&g_recv.mutex);
+            n++;
+        }
+        lst_loopback_disconnect(sid);
+    }
+    lst_loopback_set_link(0, 0);
+    snprintf(extra, sizeof(extra), "\"fail\":%d,\"ts_size\":%d,\"latency_us\":%d,"
+            "\"bandwidth_bps\":%"PRId64",\"mb_per_sec\":%.2f",
+            fail, g_opt.playback_ts_size, g_opt.latency_us, g_opt.bandwidth_bps,
+            total ? (double)bytes/total : 0);
+    calc_stat(start_samples, n, &st);
+    emit("play_start", 0, g_opt.playback_slices, &st, extra);
+    calc_stat(total_samples, n, &st);
+    emit("play_total", 0, g_opt.playback_slices, &st, extra);
+    for (i = 0; i < g_opt.playback_slices; i++) {
+        char name[64] = {0};
+        int t = base + i*g_opt.slice_sec;
+
+        snprintf(name, sizeof(name), "%d-%d_ch%d.ts", t, t+g_opt.slice_sec, PLAYBACK_CHANNEL);
+        remove(name);
+    }
+    remove("tsindexdb_ch1");
+out:
+    free(buf);
+    free(start_samples);
+    free(total_samples);
+}
+
+static int parse_days(char *arg)
+{
+    char *tok = NULL, *save = NULL;
+
+    g_opt.days_num = 0;
+    for (tok = strtok_r(arg, ",", &save); tok && g_opt.days_num < MAX_DAYS_NUM; tok = strtok_r(NULL, ",", &save)) {
+        if (atoi(tok) <= 0)
+            return -1;
+        g_opt.days[g_opt.days_num++] = atoi(tok);
+    }
+    return g_opt.days_num ? 0 : -1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-d days,days...] [-s slice_sec] [-g segment_sec] [-n ingest_count]\n"
+            "          [-k ts_size] [-l lookup_count] [-r retention_count] [-p work_dir] [-o out_file]\n"
+            "          [-P playback_slices] [-K playback_ts_size] [-R playback_rounds]\n"
+            "          [-L latency_us] [-B bandwidth_bps]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt = 0, i = 0, base = 1500000000;
+
+    while ((opt = getopt(argc, argv, "d:s:g:n:k:l:r:p:o:P:K:R:L:B:h")) != -1) {
+        switch (opt) {
+        case 'd':
+            if (parse_days(optarg) < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 's': g_opt.slice_sec = atoi(optarg); break;
+        case 'g': g_opt.segment_sec = atoi(optarg); break;
+        case 'n': g_opt.ingest_count = atoi(optarg); break;
+        case 'k': g_opt.ts_size = atoi(optarg); break;
+        case 'l': g_opt.lookup_count = atoi(optarg); break;
+        case 'r': g_opt.retention_count = atoi(optarg); break;
+        case 'p': g_opt.work_dir = optarg; break;
+        case 'o': g_opt.out_file = optarg; break;
+        case 'P': g_opt.playback_slices = atoi(optarg); break;
+        case 'K': g_opt.playback_ts_size = atoi(optarg); break;
+        case 'R': g_opt.playback_rounds = atoi(optarg); break;
+        case 'L': g_opt.latency_us = atoi(optarg); break;
+        case 'B': g_opt.bandwidth_bps = strtoll(optarg, NULL, 10); break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (g_opt.slice_sec <= 0 || g_opt.segment_sec <= 0 || g_opt.ingest_count <= 0
+            || g_opt.ts_size <= 0 || g_opt.lookup_count <= 0 || g_opt.retention_count <= 0
+            || g_opt.playback_slices <= 0 || g_opt.playback_ts_size <= 0 || g_opt.playback_rounds <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if ( (g_out = fopen(g_opt.out_file, "w")) == NULL ) {
+        LOGE("open %s error", g_opt.out_file);
+        return 1;
+    }
+    mkdir(g_opt.work_dir, 0755);
+    if (chdir(g_opt.work_dir) < 0) {
+        LOGE("chdir %s error", g_opt.work_dir);
+        return 1;
+    }
+    /* fixed seed and base time, two runs replay the same queries */
+    srand(1);
+    clean_db();
+    lst_set_transport(&lst_loopback_transport);
+    lst_loopback_set_callbacks(frame_cb, ioctl_cb, NULL);
+    sdp_init( ".", ".", "CVUUBN1MP9BWAN6GU1MJ", "admin", "123456" );
+    if ( (g_list_sid = lst_loopback_connect()) < 0 )
+        return 1;
+    bench_playback();
+    for (i = 0; i < g_opt.days_num; i++) {
+        int days = g_opt.days[i], records = 0, segments = 0;
+
+        clean_db();
+        if ( (records = gen_ts_index(base, days)) < 0 )
+            break;
+        if ( (segments = gen_segments(base, days)) < 0 )
+            break;
+        bench_lookup(days, records, base);
+        bench_segment_list(days, segments, base);
+        bench_ingest(days, records, base + days*86400);
+        bench_retention(days, records);
+    }
+    clean_db();
+    fclose(g_out);
+
+    return 0;
+}
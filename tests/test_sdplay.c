@@ -11,8 +11,21 @@
 #include <string.h>
 #include <stdlib.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include "sdplay.h"
+#include "P2PCam/AVIOCTRLDEFs.h"
 #include "dbg.h"
+#include "digest.h"
+#include "md5.h"
+#include "metrics.h"
+#include "transfer.h"
+#include "scheduler.h"
+#include "slice_cache.h"
+#include "preroll.h"
+#include "ts_parse.h"
+#include "thumb.h"
+#include "transfer_loopback.h"
 
 int64_t gettime_ms()
 {
@@ -30,12 +43,487 @@ void test_save_ts()
 
     sdp_init( ".", ".", "CVUUBN1MP9BWAN6GU1MJ", "admin", "123456" );
 
-    ret = sdp_save_ts( ts_buf, 6, 12, 34 );
+    ret = sdp_save_ts( 0, ts_buf, 6, 12, 34 );
     if ( ret < 0 ) {
         LOGE("check ret error");
     }
 }
 
+void test_digest()
+{
+    static const struct {
+        int algo;
+        const char *in;
+        const char *out;
+    } cases[] = {
+        { DIGEST_MD5, "", "d41d8cd98f00b204e9800998ecf8427e" },
+        { DIGEST_MD5, "abc", "900150983cd24fb0d6963f7d28e17f72" },
+        { DIGEST_CRC32C, "123456789", "e3069283" },
+        { DIGEST_XXH32, "", "02cc5d05" },
+        { DIGEST_XXH32, "abc", "32d153ff" },
+        { DIGEST_XXH32, "Nobody inspects the spammish repetition", "e2293b2f" },
+    };
+    char out[DIGEST_STR_LEN];
+    int i = 0;
+
+    for (i = 0; i < (int)(sizeof(cases)/sizeof(cases[0])); i++) {
+        memset(out, 0, sizeof(out));
+        digest_calc(cases[i].algo, (const uint8_t *)cases[i].in, strlen(cases[i].in), out);
+        if (strcmp(out, cases[i].out))
+            LOGE("digest %d of \"%s\": %s, expect %s", cases[i].algo, cases[i].in, out, cases[i].out);
+    }
+}
+
+/* multi buffer and chunked, unaligned writes must match one shot md5 */
+void test_md5()
+{
+    static unsigned char data[7][1000];
+    const unsigned char *bufs[7];
+    size_t lens[7] = { 1000, 999, 640, 64, 0, 130, 577 };
+    unsigned char out[7][16], ref[16];
+    MD5_CONTEXT ctx;
+    size_t off = 0, n = 0;
+    int i = 0, j = 0;
+
+    for (i = 0; i < 7; i++) {
+        for (j = 0; j < 1000; j++)
+            data[i][j] = (unsigned char)(i*131 + j*7);
+        /* odd offsets to take the unaligned path */
+        bufs[i] = data[i] + (i & 1);
+    }
+    md5_multi(bufs, lens, out, 7);
+    for (i = 0; i < 7; i++) {
+        md5_init(&ctx);
+        md5_write(&ctx, (unsigned char *)bufs[i], lens[i]);
+        md5_final(&ctx);
+        memcpy(ref, ctx.buf, 16);
+        if (memcmp(ref, out[i], 16))
+            LOGE("md5_multi lane %d mismatch", i);
+
+        md5_init(&ctx);
+        for (off = 0; off < lens[i]; off += n) {
+            n = (off % 97) + 1;
+            if (n > lens[i] - off)
+                n = lens[i] - off;
+            md5_write(&ctx, (unsigned char *)bufs[i] + off, n);
+        }
+        md5_final(&ctx);
+        if (memcmp(ref, ctx.buf, 16))
+            LOGE("chunked md5 of lane %d mismatch", i);
+    }
+}
+
+void test_metrics()
+{
+    metrics_report_t before, after;
+    metrics_hist_report_t *h = NULL;
+    int i = 0;
+
+    metrics_report(&before);
+    /* 90 fast samples and 10 slow ones */
+    for (i = 0; i < 90; i++)
+        metrics_observe(METRIC_HIST_SEGMENT_LIST, 100);
+    for (i = 0; i < 10; i++)
+        metrics_observe(METRIC_HIST_SEGMENT_LIST, 5000);
+    metrics_inc(METRIC_BYTES_SENT, 1234);
+    metrics_report(&after);
+    h = &after.hists[METRIC_HIST_SEGMENT_LIST];
+    if (h->count - before.hists[METRIC_HIST_SEGMENT_LIST].count != 100)
+        LOGE("hist count %u", h->count);
+    if (!before.hists[METRIC_HIST_SEGMENT_LIST].count
+            && (h->p50_us != 128 || h->p90_us != 128 || h->p99_us != 8192 || h->max_us != 5000))
+        LOGE("p50 %u p90 %u p99 %u max %u", h->p50_us, h->p90_us, h->p99_us, h->max_us);
+    if (after.counters[METRIC_BYTES_SENT] - before.counters[METRIC_BYTES_SENT] != 1234)
+        LOGE("bytes_sent counter");
+}
+
+/* sdplay's own requests reach cmd_handle on the sdk backends too */
+void test_map_iotype()
+{
+    static const unsigned int reqs[] = { LST_USER_SDP_METRICS_REQ, LST_USER_SDP_THUMB_REQ,
+        LST_USER_SDP_EXPORT_REQ };
+    int i = 0;
+
+    for (i = 0; i < (int)(sizeof(reqs)/sizeof(reqs[0])); i++) {
+        if (lst_map_iotype(reqs[i]) != reqs[i])
+            LOGE("iotype 0x%x is dropped", reqs[i]);
+    }
+}
+
+void test_login_wait()
+{
+    int64_t begin = gettime_ms();
+
+    /* nobody logged in yet, must time out instead of spinning */
+    if (lst_wait_login(50) != LST_ERR_TIMEOUT || gettime_ms() - begin < 50)
+        LOGE("lst_wait_login before init");
+    lst_set_transport(&lst_loopback_transport);
+    lst_init("CVUUBN1MP9BWAN6GU1MJ", "admin", "123456", 1);
+    if (lst_wait_login(-1) != 0)
+        LOGE("lst_wait_login after init");
+}
+
+static int g_sched_stop;
+
+static void *sched_sender(void *arg)
+{
+    int sid = (int)(intptr_t)arg;
+    int64_t sent = 0;
+
+    while (!__atomic_load_n(&g_sched_stop, __ATOMIC_RELAXED)) {
+        if (sched_acquire(sid, SCHED_UPLINK, 10000) < 0)
+            break;
+        sent += 10000;
+    }
+    return (void *)(intptr_t)sent;
+}
+
+void test_sched()
+{
+    pthread_t tid[2];
+    void *sent[2];
+    int i = 0;
+
+    /* 8Mbps for playback, 2 of them taken by live view, weights 2:1 */
+    sched_set_limit(SCHED_UPLINK, 8000000);
+    sched_set_live(2000000);
+    sched_set_session(0, 2, 0);
+    sched_set_session(1, 1, 0);
+    sched_join(0);
+    sched_join(1);
+    if (sched_get_rate(0, SCHED_UPLINK) != 4000000 || sched_get_rate(1, SCHED_UPLINK) != 2000000)
+        LOGE("rate %lld %lld", (long long)sched_get_rate(0, SCHED_UPLINK), (long long)sched_get_rate(1, SCHED_UPLINK));
+    /* a cap below the share gives the rest to the other */
+    sched_set_session(1, 1, 1000000);
+    if (sched_get_rate(0, SCHED_UPLINK) != 5000000)
+        LOGE("capped rate %lld", (long long)sched_get_rate(0, SCHED_UPLINK));
+    sched_set_session(1, 1, 0);
+    for (i = 0; i < 2; i++)
+        pthread_create(&tid[i], NULL, sched_sender, (void *)(intptr_t)i);
+    usleep(500*1000);
+    __atomic_store_n(&g_sched_stop, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < 2; i++)
+        pthread_join(tid[i], &sent[i]);
+    /* 250KB and 125KB in 0.5s, give or take the first packet */
+    if ((intptr_t)sent[0] < 200000 || (intptr_t)sent[0] > 280000
+            || (intptr_t)sent[1] < 90000 || (intptr_t)sent[1] > 150000)
+        LOGE("sent %ld %ld", (long)(intptr_t)sent[0], (long)(intptr_t)sent[1]);
+    sched_cancel(0);
+    if (sched_acquire(0, SCHED_UPLINK, 1) != -1)
+        LOGE("cancel");
+    sched_leave(0);
+    sched_leave(1);
+    /* an export only gets the background share while a playback runs */
+    sched_set_background(2, 1);
+    sched_join(1);
+    sched_join(2);
+    if (sched_get_rate(2, SCHED_UPLINK) != 6000000*SCHED_BACKGROUND_PERCENT/100)
+        LOGE("background rate %lld", (long long)sched_get_rate(2, SCHED_UPLINK));
+    sched_leave(1);
+    if (sched_get_rate(2, SCHED_UPLINK) != 6000000)
+        LOGE("background alone %lld", (long long)sched_get_rate(2, SCHED_UPLINK));
+    sched_leave(2);
+    sched_reset_session(2);
+    sched_set_live(0);
+    sched_set_limit(SCHED_UPLINK, 0);
+}
+
+static int g_cache_loads = 0;
+
+static int cache_load(const char *name, void *arg, uint8_t **buf, int *size)
+{
+    g_cache_loads++;
+    *size = 1024;
+    *buf = (uint8_t *)calloc(1, *size);
+    return *buf ? 0 : -1;
+}
+
+void test_slice_cache()
+{
+    slice_cache_entry_t *a = NULL, *b = NULL;
+    uint8_t data[1024] = {0};
+    char digest[DIGEST_STR_LEN] = {0}, expect[DIGEST_STR_LEN] = {0};
+
+    /* two readers of one slice load it once */
+    slice_cache_set_limit(4096);
+    slice_cache_get("/tmp/cache_a", cache_load, NULL, &a);
+    slice_cache_get("/tmp/cache_a", cache_load, NULL, &b);
+    if (g_cache_loads != 1 || a != b)
+        LOGE("loads %d", g_cache_loads);
+    digest_calc(DIGEST_CRC32C, data, sizeof(data), expect);
+    slice_cache_digest(a, DIGEST_CRC32C, digest);
+    if (strcmp(digest, expect))
+        LOGE("digest %s", digest);
+    slice_cache_put(a);
+    slice_cache_put(b);
+    /* a written slice is warm, a removed one reads the card again */
+    slice_cache_insert("/tmp/cache_b", data, sizeof(data));
+    slice_cache_get("/tmp/cache_b", cache_load, NULL, &a);
+    slice_cache_put(a);
+    slice_cache_invalidate("/tmp/cache_a");
+    slice_cache_get("/tmp/cache_a", cache_load, NULL, &a);
+    slice_cache_put(a);
+    if (g_cache_loads != 2)
+        LOGE("loads %d", g_cache_loads);
+    /* no room, the least recently used one goes */
+    slice_cache_set_limit(1024);
+    slice_cache_get("/tmp/cache_b", cache_load, NULL, &a);
+    slice_cache_put(a);
+    if (g_cache_loads != 3)
+        LOGE("loads %d", g_cache_loads);
+    slice_cache_set_limit(SLICE_CACHE_DEFAULT_BYTES);
+}
+
+static int preroll_collect(const uint8_t *buf, int size, int starttime, int endtime, void *arg)
+{
+    int *n = (int *)arg;
+
+    /* every slice was filled with its start time */
+    if (buf[0] != (uint8_t)starttime || buf[size-1] != (uint8_t)starttime)
+        LOGE("slice %d corrupted", starttime);
+    n[n[0]+1] = starttime;
+    n[0]++;
+    return 0;
+}
+
+void test_preroll()
+{
+    preroll_ring_t ring;
+    uint8_t buf[400];
+    int i = 0, got[8] = {0};
+
+    /* 1000 bytes, 3s: slices of 400 bytes wrap, 2 fit at a time */
+    preroll_init(&ring, 1000, 3);
+    for (i = 0; i < 5; i++) {
+        memset(buf, i, sizeof(buf));
+        preroll_push(&ring, buf, sizeof(buf), i, i+1);
+    }
+    if (preroll_oldest(&ring) != 3)
+        LOGE("oldest %d", preroll_oldest(&ring));
+    preroll_drain(&ring, preroll_collect, got);
+    if (got[0] != 2 || got[1] != 3 || got[2] != 4 || preroll_oldest(&ring) != -1)
+        LOGE("drained %d: %d %d", got[0], got[1], got[2]);
+    /* and by time, 1s slices over 3s */
+    for (i = 0; i < 5; i++) {
+        memset(buf, i, sizeof(buf));
+        preroll_push(&ring, buf, 100, i, i+1);
+    }
+    if (preroll_oldest(&ring) != 2)
+        LOGE("oldest %d", preroll_oldest(&ring));
+    if (preroll_push(&ring, buf, 1001, 5, 6) >= 0)
+        LOGE("too big");
+    preroll_free(&ring);
+}
+
+static void put_pts(uint8_t *p, int64_t pts)
+{
+    p[0] = 0x21 | ((pts >> 29) & 0x0e);
+    p[1] = (pts >> 22) & 0xff;
+    p[2] = ((pts >> 14) & 0xfe) | 1;
+    p[3] = (pts >> 7) & 0xff;
+    p[4] = ((pts << 1) & 0xfe) | 1;
+}
+
+/*
+ * pat, pmt, then h264 frames of two video packets and an audio packet,
+ * 25fps with an idr every kf_every frames. returns the size
+ */
+int make_test_ts(uint8_t *out, int frames, int kf_every, int64_t pts)
+{
+    static const uint8_t pat[] = { 0x47, 0x40, 0x00, 0x10, 0x00, 0x00, 0xb0, 0x0d, 0x00, 0x01, 0xc1, 0x00, 0x00,
+        0x00, 0x01, 0xf0, 0x00, 0x00, 0x00, 0x00, 0x00 };
+    static const uint8_t pmt[] = { 0x47, 0x50, 0x00, 0x10, 0x00, 0x02, 0xb0, 0x12, 0x00, 0x01, 0xc1, 0x00, 0x00,
+        0xe1, 0x00, 0xf0, 0x00, 0x1b, 0xe1, 0x00, 0xf0, 0x00, 0x00, 0x00, 0x00, 0x00 };
+    static const uint8_t pes[] = { 0x00, 0x00, 0x01, 0xe0, 0x00, 0x00, 0x80, 0x80, 0x05, 0, 0, 0, 0, 0,
+        0x00, 0x00, 0x00, 0x01, 0x09, 0xf0, 0x00, 0x00, 0x00, 0x01 };
+    uint8_t *p = out;
+    int i = 0;
+
+    memset(out, 0xff, (2 + frames*3)*TS_PKT_LEN);
+    memcpy(p, pat, sizeof(pat));
+    p += TS_PKT_LEN;
+    memcpy(p, pmt, sizeof(pmt));
+    p += TS_PKT_LEN;
+    for (i = 0; i < frames; i++) {
+        p[0] = 0x47; p[1] = 0x41; p[2] = 0x00; p[3] = 0x10 | ((i*2) & 0x0f);
+        memcpy(p + 4, pes, sizeof(pes));
+        put_pts(p + 4 + 9, pts + i*TS_PTS_HZ/25);
+        p[4 + sizeof(pes)] = i % kf_every ? 0x41 : 0x65;
+        p += TS_PKT_LEN;
+        p[0] = 0x47; p[1] = 0x01; p[2] = 0x00; p[3] = 0x10 | ((i*2+1) & 0x0f);
+        p += TS_PKT_LEN;
+        p[0] = 0x47; p[1] = 0x41; p[2] = 0x01; p[3] = 0x10 | (i & 0x0f);
+        p += TS_PKT_LEN;
+    }
+    return (int)(p - out);
+}
+
+void test_ts_keyframe()
+{
+    static uint8_t ts[(2+50*3)*TS_PKT_LEN], out[sizeof(ts)];
+    ts_keyframe_t kf;
+    int size = make_test_ts(ts, 50, 25, 900000), len = 0;
+
+    if (ts_next_keyframe(ts, size, 0, &kf) < 0 || kf.off != 2*TS_PKT_LEN
+            || kf.end != 4*TS_PKT_LEN || kf.pts != 900000)
+        LOGE("keyframe %d-%d pts %lld", kf.off, kf.end, (long long)kf.pts);
+    if (ts_next_keyframe(ts, size, kf.end, &kf) < 0 || kf.pts != 900000 + TS_PTS_HZ)
+        LOGE("second keyframe pts %lld", (long long)kf.pts);
+    /* pat, pmt and the two video packets, the audio one is left out */
+    len = ts_copy_keyframe(ts, size, &kf, out, sizeof(out));
+    if (len != 4*TS_PKT_LEN || memcmp(out + 2*TS_PKT_LEN, ts + kf.off, 2*TS_PKT_LEN))
+        LOGE("copy %d", len);
+    if (ts_next_keyframe(ts, size, kf.end, &kf) == 0)
+        LOGE("no third keyframe");
+}
+
+/* mpeg crc32 over a section with its crc is 0 */
+static uint32_t test_crc32_mpeg(const uint8_t *buf, int len)
+{
+    uint32_t crc = 0xffffffff;
+    int i = 0;
+
+    while (len--) {
+        crc ^= (uint32_t)*buf++ << 24;
+        for (i = 0; i < 8; i++)
+            crc = crc & 0x80000000 ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+    }
+    return crc;
+}
+
+void test_ts_concat()
+{
+    static uint8_t ts[(2+10*3)*TS_PKT_LEN], out[3*sizeof(ts)];
+    ts_concat_t c;
+    int size = 0, len = 0, i = 0, off = 0, n = 0, pid = 0, pats = 0, pmts = 0;
+    int cc[2] = { -1, -1 };
+
+    ts_concat_init(&c);
+    for (i = 0; i < 3; i++) {
+        size = make_test_ts(ts, 10, 25, 900000 + i*10*TS_PTS_HZ/25);
+        /* the encoder went h265 for the last slice, the version was left alone */
+        if (i == 2)
+            ts[TS_PKT_LEN + 17] = 0x24;
+        ts_concat_slice(&c, 0);
+        for (off = 0; off < size; off += TS_PKT_LEN) {
+            if ( (n = ts_concat_packet(&c, ts + off, out + len)) > 0 )
+                len += n;
+        }
+    }
+    if (len != (2 + 1 + 3*10*3)*TS_PKT_LEN)
+        LOGE("concat len %d", len);
+    for (off = 0; off < len; off += TS_PKT_LEN) {
+        pid = ((out[off+1] & 0x1f) << 8) | out[off+2];
+        if (pid == 0) {
+            pats++;
+        } else if (pid == 0x1000) {
+            if (pmts++ && (((out[off+10] >> 1) & 0x1f) != 1 || test_crc32_mpeg(out + off + 5, 3 + 0x12)))
+                LOGE("changed pmt version %d", (out[off+10] >> 1) & 0x1f);
+        } else if (pid == 0x100 || pid == 0x101) {
+            if (cc[pid-0x100] >= 0 && (out[off+3] & 0x0f) != ((cc[pid-0x100] + 1) & 0x0f))
+                LOGE("pid 0x%x cc %d after %d", pid, out[off+3] & 0x0f, cc[pid-0x100]);
+            cc[pid-0x100] = out[off+3] & 0x0f;
+        }
+    }
+    if (pats != 1 || pmts != 2)
+        LOGE("pat %d pmt %d", pats, pmts);
+}
+
+static int count_thumb(int time, const uint8_t *buf, int size, void *arg)
+{
+    int *times = (int *)arg;
+
+    times[++times[0]] = time;
+    return 0;
+}
+
+void test_thumb()
+{
+    thumb_store_t store;
+    uint8_t buf[1000] = {0};
+    int times[8] = {0}, t = 0;
+
+    remove("./thumbtest");
+    remove("./thumbtest.idx");
+    remove("./thumbtest.old");
+    remove("./thumbtest.idx.old");
+    thumb_store_init(&store, "./thumbtest");
+    for (t = 100; t < 200; t += 5) {
+        if (thumb_store_want(&store, t))
+            thumb_store_add(&store, t, buf, sizeof(buf));
+    }
+    /* every 10s, from the first at or after 125 */
+    if (thumb_store_query(&store, 125, 165, 8, 1 << 20, count_thumb, times) != 4
+            || times[1] != 130 || times[4] != 160)
+        LOGE("thumbs %d: %d..%d", times[0], times[1], times[times[0]]);
+    memset(times, 0, sizeof(times));
+    if (thumb_store_query(&store, 0, 1000, 8, 2500, count_thumb, times) != 2)
+        LOGE("thumbs by bytes %d", times[0]);
+    /* reopened, the interval goes on from the last one */
+    thumb_store_init(&store, "./thumbtest");
+    if (thumb_store_want(&store, 195) || !thumb_store_want(&store, 200))
+        LOGE("last time %d", store.last_time);
+}
+
+/* sdp_init starts threads that live on, every test shares one */
+static void test_sdp_init()
+{
+    static int inited = 0;
+
+    if (inited)
+        return;
+    inited = 1;
+    lst_set_transport(&lst_loopback_transport);
+    sdp_init( ".", ".", "CVUUBN1MP9BWAN6GU1MJ", "admin", "123456" );
+}
+
+static void write_file(const char *name, const char *data)
+{
+    FILE *fp = fopen(name, "w");
+
+    if (!fp) {
+        LOGE("open %s error", name);
+        return;
+    }
+    fputs(data, fp);
+    fclose(fp);
+}
+
+/* must run before anything else calls sdp_init */
+void test_recover()
+{
+    const char *want = "1600000010-1600000020_ch2.ts\n1600000020-1600000030_ch2.ts\n";
+    char buf[256] = {0};
+    FILE *fp = NULL;
+    size_t n = 0;
+    int i = 0;
+
+    write_file("./1600000010-1600000020_ch2.ts", "ts");
+    write_file("./1600000020-1600000030_ch2.ts", "ts");
+    /* still being written when recovery looks at it */
+    write_file("./1600000030-1600000040_ch2.ts", "");
+    /* head slice evicted, tail torn */
+    write_file("./tsindexdb_ch2", "1600000000-1600000010_ch2.ts\n1600000010-1600000020_ch2.ts\n16000000");
+    test_sdp_init();
+    for (i = 0; i < 200; i++) {
+        if ( (fp = fopen("./tsindexdb_ch2", "r")) != NULL ) {
+            n = fread(buf, 1, sizeof(buf)-1, fp);
+            buf[n] = '\0';
+            fclose(fp);
+            if (strcmp(buf, want) == 0)
+                break;
+        }
+        usleep(10*1000);
+    }
+    if (strcmp(buf, want) != 0)
+        LOGE("rebuilt index:\n%s", buf);
+    if (access("./1600000030-1600000040_ch2.ts", F_OK) != 0)
+        LOGE("recovery removed a slice");
+    remove("./1600000010-1600000020_ch2.ts");
+    remove("./1600000020-1600000030_ch2.ts");
+    remove("./1600000030-1600000040_ch2.ts");
+}
+
 int gen_rand_num()
 {
     return(rand()%360+30);
@@ -46,19 +534,592 @@ void test_segment()
     int t = (int)(gettime_ms()/1000)-60*30,i,num;
 
     remove("./segmentdb");
-    sdp_init( ".", ".", "CVUUBN1MP9BWAN6GU1MJ", "admin", "123456" );
+    test_sdp_init();
     srand((unsigned int)time((time_t *)NULL));
     for (i=0; i<20; i++) {
         num = gen_rand_num();
         LOGI("%d-%d",t, t+num);
-        sdp_save_segment_info(t, t+num); 
+        sdp_save_segment_info(0, t, t+num, AVIOCTRL_EVENT_MOTIONDECT); 
         t += num;
     }
 }
 
+void test_snapshot()
+{
+    sdp_snapshot_t *snap = NULL;
+    sdp_cursor_t cur;
+    sdp_slice_rec_t slice;
+    sdp_segment_rec_t seg;
+    FILE *fp = NULL;
+    int t = 0, n = 0;
+
+    mkdir("./snaptest", 0755);
+    fp = fopen("./snaptest/tsindexdb_ch1", "w");
+    for (t = 1600000000; t < 1600000100; t += 10)
+        fprintf(fp, "%d-%d_ch1.ts\n", t, t+10);
+    fprintf(fp, "1600000100-16000"); /* an append half way */
+    fclose(fp);
+    fp = fopen("./snaptest/segmentdb_ch1", "w");
+    fprintf(fp, "1600000000-1600000030-01\n1600000040-1600000050-03\n1600000060-1600000090-01\n");
+    fclose(fp);
+    if ( !(snap = sdp_snapshot_open("./snaptest", 1)) ) {
+        LOGE("open snapshot error");
+        return;
+    }
+    /* not seen by the open snapshot */
+    fp = fopen("./snaptest/tsindexdb_ch1", "a");
+    fprintf(fp, "00110.ts\n1600000110-1600000120_ch1.ts\n");
+    fclose(fp);
+    sdp_snapshot_slices(snap, 1600000025, 1600001000, &cur);
+    while (sdp_snapshot_next_slice(&cur, &slice) == 0) {
+        if (n++ == 0 && (slice.starttime != 1600000020
+                    || slice.name_len != 28 || strncmp(slice.name, "1600000020-1600000030_ch1.ts", 28)))
+            LOGE("first slice %d %.*s", slice.starttime, slice.name_len, slice.name);
+    }
+    if (n != 8)
+        LOGE("slices %d", n);
+    n = 0;
+    sdp_snapshot_segments(snap, 1600000035, 1600000070, AVIOCTRL_EVENT_MOTIONDECT, &cur);
+    while (sdp_snapshot_next_segment(&cur, &seg) == 0)
+        n++;
+    if (n != 1 || seg.starttime != 1600000060)
+        LOGE("segments %d %d", n, seg.starttime);
+    sdp_snapshot_close(snap);
+
+    /* a long motion segment still runs past the short ones of other types after it */
+    fp = fopen("./snaptest/segmentdb_ch1", "w");
+    fprintf(fp, "1600000100-1600000500-01\n1600000150-1600000160-02\n1600000200-1600000210-03\n"
+            "1600000450-1600000460-02\n");
+    fclose(fp);
+    if ( !(snap = sdp_snapshot_open("./snaptest", 1)) ) {
+        LOGE("open snapshot error");
+        return;
+    }
+    n = 0;
+    sdp_snapshot_segments(snap, 1600000300, 1600000400, AVIOCTRL_EVENT_ALL, &cur);
+    while (sdp_snapshot_next_segment(&cur, &seg) == 0)
+        t = n++ ? 0 : seg.starttime;
+    if (n != 1 || t != 1600000100)
+        LOGE("overlapping segments %d %d", n, t);
+    n = 0;
+    sdp_snapshot_segments(snap, 1600000155, 1600000455, AVIOCTRL_EVENT_ALL, &cur);
+    while (sdp_snapshot_next_segment(&cur, &seg) == 0)
+        n++;
+    if (n != 4)
+        LOGE("overlapping segments %d", n);
+    sdp_snapshot_close(snap);
+}
+
+typedef struct {
+    int results[8];  /* of the play control replies, in order */
+    int replies;
+    int ends;
+    int frames;      /* sent after the second reply */
+    int last_time;
+} stepback_state_t;
+
+static stepback_state_t g_stepback;
+
+static void stepback_frame(int ch, const uint8_t *hdr, int hdr_len, const uint8_t *data, int len, void *arg)
+{
+    unsigned int utctime = 0;
+
+    memcpy(&utctime, hdr + 8, sizeof(utctime));
+    if (__atomic_load_n(&g_stepback.replies, __ATOMIC_ACQUIRE) >= 2) {
+        g_stepback.frames++;
+        g_stepback.last_time = utctime;
+    }
+}
+
+static void stepback_ioctl(int ch, unsigned int cmd, const char *data, int size, void *arg)
+{
+    const SMsgAVIoctrlPlayRecordResp *res = (const SMsgAVIoctrlPlayRecordResp *)data;
+
+    if (cmd != LST_USER_IPCAM_RECORD_PLAYCONTROL_RESP)
+        return;
+    if (res->command == AVIOCTRL_RECORD_PLAY_END) {
+        __atomic_add_fetch(&g_stepback.ends, 1, __ATOMIC_RELEASE);
+    } else if (g_stepback.replies < 8) {
+        g_stepback.results[g_stepback.replies] = res->result;
+        __atomic_add_fetch(&g_stepback.replies, 1, __ATOMIC_RELEASE);
+    }
+}
+
+/* STEPBACKWARD while a forward playback runs takes it over, no STOP needed */
+void test_stepback()
+{
+    static uint8_t ts[(2+150*3)*TS_PKT_LEN];
+    SMsgAVIoctrlPlayRecord req;
+    int base = 1700000000, i = 0, size = 0, sid = 0;
+
+    test_sdp_init();
+    for (i = 0; i < 30; i++) {
+        size = make_test_ts(ts, 150, 25, (int64_t)TS_PTS_HZ*6*i);
+        sdp_save_ts(3, ts, size, base+i*6, base+i*6+6);
+    }
+    memset(&g_stepback, 0, sizeof(g_stepback));
+    lst_loopback_set_callbacks(stepback_frame, stepback_ioctl, NULL);
+    /* a slice takes about 0.3s, the forward playback is still going */
+    lst_loopback_set_link(0, 2*1000*1000);
+    sid = lst_loopback_connect();
+    usleep(100*1000);
+    memset(&req, 0, sizeof(req));
+    req.command = AVIOCTRL_RECORD_PLAY_START;
+    req.channel = 3;
+    req.utcTime = base;
+    lst_loopback_push_ioctl(sid, LST_USER_IPCAM_RECORD_PLAYCONTROL, &req, sizeof(req));
+    usleep(500*1000);
+    req.command = AVIOCTRL_RECORD_PLAY_STEPBACKWARD;
+    req.utcTime = base+60;
+    lst_loopback_push_ioctl(sid, LST_USER_IPCAM_RECORD_PLAYCONTROL, &req, sizeof(req));
+    for (i = 0; i < 500 && __atomic_load_n(&g_stepback.ends, __ATOMIC_ACQUIRE) < 2; i++)
+        usleep(10*1000);
+    if (g_stepback.replies != 2 || g_stepback.results[0] < 0 || g_stepback.results[1] < 0)
+        LOGE("replies %d, results %d %d", g_stepback.replies, g_stepback.results[0], g_stepback.results[1]);
+    /* the stopped forward playback and the step each end */
+    if (g_stepback.ends != 2 || g_stepback.frames != 1
+            || g_stepback.last_time >= base+60 || g_stepback.last_time < base+54)
+        LOGE("ends %d, frames %d at %d", g_stepback.ends, g_stepback.frames, g_stepback.last_time);
+    lst_loopback_disconnect(sid);
+    lst_loopback_set_link(0, 0);
+    lst_loopback_set_callbacks(NULL, NULL, NULL);
+}
+
+/* reserved[1] flags of the play request and the frame header, see doc/protocol.md */
+#define PKT_CRC_FLAG 0x01
+#define PLAY_FOLLOW_FLAG 0x02
+#define PLAY_GAP_FLAG 0x08
+#define FRAME_GAP_FLAG 0x02
+#define FRAME_FLAGS_OFFSET (16+DIGEST_STR_LEN+1)
+#define FRAME_HDR_LEN 52 /* without pkt_crc */
+
+typedef struct {
+    int base;
+    /*
+     * start of each slice from base, +index of each packet after its
+     * first and [gap_start-gap_end] of each marker
+     */
+    char trace[512];
+    int ends;
+    int frames;
+    int crc_ok;      /* frames with PKT_CRC_FLAG and a matching pkt_crc */
+} play_state_t;
+
+static play_state_t g_play;
+
+static void play_frame(int ch, const uint8_t *hdr, int hdr_len, const uint8_t *data, int len, void *arg)
+{
+    sdp_gap_marker_t marker;
+    unsigned int index = 0, utctime = 0;
+    size_t n = strlen(g_play.trace);
+
+    uint32_t crc = 0;
+
+    memcpy(&index, hdr, sizeof(index));
+    memcpy(&utctime, hdr + 8, sizeof(utctime));
+    g_play.frames++;
+    if ((hdr[FRAME_FLAGS_OFFSET] & PKT_CRC_FLAG) && hdr_len == FRAME_HDR_LEN+4) {
+        memcpy(&crc, hdr + FRAME_HDR_LEN, sizeof(crc));
+        g_play.crc_ok += crc == digest_crc32c(0, data, len);
+    }
+    if ((hdr[FRAME_FLAGS_OFFSET] & FRAME_GAP_FLAG) && len == sizeof(marker)) {
+        memcpy(&marker, data, sizeof(marker));
+        snprintf(g_play.trace+n, sizeof(g_play.trace)-n, "[%d-%d] ",
+                (int)marker.gap_start-g_play.base, (int)marker.gap_end-g_play.base);
+    } else if (index == 0) {
+        snprintf(g_play.trace+n, sizeof(g_play.trace)-n, "%d ", (int)utctime-g_play.base);
+    } else {
+        snprintf(g_play.trace+n, sizeof(g_play.trace)-n, "+%u ", index);
+    }
+}
+
+static void play_ioctl(int ch, unsigned int cmd, const char *data, int size, void *arg)
+{
+    const SMsgAVIoctrlPlayRecordResp *res = (const SMsgAVIoctrlPlayRecordResp *)data;
+
+    if (cmd == LST_USER_IPCAM_RECORD_PLAYCONTROL_RESP && res->command == AVIOCTRL_RECORD_PLAY_END)
+        __atomic_add_fetch(&g_play.ends, 1, __ATOMIC_RELEASE);
+}
+
+static void play_control(int sid, int command, int channel, int time, int param, int flags)
+{
+    SMsgAVIoctrlPlayRecord req;
+
+    memset(&req, 0, sizeof(req));
+    req.command = command;
+    req.channel = channel;
+    req.utcTime = time;
+    req.Param = param;
+    req.reserved[1] = flags;
+    lst_loopback_push_ioctl(sid, LST_USER_IPCAM_RECORD_PLAYCONTROL, &req, sizeof(req));
+}
+
+static int play_connect(int base)
+{
+    int sid = 0;
+
+    memset(&g_play, 0, sizeof(g_play));
+    g_play.base = base;
+    lst_loopback_set_callbacks(play_frame, play_ioctl, NULL);
+    sid = lst_loopback_connect();
+    usleep(100*1000);
+    return sid;
+}
+
+static int play_start(int channel, int base, int start, int flags)
+{
+    int sid = play_connect(base);
+
+    play_control(sid, AVIOCTRL_RECORD_PLAY_START, channel, base+start, 0, flags);
+    return sid;
+}
+
+static void play_end(int sid)
+{
+    int i = 0;
+
+    for (i = 0; i < 500 && !__atomic_load_n(&g_play.ends, __ATOMIC_ACQUIRE); i++)
+        usleep(10*1000);
+    if (!g_play.ends)
+        LOGE("playback did not end, %s", g_play.trace);
+    lst_loopback_disconnect(sid);
+    lst_loopback_set_callbacks(NULL, NULL, NULL);
+}
+
+/* plays channel from base+start on a session of its own until the end */
+static const char *play_trace(int channel, int base, int start, int flags)
+{
+    play_end(play_start(channel, base, start, flags));
+    return g_play.trace;
+}
+
+static void save_test_slices(int channel, int base, int from, int to)
+{
+    static uint8_t ts[(2+50*3)*TS_PKT_LEN];
+    int t = 0, size = 0;
+
+    for (t = from; t < to; t += 6) {
+        size = make_test_ts(ts, 50, 25, (int64_t)TS_PTS_HZ*t);
+        sdp_save_ts(channel, ts, size, base+t, base+t+6);
+    }
+}
+
+static void check_trace(const char *name, const char *trace, const char *want)
+{
+    if (strcmp(trace, want) != 0)
+        LOGE("%s: %s, want %s", name, trace, want);
+}
+
+/* PLAY_GAP_FLAG only plays what the segments cover, and marks the rest */
+void test_gap()
+{
+    int base = 1710000000;
+
+    test_sdp_init();
+    /* nothing recorded from 60 to 90 */
+    save_test_slices(1, base, 0, 60);
+    save_test_slices(1, base, 90, 120);
+    /* a short segment of another type inside a long one, their ends are not in order */
+    sdp_save_segment_info(1, base, base+24, AVIOCTRL_EVENT_MOTIONDECT);
+    sdp_save_segment_info(1, base+6, base+10, AVIOCTRL_EVENT_VIDEOLOST);
+    sdp_save_segment_info(1, base+36, base+48, AVIOCTRL_EVENT_MOTIONDECT);
+    sdp_save_segment_info(1, base+96, base+120, AVIOCTRL_EVENT_MOTIONDECT);
+    /* inside the long segment, after the short one ended */
+    check_trace("in a segment", play_trace(1, base, 14, PLAY_GAP_FLAG),
+            "12 18 [24-36] 36 42 [48-96] 96 102 108 114 ");
+    /* between two segments, the marker starts at the time asked for */
+    check_trace("in a hole", play_trace(1, base, 27, PLAY_GAP_FLAG), "[27-36] 36 42 [48-96] 96 102 108 114 ");
+    check_trace("after the last segment", play_trace(1, base, 121, PLAY_GAP_FLAG), "");
+
+    /* no segments, only what is not recorded is passed over */
+    save_test_slices(2, base, 0, 30);
+    save_test_slices(2, base, 60, 72);
+    check_trace("no segments", play_trace(2, base, 3, PLAY_GAP_FLAG), "0 6 12 18 24 [30-60] 60 66 ");
+    check_trace("no segments, in a hole", play_trace(2, base, 40, PLAY_GAP_FLAG), "[40-60] 60 66 ");
+    check_trace("no flag", play_trace(2, base, 3, 0), "0 6 12 18 24 60 66 ");
+}
+
+#define LIST_SHORT_SEGMENTS (9216+34)
+
+typedef struct {
+    int packets;    /* of the last reply */
+    int total;
+    int events;
+    int last_start;
+    int done;
+    int bad;        /* packet out of order or total changed */
+    unsigned char seen[1+LIST_SHORT_SEGMENTS];
+} list_state_t;
+
+static list_state_t g_list;
+
+static void list_ioctl(int ch, unsigned int cmd, const char *data, int size, void *arg)
+{
+    const SMsgAVIoctrlListEventResp *res = (const SMsgAVIoctrlListEventResp *)data;
+    int base = *(int *)arg, i = 0, idx = 0;
+
+    if (cmd != LST_USER_IPCAM_LISTEVENT_RESP)
+        return;
+    if (res->index != g_list.packets || (g_list.packets && res->total != g_list.total))
+        g_list.bad++;
+    g_list.packets++;
+    g_list.total = res->total;
+    for (i = 0; i < res->count; i++) {
+        /* the long one first, the short ones every 10s from base+1 */
+        idx = res->stEvent[i].utcStartTime == base ? 0 : ((int)res->stEvent[i].utcStartTime-base-1)/10+1;
+        if (idx >= 0 && idx <= LIST_SHORT_SEGMENTS)
+            g_list.seen[idx] = 1;
+        g_list.last_start = res->stEvent[i].utcStartTime;
+        g_list.events++;
+    }
+    if (res->endflag)
+        __atomic_store_n(&g_list.done, 1, __ATOMIC_RELEASE);
+}
+
+static void list_segments(int sid, int channel, int starttime, int endtime)
+{
+    SMsgAVIoctrlListEventReq req;
+    int i = 0;
+
+    g_list.packets = g_list.total = g_list.events = g_list.done = 0;
+    memset(&req, 0, sizeof(req));
+    req.channel = channel;
+    req.utcStartTime = starttime;
+    req.utcEndTime = endtime;
+    req.event = AVIOCTRL_EVENT_ALL;
+    lst_loopback_push_ioctl(sid, LST_USER_IPCAM_LISTEVENT_REQ, &req, sizeof(req));
+    for (i = 0; i < 500 && !__atomic_load_n(&g_list.done, __ATOMIC_ACQUIRE); i++)
+        usleep(10*1000);
+    if (!g_list.done)
+        LOGE("list of %d-%d not done", starttime, endtime);
+}
+
+/* more segments than one reply holds, the app asks again from the start of the last one */
+void test_segment_list()
+{
+    static int base = 1720000000;
+    int i = 0, sid = 0, missing = 0;
+
+    test_sdp_init();
+    /* runs past every short one */
+    sdp_save_segment_info(3, base, base+LIST_SHORT_SEGMENTS*10+100, AVIOCTRL_EVENT_MOTIONDECT);
+    for (i = 0; i < LIST_SHORT_SEGMENTS; i++)
+        sdp_save_segment_info(3, base+1+i*10, base+6+i*10, AVIOCTRL_EVENT_VIDEOLOST);
+    memset(&g_list, 0, sizeof(g_list));
+    lst_loopback_set_callbacks(NULL, list_ioctl, &base);
+    sid = lst_loopback_connect();
+    usleep(100*1000);
+    list_segments(sid, 3, base-1000, base-900);
+    if (g_list.packets != 1 || g_list.total != 0 || g_list.events != 0)
+        LOGE("empty window: packets %d, total %d", g_list.packets, g_list.total);
+    list_segments(sid, 3, base, base+LIST_SHORT_SEGMENTS*10+1000);
+    if (g_list.packets != 256 || g_list.total != 9216 || g_list.events != 9216)
+        LOGE("first reply: packets %d, total %d, events %d", g_list.packets, g_list.total, g_list.events);
+    list_segments(sid, 3, g_list.last_start, base+LIST_SHORT_SEGMENTS*10+1000);
+    /* the long one and the last one of the first reply again, then the rest */
+    if (g_list.packets != 2 || g_list.total != 37 || g_list.events != 37)
+        LOGE("second reply: packets %d, total %d, events %d", g_list.packets, g_list.total, g_list.events);
+    for (i = 0; i <= LIST_SHORT_SEGMENTS; i++)
+        missing += !g_list.seen[i];
+    if (missing || g_list.bad)
+        LOGE("missing %d, bad packets %d", missing, g_list.bad);
+    lst_loopback_disconnect(sid);
+    lst_loopback_set_callbacks(NULL, NULL, NULL);
+}
+
+/* the records of index from base on, as start-end from base */
+static void index_trace(const char *index, int base, char *out, int size)
+{
+    char line[128];
+    FILE *fp = fopen(index, "r");
+    int start = 0, end = 0, n = 0;
+
+    out[0] = '\0';
+    if (!fp)
+        return;
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "%d-%d", &start, &end) == 2 && start >= base && n < size)
+            n += snprintf(out+n, size-n, "%d-%d ", start-base, end-base);
+    }
+    fclose(fp);
+}
+
+static void save_test_slice(int channel, int frames, int starttime, int endtime)
+{
+    static uint8_t ts[(2+1800*3)*TS_PKT_LEN];
+    int size = make_test_ts(ts, frames, 25, (int64_t)TS_PTS_HZ*starttime);
+
+    if (sdp_save_ts(channel, ts, size, starttime, endtime) < 0)
+        LOGE("save %d-%d error", starttime, endtime);
+}
+
+/* each channel has an index and a segment list of its own, the card is shared */
+void test_channels()
+{
+    int base1 = 1590000000, base3 = 1595000000;
+    char trace[256] = {0};
+
+    test_sdp_init();
+    save_test_slices(1, base1, 0, 18);
+    save_test_slices(3, base3, 0, 12);
+    sdp_save_segment_info(1, base1, base1+18, AVIOCTRL_EVENT_MOTIONDECT);
+    sdp_save_segment_info(3, base3+6, base3+12, AVIOCTRL_EVENT_MOTIONDECT);
+    index_trace("./tsindexdb_ch1", base1, trace, sizeof(trace));
+    if (strcmp(trace, "0-6 6-12 12-18 ") != 0)
+        LOGE("index of channel 1: %s", trace);
+    index_trace("./segmentdb_ch1", base1, trace, sizeof(trace));
+    if (strcmp(trace, "0-18 ") != 0)
+        LOGE("segments of channel 1: %s", trace);
+    index_trace("./tsindexdb_ch3", base1, trace, sizeof(trace));
+    if (strcmp(trace, "5000000-5000006 5000006-5000012 ") != 0)
+        LOGE("index of channel 3: %s", trace);
+    index_trace("./segmentdb_ch3", base1, trace, sizeof(trace));
+    if (strcmp(trace, "5000006-5000012 ") != 0)
+        LOGE("segments of channel 3: %s", trace);
+    /* channel 1 has the oldest slice, two go at a time */
+    sdp_release_space();
+    index_trace("./tsindexdb_ch1", base1, trace, sizeof(trace));
+    if (strcmp(trace, "12-18 ") != 0 || access("./1590000000-1590000006_ch1.ts", F_OK) == 0
+            || access("./1590000012-1590000018_ch1.ts", F_OK) != 0)
+        LOGE("channel 1 after the first eviction: %s", trace);
+    index_trace("./tsindexdb_ch3", base1, trace, sizeof(trace));
+    if (strcmp(trace, "5000000-5000006 5000006-5000012 ") != 0)
+        LOGE("channel 3 after the first eviction: %s", trace);
+    /* the rest of channel 1 is still older than channel 3 */
+    sdp_release_space();
+    sdp_release_space();
+    index_trace("./tsindexdb_ch1", base1, trace, sizeof(trace));
+    if (trace[0])
+        LOGE("channel 1 after three evictions: %s", trace);
+    index_trace("./tsindexdb_ch3", base1, trace, sizeof(trace));
+    if (trace[0] || access("./1595000006-1595000012_ch3.ts", F_OK) == 0)
+        LOGE("channel 3 after three evictions: %s", trace);
+}
+
+/* back to back short slices are stored as one file with one index record */
+void test_coalesce()
+{
+    int base = 1730000000, t = 0;
+    char trace[256] = {0};
+
+    test_sdp_init();
+    sdp_set_coalesce(0, 10, 0);
+    for (t = 0; t < 10; t += 2)
+        save_test_slice(0, 50, base+t, base+t+2);
+    index_trace("./tsindexdb", base, trace, sizeof(trace));
+    if (strcmp(trace, "0-10 ") != 0 || access("./1730000000-1730000010.ts", F_OK) != 0
+            || access("./1730000000-1730000002.ts", F_OK) == 0)
+        LOGE("merged: %s", trace);
+    /* a hole ends the merge */
+    save_test_slice(0, 50, base+10, base+12);
+    save_test_slice(0, 50, base+14, base+16);
+    index_trace("./tsindexdb", base, trace, sizeof(trace));
+    if (strcmp(trace, "0-10 10-12 ") != 0)
+        LOGE("discontinuity: %s", trace);
+    sdp_flush_ts(0);
+    index_trace("./tsindexdb", base, trace, sizeof(trace));
+    if (strcmp(trace, "0-10 10-12 14-16 ") != 0)
+        LOGE("flush: %s", trace);
+    /* about 1MB each, the ninth does not fit COALESCE_MAX_BYTES */
+    sdp_set_coalesce(0, 3600, 0);
+    for (t = 20; t < 29; t++)
+        save_test_slice(0, 1800, base+t, base+t+1);
+    index_trace("./tsindexdb", base, trace, sizeof(trace));
+    if (strcmp(trace, "0-10 10-12 14-16 20-28 ") != 0)
+        LOGE("max bytes: %s", trace);
+    /* turning it off stores what waits, and every slice after it on its own */
+    sdp_set_coalesce(0, 0, 0);
+    save_test_slice(0, 50, base+29, base+30);
+    index_trace("./tsindexdb", base, trace, sizeof(trace));
+    if (strcmp(trace, "0-10 10-12 14-16 20-28 28-29 29-30 ") != 0)
+        LOGE("off: %s", trace);
+}
+
+/* a follower at the end of the index gets the slices saved after it */
+void test_follow()
+{
+    int base = 1740000000, sid = 0, i = 0;
+
+    test_sdp_init();
+    save_test_slices(1, base, 0, 12);
+    sid = play_start(1, base, 12, PLAY_FOLLOW_FLAG);
+    usleep(200*1000);
+    if (strcmp(g_play.trace, "6 ") != 0 || g_play.ends)
+        LOGE("before the new slice: %s, ends %d", g_play.trace, g_play.ends);
+    save_test_slices(1, base, 12, 18);
+    for (i = 0; i < 200 && strcmp(g_play.trace, "6 12 ") != 0; i++)
+        usleep(10*1000);
+    if (strcmp(g_play.trace, "6 12 ") != 0 || g_play.ends)
+        LOGE("after the new slice: %s, ends %d", g_play.trace, g_play.ends);
+    play_control(sid, AVIOCTRL_RECORD_PLAY_STOP, 1, 0, 0, 0);
+    play_end(sid);
+}
+
+/* every frame carries the crc32c of its data, gap markers too */
+void test_pkt_crc()
+{
+    int base = 1710000000;
+
+    /* channel 2 of test_gap, nothing recorded from 30 to 60 */
+    check_trace("crc", play_trace(2, base, 3, PKT_CRC_FLAG|PLAY_GAP_FLAG), "0 6 12 18 24 [30-60] 60 66 ");
+    if (g_play.crc_ok != 8 || g_play.frames != 8)
+        LOGE("crc of %d frames out of %d", g_play.crc_ok, g_play.frames);
+    play_trace(2, base, 3, 0);
+    if (g_play.crc_ok != 0 || g_play.frames != 7)
+        LOGE("crc without the flag, %d frames out of %d", g_play.crc_ok, g_play.frames);
+}
+
+/* SDP_RECORD_PLAY_RESUME resends a slice from the packet the app is missing */
+void test_resume()
+{
+    static uint8_t ts[(2+2000*3)*TS_PKT_LEN];
+    int base = 1750000000, i = 0, size = 0, sid = 0;
+
+    test_sdp_init();
+    /* a bit over MAX_PKT_SIZE, two packets each */
+    for (i = 0; i < 3; i++) {
+        size = make_test_ts(ts, 2000, 25, (int64_t)TS_PTS_HZ*6*i);
+        sdp_save_ts(2, ts, size, base+i*6, base+i*6+6);
+    }
+    /* no playback, it starts from that packet */
+    sid = play_connect(base);
+    play_control(sid, SDP_RECORD_PLAY_RESUME, 2, base+6, 1, 0);
+    play_end(sid);
+    check_trace("resume", g_play.trace, "+1 12 +1 ");
+    /* during playback, once the slice being sent is done */
+    lst_loopback_set_link(0, 16*1000*1000);
+    sid = play_start(2, base, 0, 0);
+    usleep(300*1000);
+    play_control(sid, SDP_RECORD_PLAY_RESUME, 2, base, 1, 0);
+    play_end(sid);
+    lst_loopback_set_link(0, 0);
+    check_trace("resume while playing", g_play.trace, "0 +1 +1 6 +1 12 +1 ");
+}
+
 int main(int argc, char *argv[])
 {
+    test_digest();
+    test_md5();
+    test_metrics();
+    test_login_wait();
+    test_map_iotype();
+    test_sched();
+    test_slice_cache();
+    test_preroll();
+    test_ts_keyframe();
+    test_ts_concat();
+    test_thumb();
+    test_recover();
+    test_channels();
     test_segment();
+    test_snapshot();
+    test_stepback();
+    test_gap();
+    test_segment_list();
+    test_coalesce();
+    test_follow();
+    test_pkt_crc();
+    test_resume();
     for(;;) 
         sleep(1);
     